@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <stdatomic.h>
+
+#include <msgpack.h>
+
+#include <fluent-bit/flb_lib.h>
+#include <fluent-bit/flb_config.h>
+#include <fluent-bit/flb_output.h>
+#include <fluent-bit/flb_output_plugin.h>
+#include <fluent-bit/flb_time.h>
+
+#include <pulsar/c/client.h>
+#include "pulsar_context.h"
+#include "pulsar_json.h"
+#include "mock_pulsar.h"
+
+/*
+ * Flush benchmark of out_pulsar: synthetic chunks are sent through
+ * flb_pulsar_flush_chunk(), the body of cb_pulsar_flush(), with the pulsar
+ * client replaced by mock_pulsar.c. Allocations are counted by wrapping
+ * malloc/calloc/realloc at link time, so only the calls made by the plugin
+ * sources (and the inline flb_mem.h helpers they use) are accounted, not
+ * the ones inside libfluent-bit.
+ */
+
+#define BENCH_TAG  "bench.logs"
+
+extern struct flb_output_plugin out_pulsar_plugin;
+
+static atomic_uint_fast64_t bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+struct bench_options {
+    int records;          // records per chunk
+    int chunks;           // chunks flushed per scenario
+    int sync_window;      // syncSendWindow of the sync runs
+    int stripes;          // producerStripes
+    uint32_t ack_latency_us;
+    double error_rate;
+};
+
+typedef void (*bench_shape_func)(msgpack_packer *pck, int i);
+
+struct bench_shape {
+    const char *name;
+    bench_shape_func pack;
+};
+
+static void pack_str(msgpack_packer *pck, const char *str)
+{
+    size_t len = strlen(str);
+    msgpack_pack_str(pck, len);
+    msgpack_pack_str_body(pck, str, len);
+}
+
+// short access log line
+static void shape_small(msgpack_packer *pck, int i)
+{
+    char log[128];
+
+    snprintf(log, sizeof(log), "GET /api/v1/items/%d HTTP/1.1 200 %d \"-\" \"curl/7.88\"", i, 100 + i % 900);
+    msgpack_pack_map(pck, 2);
+    pack_str(pck, "log");
+    pack_str(pck, log);
+    pack_str(pck, "stream");
+    pack_str(pck, "stdout");
+}
+
+// container log enriched by the kubernetes filter
+static void shape_kubernetes(msgpack_packer *pck, int i)
+{
+    char log[256];
+
+    snprintf(log, sizeof(log), "{\"level\":\"info\",\"msg\":\"request served\",\"id\":%d,\"latency_ms\":%d.%03d}\n",
+             i, i % 50, i % 1000);
+    msgpack_pack_map(pck, 4);
+    pack_str(pck, "log");
+    pack_str(pck, log);
+    pack_str(pck, "stream");
+    pack_str(pck, "stdout");
+    pack_str(pck, "time");
+    pack_str(pck, "2023-06-01T12:00:00.123456789Z");
+    pack_str(pck, "kubernetes");
+    msgpack_pack_map(pck, 6);
+    pack_str(pck, "pod_name");
+    pack_str(pck, "checkout-7d9c8b6f5-x2x9q");
+    pack_str(pck, "namespace_name");
+    pack_str(pck, "shop");
+    pack_str(pck, "pod_id");
+    pack_str(pck, "6f1c2d8a-3b4e-4f5a-9c6d-7e8f9a0b1c2d");
+    pack_str(pck, "container_name");
+    pack_str(pck, "checkout");
+    pack_str(pck, "host");
+    pack_str(pck, "ip-10-0-12-34.ec2.internal");
+    pack_str(pck, "labels");
+    msgpack_pack_map(pck, 3);
+    pack_str(pck, "app");
+    pack_str(pck, "checkout");
+    pack_str(pck, "pod-template-hash");
+    pack_str(pck, "7d9c8b6f5");
+    pack_str(pck, "tier");
+    pack_str(pck, "backend");
+}
+
+// multi-line stack trace with escapes and non-ASCII text, about 4KB
+static void shape_large(msgpack_packer *pck, int i)
+{
+    int n;
+    size_t len = 0;
+    char log[4096];
+
+    len += snprintf(log, sizeof(log), "java.lang.IllegalStateException: order %d \"failed\" – état invalide\n", i);
+    for (n = 0; len < sizeof(log) - 128; n++) {
+        len += snprintf(log + len, sizeof(log) - len,
+                        "\tat com.example.shop.checkout.OrderService.process(OrderService.java:%d)\n", 100 + n);
+    }
+    msgpack_pack_map(pck, 3);
+    pack_str(pck, "log");
+    msgpack_pack_str(pck, len);
+    msgpack_pack_str_body(pck, log, len);
+    pack_str(pck, "stream");
+    pack_str(pck, "stderr");
+    pack_str(pck, "level");
+    pack_str(pck, "error");
+}
+
+static struct bench_shape bench_shapes[] = {
+    { "small", shape_small },
+    { "kubernetes", shape_kubernetes },
+    { "large", shape_large },
+};
+
+// a chunk as produced by the input plugins: concatenated [timestamp, record] events
+static void bench_build_chunk(msgpack_sbuffer *sbuf, bench_shape_func pack, int records)
+{
+    int i;
+    struct flb_time tm;
+    msgpack_packer pck;
+
+    msgpack_sbuffer_init(sbuf);
+    msgpack_packer_init(&pck, sbuf, msgpack_sbuffer_write);
+    flb_time_get(&tm);
+    for (i = 0; i < records; i++) {
+        msgpack_pack_array(&pck, 2);
+        flb_time_append_to_msgpack(&tm, &pck, 0);
+        pack(&pck, i);
+    }
+}
+
+static uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static struct flb_output_instance *bench_instance(struct flb_config *config, struct bench_options *opts,
+                                                  const char *schema, bool async)
+{
+    char window[16];
+    char stripes[16];
+    struct flb_output_plugin *plugin;
+    struct flb_output_instance *ins;
+
+    // registered like an external plugin: the config owns a copy
+    plugin = flb_malloc(sizeof(struct flb_output_plugin));
+    if (!plugin) {
+        return NULL;
+    }
+    memcpy(plugin, &out_pulsar_plugin, sizeof(struct flb_output_plugin));
+    mk_list_add(&plugin->_head, &config->out_plugins);
+
+    ins = flb_output_new(config, "pulsar", NULL, FLB_TRUE);
+    if (!ins) {
+        return NULL;
+    }
+
+    // the async modes need a worker, the flushes are still called from the benchmark thread
+    flb_output_set_property(ins, "workers", "1");
+    flb_output_set_property(ins, "log_level", "warn");
+    flb_output_set_property(ins, PULSAR_KEY_BROKER_URL, "pulsar://mock:6650");
+    flb_output_set_property(ins, PULSAR_KEY_TOPIC_NAME, "persistent://bench/bench/logs");
+    flb_output_set_property(ins, OUTPUT_KEY_DATA_SCHEMA, schema);
+    flb_output_set_property(ins, PULSAR_KEY_ASYNC_SEND, async ? "true" : "false");
+    snprintf(window, sizeof(window), "%d", opts->sync_window);
+    flb_output_set_property(ins, OUTPUT_KEY_SYNC_SEND_WINDOW, window);
+    snprintf(stripes, sizeof(stripes), "%d", opts->stripes);
+    flb_output_set_property(ins, OUTPUT_KEY_PRODUCER_STRIPES, stripes);
+    flb_output_set_property(ins, OUTPUT_KEY_SHOW_INTERNAL, "1000000000");
+
+    if (flb_output_init_all(config) != 0) {
+        return NULL;
+    }
+    return ins;
+}
+
+static int bench_run(struct bench_options *opts, const char *schema, bool async, struct bench_shape *shape)
+{
+    int i;
+    int ret;
+    int retries = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t allocs;
+    uint64_t *latencies;
+    double seconds;
+    msgpack_sbuffer chunk;
+    struct mock_pulsar_stats stats;
+    struct flb_config *config;
+    struct flb_output_instance *ins;
+
+    config = flb_config_init();
+    if (!config) {
+        return -1;
+    }
+    ins = bench_instance(config, opts, schema, async);
+    if (!ins || !ins->context) {
+        fprintf(stderr, "cannot initialize the pulsar output\n");
+        flb_config_exit(config);
+        return -1;
+    }
+
+    latencies = flb_calloc(opts->chunks, sizeof(uint64_t));
+    bench_build_chunk(&chunk, shape->pack, opts->records);
+
+    // one warm-up flush fills the callback pool and the encode buffers
+    flb_pulsar_flush_chunk(ins->context, BENCH_TAG, sizeof(BENCH_TAG) - 1, chunk.data, chunk.size);
+    mock_pulsar_reset_stats();
+
+    allocs = atomic_load(&bench_allocs);
+    start = bench_now_ns();
+    for (i = 0; i < opts->chunks; i++) {
+        latencies[i] = bench_now_ns();
+        ret = flb_pulsar_flush_chunk(ins->context, BENCH_TAG, sizeof(BENCH_TAG) - 1, chunk.data, chunk.size);
+        latencies[i] = bench_now_ns() - latencies[i];
+        if (FLB_OK != ret) {
+            ++retries;
+        }
+    }
+    elapsed = bench_now_ns() - start;
+    allocs = atomic_load(&bench_allocs) - allocs;
+    mock_pulsar_get_stats(&stats);
+
+    qsort(latencies, opts->chunks, sizeof(uint64_t), cmp_u64);
+    seconds = (double) elapsed / 1e9;
+    printf("%-8s %-6s %-11s %12.0f %10.2f %11.2f %9.3f %9.3f %8d\n",
+           schema, async ? "async" : "sync", shape->name,
+           (double) opts->records * opts->chunks / seconds,
+           (double) stats.bytes / seconds / (1024 * 1024),
+           (double) allocs / ((double) opts->records * opts->chunks),
+           (double) latencies[opts->chunks / 2] / 1e6,
+           (double) latencies[(size_t) opts->chunks * 99 / 100] / 1e6,
+           retries);
+
+    msgpack_sbuffer_destroy(&chunk);
+    flb_free(latencies);
+    flb_output_exit(config);
+    flb_config_exit(config);
+    return 0;
+}
+
+/*
+ * Differential check of the JSON writer: random objects, with strings mixing
+ * clean runs around the 16/32 byte boundaries of the escape scanners, escapes,
+ * control bytes, valid and broken UTF-8, and edge integers and floats, are
+ * written by every scanner the CPU supports and compared to
+ * flb_msgpack_to_json().
+ */
+static uint64_t verify_state;
+
+static uint64_t verify_rand()
+{
+    verify_state ^= verify_state << 13;
+    verify_state ^= verify_state >> 7;
+    verify_state ^= verify_state << 17;
+    return verify_state;
+}
+
+static void verify_pack_str(msgpack_packer *pck)
+{
+    int i;
+    int run;
+    size_t len = 0;
+    size_t target = verify_rand() % 160;
+    char str[192];
+    static const char escapes[] = "\"\\\n\r\t\b\f\x01\x1f\x7f";
+    static const char *utf8[] = { "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80", "\xe4\xb8", "\x80", "\xc3(" };
+
+    while (len < target) {
+        switch (verify_rand() % 8) {
+        case 0:
+        case 1:
+        case 2:
+            run = verify_rand() % 70;
+            for (i = 0; i < run && len < sizeof(str); i++) {
+                str[len++] = 0x20 + verify_rand() % 95;
+            }
+            break;
+        case 3:
+            str[len++] = escapes[verify_rand() % (sizeof(escapes) - 1)];
+            break;
+        case 4:
+        case 5:
+            run = verify_rand() % (sizeof(utf8) / sizeof(utf8[0]));
+            if (len + strlen(utf8[run]) <= sizeof(str)) {
+                memcpy(str + len, utf8[run], strlen(utf8[run]));
+                len += strlen(utf8[run]);
+            }
+            break;
+        default:
+            str[len++] = (char) (verify_rand() & 0xff);
+            break;
+        }
+    }
+    if (verify_rand() % 4) {
+        msgpack_pack_str(pck, len);
+        msgpack_pack_str_body(pck, str, len);
+    } else {
+        msgpack_pack_bin(pck, len);
+        msgpack_pack_bin_body(pck, str, len);
+    }
+}
+
+static void verify_pack_object(msgpack_packer *pck, int depth)
+{
+    int i;
+    int n;
+    uint64_t bits;
+    double f;
+    static const double floats[] = { 0.0, -0.0, 1.0, -1.0, 0.1, 1e15, 1e16, 1e300, -1e-300,
+                                     9223372036854775807.0, -9223372036854775808.0, 1.5e19 };
+
+    switch (verify_rand() % (depth < 3 ? 8 : 6)) {
+    case 0:
+        msgpack_pack_uint64(pck, verify_rand() % 4 ? verify_rand() >> (verify_rand() % 64) : UINT64_MAX);
+        break;
+    case 1:
+        msgpack_pack_int64(pck, verify_rand() % 4 ? -(int64_t) (verify_rand() >> (1 + verify_rand() % 63)) - 1
+                                                  : INT64_MIN);
+        break;
+    case 2:
+        if (verify_rand() % 2) {
+            f = floats[verify_rand() % (sizeof(floats) / sizeof(floats[0]))];
+        } else if (verify_rand() % 2) {
+            f = (double) (int64_t) (verify_rand() >> (1 + verify_rand() % 63)) * (verify_rand() % 2 ? 1 : -1);
+        } else {
+            bits = verify_rand();
+            memcpy(&f, &bits, sizeof(f));
+        }
+        msgpack_pack_double(pck, f);
+        break;
+    case 3:
+        switch (verify_rand() % 3) {
+        case 0:
+            msgpack_pack_nil(pck);
+            break;
+        case 1:
+            msgpack_pack_true(pck);
+            break;
+        default:
+            msgpack_pack_false(pck);
+            break;
+        }
+        break;
+    case 6:
+        n = verify_rand() % 5;
+        msgpack_pack_array(pck, n);
+        for (i = 0; i < n; i++) {
+            verify_pack_object(pck, depth + 1);
+        }
+        break;
+    case 7:
+        n = verify_rand() % 5;
+        msgpack_pack_map(pck, n);
+        for (i = 0; i < n; i++) {
+            verify_pack_str(pck);
+            verify_pack_object(pck, depth + 1);
+        }
+        break;
+    default:
+        verify_pack_str(pck);
+        break;
+    }
+}
+
+static int bench_verify_json(int iterations, uint64_t seed)
+{
+    int i;
+    int isa;
+    int len;
+    int failures = 0;
+    size_t off;
+    size_t expected_size = 65536;
+    char *expected;
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+    struct pulsar_buffer out;
+
+    verify_state = seed ? seed : 1;
+    expected = malloc(expected_size);
+    if (!expected || pulsar_buffer_init(&out, PULSAR_BUFFER_INIT_SIZE) != 0) {
+        free(expected);
+        return -1;
+    }
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_unpacked_init(&result);
+
+    for (i = 0; i < iterations && failures < 10; i++) {
+        msgpack_sbuffer_clear(&sbuf);
+        verify_pack_object(&pck, 0);
+        off = 0;
+        if (msgpack_unpack_next(&result, sbuf.data, sbuf.size, &off) != MSGPACK_UNPACK_SUCCESS) {
+            continue;
+        }
+        len = flb_msgpack_to_json(expected, expected_size, &result.data);
+        if (len <= 0) {
+            continue;
+        }
+        for (isa = PULSAR_JSON_ISA_SCALAR; isa <= PULSAR_JSON_ISA_AVX2; isa++) {
+            if (pulsar_json_use_isa(isa) != 0) {
+                continue;
+            }
+            pulsar_buffer_reset(&out);
+            if (pulsar_json_write_object(&out, &result.data) != 0
+                || out.size != (size_t) len || memcmp(out.data, expected, len) != 0) {
+                failures++;
+                printf("mismatch (%s, iteration %d):\n  expected: %.*s\n  written:  %.*s\n",
+                       pulsar_json_isa_name(isa), i, len, expected, (int) out.size, out.data);
+            }
+        }
+    }
+    pulsar_json_use_isa(pulsar_json_isa());
+
+    printf("json verify: %d objects, scanners up to %s, %d mismatches\n",
+           i, pulsar_json_isa_name(pulsar_json_isa()), failures);
+    msgpack_unpacked_destroy(&result);
+    msgpack_sbuffer_destroy(&sbuf);
+    pulsar_buffer_destroy(&out);
+    free(expected);
+    return failures ? -1 : 0;
+}
+
+/*
+ * GELF additional field names of nested maps with keys around the size of
+ * the key buffer: every record must be written, with every name cut to fit.
+ */
+static int bench_verify_gelf()
+{
+    int depth;
+    int d;
+    int failures = 0;
+    size_t i;
+    size_t len;
+    size_t key_len;
+    const char *name;
+    const char *end;
+    char key[PULSAR_GELF_MAX_KEY_LEN + 16];
+    const size_t key_lens[] = { 1, 254, 255, 256, 508, 509, 510, 511, 512, 513, sizeof(key) };
+    struct flb_time tm;
+    struct pulsar_gelf_conf conf = { 0 };
+    msgpack_sbuffer sbuf;
+    msgpack_packer pck;
+    msgpack_unpacked result;
+    struct pulsar_buffer out;
+
+    if (pulsar_buffer_init(&out, PULSAR_BUFFER_INIT_SIZE) != 0) {
+        return -1;
+    }
+    conf.short_message_key = flb_sds_create(PULSAR_GELF_DEFAULT_SHORT_MESSAGE_KEY);
+    pulsar_gelf_conf_init(&conf);
+    flb_time_get(&tm);
+    memset(key, 'k', sizeof(key));
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&pck, &sbuf, msgpack_sbuffer_write);
+    msgpack_unpacked_init(&result);
+
+    for (i = 0; i < sizeof(key_lens) / sizeof(key_lens[0]); i++) {
+        for (depth = 1; depth <= 4; depth++) {
+            msgpack_sbuffer_clear(&sbuf);
+            msgpack_pack_map(&pck, 2);
+            pack_str(&pck, PULSAR_GELF_DEFAULT_SHORT_MESSAGE_KEY);
+            pack_str(&pck, "message");
+            for (d = 0; d < depth; d++) {
+                msgpack_pack_str(&pck, key_lens[i]);
+                msgpack_pack_str_body(&pck, key, key_lens[i]);
+                if (d + 1 < depth) {
+                    msgpack_pack_map(&pck, 1);
+                }
+            }
+            pack_str(&pck, "value");
+
+            len = 0;
+            pulsar_buffer_reset(&out);
+            if (msgpack_unpack_next(&result, sbuf.data, sbuf.size, &len) != MSGPACK_UNPACK_SUCCESS
+                || pulsar_gelf_write(&out, &conf, &result.data, &tm) != 0) {
+                failures++;
+                printf("gelf: record of %d keys of %zu bytes not written\n", depth, key_lens[i]);
+                continue;
+            }
+            // additional fields are the only names starting with '_'
+            end = out.data + out.size;
+            for (name = out.data; name + 3 < end; name++) {
+                if (memcmp(name, ",\"_", 3) != 0) {
+                    continue;
+                }
+                name += 2;
+                key_len = (const char *) memchr(name, '"', end - name) - name;
+                if (key_len >= PULSAR_GELF_MAX_KEY_LEN) {
+                    failures++;
+                    printf("gelf: field name of %zu bytes from %d keys of %zu bytes\n",
+                           key_len, depth, key_lens[i]);
+                }
+            }
+        }
+    }
+
+    printf("gelf verify: nested keys up to %zu bytes, %d failures\n", sizeof(key), failures);
+    flb_sds_destroy(conf.short_message_key);
+    msgpack_unpacked_destroy(&result);
+    msgpack_sbuffer_destroy(&sbuf);
+    pulsar_buffer_destroy(&out);
+    return failures ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-r records] [-c chunks] [-w sync_window] [-s stripes] [-l ack_latency_us] [-e error_rate]\n"
+           "       %s -V objects [-S seed]\n\n"
+           "  -r  records per chunk, default 1000\n"
+           "  -c  chunks flushed per scenario, default 200\n"
+           "  -w  syncSendWindow of the sync runs, default 1\n"
+           "  -s  producerStripes, default 1\n"
+           "  -l  mock broker ack latency in microseconds, default 0\n"
+           "  -e  fraction of the sends failed by the mock broker, default 0\n"
+           "  -V  compare the JSON of that many random objects to flb_msgpack_to_json(), check the GELF\n"
+           "      field names of long nested keys, and exit\n"
+           "  -S  seed of the random objects, default 1\n",
+           name, name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    size_t s;
+    const char *schemas[] = { "JSON", "MSGPACK" };
+    bool modes[] = { false, true };
+    int i;
+    int m;
+    int verify = 0;
+    uint64_t seed = 1;
+    struct bench_options opts = {
+        .records = 1000,
+        .chunks = 200,
+        .sync_window = 1,
+        .stripes = 1,
+        .ack_latency_us = 0,
+        .error_rate = 0,
+    };
+
+    while ((opt = getopt(argc, argv, "r:c:w:s:l:e:V:S:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            opts.records = atoi(optarg);
+            break;
+        case 'c':
+            opts.chunks = atoi(optarg);
+            break;
+        case 'w':
+            opts.sync_window = atoi(optarg);
+            break;
+        case 's':
+            opts.stripes = atoi(optarg);
+            break;
+        case 'l':
+            opts.ack_latency_us = (uint32_t) atoi(optarg);
+            break;
+        case 'e':
+            opts.error_rate = atof(optarg);
+            break;
+        case 'V':
+            verify = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.records <= 0 || opts.chunks <= 0 || opts.error_rate < 0 || opts.error_rate > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    flb_init_env();
+    if (verify > 0) {
+        return bench_verify_json(verify, seed) == 0 && bench_verify_gelf() == 0 ? 0 : 1;
+    }
+    mock_pulsar_configure(opts.ack_latency_us, opts.error_rate);
+
+    printf("records/chunk: %d, chunks: %d, sync window: %d, stripes: %d, ack latency: %uus, error rate: %.4f\n\n",
+           opts.records, opts.chunks, opts.sync_window, opts.stripes, opts.ack_latency_us, opts.error_rate);
+    printf("%-8s %-6s %-11s %12s %10s %11s %9s %9s %8s\n",
+           "schema", "mode", "shape", "records/s", "MB/s", "allocs/rec", "p50(ms)", "p99(ms)", "retries");
+
+    for (i = 0; i < (int) (sizeof(schemas) / sizeof(schemas[0])); i++) {
+        for (m = 0; m < (int) (sizeof(modes) / sizeof(modes[0])); m++) {
+            for (s = 0; s < sizeof(bench_shapes) / sizeof(bench_shapes[0]); s++) {
+                if (bench_run(&opts, schemas[i], modes[m], &bench_shapes[s]) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,590 @@
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <pulsar/c/version.h>
+#include <pulsar/c/authentication.h>
+#include <pulsar/c/client.h>
+
+#include "mock_pulsar.h"
+
+// allocations of the mock are not accounted to the plugin
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+
+static uint32_t mock_ack_latency_us = 0;
+static double mock_error_rate = 0;
+static atomic_uint_fast64_t mock_sends;
+static atomic_uint_fast64_t mock_messages;
+static atomic_uint_fast64_t mock_bytes;
+static atomic_uint_fast64_t mock_failed;
+
+struct mock_ack {
+    pulsar_message_t *msg;
+    pulsar_send_callback callback;
+    pulsar_close_callback flushed;   // set for a flush, which completes after the sends before it
+    void *ctx;
+    pulsar_result result;
+    uint64_t due_ns;
+    struct mock_ack *next;
+};
+
+struct _pulsar_client {
+    pthread_t io_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mock_ack *head;
+    struct mock_ack *tail;
+    bool closing;
+};
+
+struct _pulsar_producer {
+    pulsar_client_t *client;
+};
+
+struct _pulsar_authentication {
+    int unused;
+};
+
+struct _pulsar_client_configuration {
+    unsigned long long memory_limit;
+    int io_threads;
+    int message_listener_threads;
+};
+
+struct _pulsar_producer_configuration {
+    char producer_name[256];
+    pulsar_compression_type compression_type;
+    int send_timeout;
+    pulsar_partitions_routing_mode routing_mode;
+    pulsar_hashing_scheme hashing_scheme;
+    pulsar_producer_crypto_failure_action crypto_failure_action;
+    pulsar_producer_batching_type batching_type;
+    int batching_enabled;
+    unsigned int batching_max_messages;
+    unsigned long batching_max_bytes;
+    unsigned long batching_max_delay_ms;
+    int block_if_queue_full;
+    int max_pending_messages;
+    int max_pending_messages_across_partitions;
+};
+
+struct _pulsar_message {
+    const void *data;
+    size_t len;
+    char partition_key[512];
+};
+
+static uint64_t mock_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mock_sleep_until(uint64_t due_ns)
+{
+    struct timespec ts;
+    uint64_t now = mock_now_ns();
+
+    if (due_ns <= now) {
+        return;
+    }
+    ts.tv_sec = (due_ns - now) / 1000000000ULL;
+    ts.tv_nsec = (due_ns - now) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+}
+
+// fail `error_rate` of the sends, spread evenly and deterministically
+static pulsar_result mock_send_result(size_t len)
+{
+    uint64_t n = atomic_fetch_add(&mock_sends, 1);
+
+    if (0 < mock_error_rate && (uint64_t) ((n + 1) * mock_error_rate) != (uint64_t) (n * mock_error_rate)) {
+        atomic_fetch_add(&mock_failed, 1);
+        return pulsar_result_Timeout;
+    }
+    atomic_fetch_add(&mock_messages, 1);
+    atomic_fetch_add(&mock_bytes, len);
+    return pulsar_result_Ok;
+}
+
+void mock_pulsar_configure(uint32_t ack_latency_us, double error_rate)
+{
+    mock_ack_latency_us = ack_latency_us;
+    mock_error_rate = error_rate;
+}
+
+void mock_pulsar_get_stats(struct mock_pulsar_stats *stats)
+{
+    stats->messages = atomic_load(&mock_messages);
+    stats->bytes = atomic_load(&mock_bytes);
+    stats->failed = atomic_load(&mock_failed);
+}
+
+void mock_pulsar_reset_stats()
+{
+    atomic_store(&mock_sends, 0);
+    atomic_store(&mock_messages, 0);
+    atomic_store(&mock_bytes, 0);
+    atomic_store(&mock_failed, 0);
+}
+
+static void *mock_io_thread(void *data)
+{
+    bool closing;
+    struct mock_ack *ack;
+    pulsar_client_t *client = data;
+
+    pthread_mutex_lock(&client->lock);
+    while (true) {
+        while (!client->head && !client->closing) {
+            pthread_cond_wait(&client->cond, &client->lock);
+        }
+        if (!client->head) {
+            break;
+        }
+        ack = client->head;
+        client->head = ack->next;
+        if (!client->head) {
+            client->tail = NULL;
+        }
+        closing = client->closing;
+        pthread_mutex_unlock(&client->lock);
+
+        // pending sends are still completed on close, without the latency
+        if (!closing) {
+            mock_sleep_until(ack->due_ns);
+        }
+        if (ack->flushed) {
+            ack->flushed(ack->result, ack->ctx);
+        } else {
+            ack->callback(ack->result, NULL, ack->ctx);
+        }
+        free(ack);
+
+        pthread_mutex_lock(&client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+    return NULL;
+}
+
+const char *pulsar_result_str(pulsar_result result)
+{
+    switch (result) {
+    case pulsar_result_Ok:
+        return "Ok";
+    case pulsar_result_Timeout:
+        return "TimeOut";
+    default:
+        return "UnknownError";
+    }
+}
+
+pulsar_client_t *pulsar_client_create(const char *url, const pulsar_client_configuration_t *conf)
+{
+    pulsar_client_t *client = __real_calloc(1, sizeof(pulsar_client_t));
+
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->cond, NULL);
+    pthread_create(&client->io_thread, NULL, mock_io_thread, client);
+    return client;
+}
+
+pulsar_result pulsar_client_create_producer(pulsar_client_t *client, const char *topic,
+                                            const pulsar_producer_configuration_t *conf,
+                                            pulsar_producer_t **producer)
+{
+    *producer = __real_calloc(1, sizeof(pulsar_producer_t));
+    (*producer)->client = client;
+    return pulsar_result_Ok;
+}
+
+pulsar_result pulsar_client_close(pulsar_client_t *client)
+{
+    pthread_mutex_lock(&client->lock);
+    client->closing = true;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+    pthread_join(client->io_thread, NULL);
+    return pulsar_result_Ok;
+}
+
+void pulsar_client_free(pulsar_client_t *client)
+{
+    pthread_cond_destroy(&client->cond);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+pulsar_client_configuration_t *pulsar_client_configuration_create()
+{
+    pulsar_client_configuration_t *conf = __real_calloc(1, sizeof(pulsar_client_configuration_t));
+
+    // defaults of the pulsar C++ client
+    conf->io_threads = 1;
+    conf->message_listener_threads = 1;
+    return conf;
+}
+
+void pulsar_client_configuration_free(pulsar_client_configuration_t *conf)
+{
+    free(conf);
+}
+
+void pulsar_client_configuration_set_auth(pulsar_client_configuration_t *conf, pulsar_authentication_t *authentication)
+{
+}
+
+void pulsar_client_configuration_set_memory_limit(pulsar_client_configuration_t *conf, unsigned long long limit)
+{
+    conf->memory_limit = limit;
+}
+
+unsigned long long pulsar_client_configuration_get_memory_limit(pulsar_client_configuration_t *conf)
+{
+    return conf->memory_limit;
+}
+
+void pulsar_client_configuration_set_io_threads(pulsar_client_configuration_t *conf, int threads)
+{
+    conf->io_threads = threads;
+}
+
+int pulsar_client_configuration_get_io_threads(pulsar_client_configuration_t *conf)
+{
+    return conf->io_threads;
+}
+
+void pulsar_client_configuration_set_message_listener_threads(pulsar_client_configuration_t *conf, int threads)
+{
+    conf->message_listener_threads = threads;
+}
+
+int pulsar_client_configuration_get_message_listener_threads(pulsar_client_configuration_t *conf)
+{
+    return conf->message_listener_threads;
+}
+
+pulsar_authentication_t *pulsar_authentication_token_create(const char *token)
+{
+    return __real_calloc(1, sizeof(pulsar_authentication_t));
+}
+
+void pulsar_authentication_free(pulsar_authentication_t *authentication)
+{
+    free(authentication);
+}
+
+pulsar_producer_configuration_t *pulsar_producer_configuration_create()
+{
+    pulsar_producer_configuration_t *conf = __real_calloc(1, sizeof(pulsar_producer_configuration_t));
+
+    // defaults of the pulsar C++ client
+    conf->send_timeout = 30000;
+    conf->routing_mode = pulsar_UseSinglePartition;
+    conf->hashing_scheme = pulsar_BoostHash;
+    conf->batching_enabled = 1;
+    conf->batching_max_messages = 1000;
+    conf->batching_max_bytes = 128 * 1024;
+    conf->batching_max_delay_ms = 10;
+    conf->max_pending_messages = 1000;
+    conf->max_pending_messages_across_partitions = 50000;
+    return conf;
+}
+
+void pulsar_producer_configuration_free(pulsar_producer_configuration_t *conf)
+{
+    free(conf);
+}
+
+void pulsar_producer_configuration_set_producer_name(pulsar_producer_configuration_t *conf, const char *name)
+{
+    strncpy(conf->producer_name, name, sizeof(conf->producer_name) - 1);
+}
+
+const char *pulsar_producer_configuration_get_producer_name(pulsar_producer_configuration_t *conf)
+{
+    return conf->producer_name;
+}
+
+void pulsar_producer_configuration_set_compression_type(pulsar_producer_configuration_t *conf, pulsar_compression_type type)
+{
+    conf->compression_type = type;
+}
+
+pulsar_compression_type pulsar_producer_configuration_get_compression_type(pulsar_producer_configuration_t *conf)
+{
+    return conf->compression_type;
+}
+
+void pulsar_producer_configuration_set_send_timeout(pulsar_producer_configuration_t *conf, int timeout)
+{
+    conf->send_timeout = timeout;
+}
+
+int pulsar_producer_configuration_get_send_timeout(pulsar_producer_configuration_t *conf)
+{
+    return conf->send_timeout;
+}
+
+void pulsar_producer_configuration_set_partitions_routing_mode(pulsar_producer_configuration_t *conf, pulsar_partitions_routing_mode mode)
+{
+    conf->routing_mode = mode;
+}
+
+pulsar_partitions_routing_mode pulsar_producer_configuration_get_partitions_routing_mode(pulsar_producer_configuration_t *conf)
+{
+    return conf->routing_mode;
+}
+
+void pulsar_producer_configuration_set_batching_enabled(pulsar_producer_configuration_t *conf, int enabled)
+{
+    conf->batching_enabled = enabled;
+}
+
+int pulsar_producer_configuration_get_batching_enabled(pulsar_producer_configuration_t *conf)
+{
+    return conf->batching_enabled;
+}
+
+void pulsar_producer_configuration_set_batching_max_messages(pulsar_producer_configuration_t *conf, unsigned int max)
+{
+    conf->batching_max_messages = max;
+}
+
+unsigned int pulsar_producer_configuration_get_batching_max_messages(pulsar_producer_configuration_t *conf)
+{
+    return conf->batching_max_messages;
+}
+
+void pulsar_producer_configuration_set_batching_max_allowed_size_in_bytes(pulsar_producer_configuration_t *conf, unsigned long max)
+{
+    conf->batching_max_bytes = max;
+}
+
+unsigned long pulsar_producer_configuration_get_batching_max_allowed_size_in_bytes(pulsar_producer_configuration_t *conf)
+{
+    return conf->batching_max_bytes;
+}
+
+void pulsar_producer_configuration_set_batching_max_publish_delay_ms(pulsar_producer_configuration_t *conf, unsigned long delay)
+{
+    conf->batching_max_delay_ms = delay;
+}
+
+unsigned long pulsar_producer_configuration_get_batching_max_publish_delay_ms(pulsar_producer_configuration_t *conf)
+{
+    return conf->batching_max_delay_ms;
+}
+
+void pulsar_producer_configuration_set_block_if_queue_full(pulsar_producer_configuration_t *conf, int block)
+{
+    conf->block_if_queue_full = block;
+}
+
+int pulsar_producer_configuration_get_block_if_queue_full(pulsar_producer_configuration_t *conf)
+{
+    return conf->block_if_queue_full;
+}
+
+void pulsar_producer_configuration_set_max_pending_messages(pulsar_producer_configuration_t *conf, int max)
+{
+    conf->max_pending_messages = max;
+}
+
+int pulsar_producer_configuration_get_max_pending_messages(pulsar_producer_configuration_t *conf)
+{
+    return conf->max_pending_messages;
+}
+
+void pulsar_producer_configuration_set_max_pending_messages_across_partitions(pulsar_producer_configuration_t *conf, int max)
+{
+    conf->max_pending_messages_across_partitions = max;
+}
+
+int pulsar_producer_configuration_get_max_pending_messages_across_partitions(pulsar_producer_configuration_t *conf)
+{
+    return conf->max_pending_messages_across_partitions;
+}
+
+void pulsar_producer_configuration_set_hashing_scheme(pulsar_producer_configuration_t *conf, pulsar_hashing_scheme scheme)
+{
+    conf->hashing_scheme = scheme;
+}
+
+pulsar_hashing_scheme pulsar_producer_configuration_get_hashing_scheme(pulsar_producer_configuration_t *conf)
+{
+    return conf->hashing_scheme;
+}
+
+void pulsar_producer_configuration_set_crypto_failure_action(pulsar_producer_configuration_t *conf, pulsar_producer_crypto_failure_action action)
+{
+    conf->crypto_failure_action = action;
+}
+
+pulsar_producer_crypto_failure_action pulsar_producer_configuration_get_crypto_failure_action(pulsar_producer_configuration_t *conf)
+{
+    return conf->crypto_failure_action;
+}
+
+void pulsar_producer_configuration_set_batching_type(pulsar_producer_configuration_t *conf, pulsar_producer_batching_type type)
+{
+    conf->batching_type = type;
+}
+
+pulsar_producer_batching_type pulsar_producer_configuration_get_batching_type(pulsar_producer_configuration_t *conf)
+{
+    return conf->batching_type;
+}
+
+void pulsar_producer_configuration_set_schema_info(pulsar_producer_configuration_t *conf, pulsar_schema_type schema_type,
+                                                   const char *name, const char *schema, pulsar_string_map_t *properties)
+{
+}
+
+pulsar_string_map_t *pulsar_string_map_create()
+{
+    // only handed back to pulsar_string_map_free()
+    return __real_calloc(1, 1);
+}
+
+void pulsar_string_map_free(pulsar_string_map_t *map)
+{
+    free(map);
+}
+
+int64_t pulsar_producer_configuration_get_initial_sequence_id(pulsar_producer_configuration_t *conf)
+{
+    return -1;
+}
+
+int pulsar_producer_configuration_get_lazy_start_partitioned_producers(pulsar_producer_configuration_t *conf)
+{
+    return 0;
+}
+
+int pulsar_producer_is_encryption_enabled(pulsar_producer_configuration_t *conf)
+{
+    return 0;
+}
+
+pulsar_result pulsar_producer_send(pulsar_producer_t *producer, pulsar_message_t *msg)
+{
+    if (0 < mock_ack_latency_us) {
+        mock_sleep_until(mock_now_ns() + (uint64_t) mock_ack_latency_us * 1000);
+    }
+    return mock_send_result(msg->len);
+}
+
+static void mock_ack_push(pulsar_client_t *client, struct mock_ack *ack)
+{
+    ack->next = NULL;
+    pthread_mutex_lock(&client->lock);
+    if (client->tail) {
+        client->tail->next = ack;
+    } else {
+        client->head = ack;
+    }
+    client->tail = ack;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+}
+
+void pulsar_producer_send_async(pulsar_producer_t *producer, pulsar_message_t *msg,
+                                pulsar_send_callback callback, void *ctx)
+{
+    struct mock_ack *ack = __real_malloc(sizeof(struct mock_ack));
+
+    ack->msg = msg;
+    ack->callback = callback;
+    ack->flushed = NULL;
+    ack->ctx = ctx;
+    ack->result = mock_send_result(msg->len);
+    ack->due_ns = mock_now_ns() + (uint64_t) mock_ack_latency_us * 1000;
+    mock_ack_push(producer->client, ack);
+}
+
+void pulsar_producer_flush_async(pulsar_producer_t *producer, pulsar_close_callback callback, void *ctx)
+{
+    struct mock_ack *ack = __real_malloc(sizeof(struct mock_ack));
+
+    ack->msg = NULL;
+    ack->callback = NULL;
+    ack->flushed = callback;
+    ack->ctx = ctx;
+    ack->result = pulsar_result_Ok;
+    ack->due_ns = 0;
+    mock_ack_push(producer->client, ack);
+}
+
+void pulsar_producer_close_async(pulsar_producer_t *producer, pulsar_close_callback callback, void *ctx)
+{
+    callback(pulsar_result_Ok, ctx);
+}
+
+pulsar_result pulsar_producer_close(pulsar_producer_t *producer)
+{
+    return pulsar_result_Ok;
+}
+
+void pulsar_producer_free(pulsar_producer_t *producer)
+{
+    free(producer);
+}
+
+pulsar_message_t *pulsar_message_create()
+{
+    return __real_calloc(1, sizeof(pulsar_message_t));
+}
+
+void pulsar_message_free(pulsar_message_t *message)
+{
+    free(message);
+}
+
+void pulsar_message_set_allocated_content(pulsar_message_t *message, void *data, size_t size)
+{
+    message->data = data;
+    message->len = size;
+}
+
+void pulsar_message_set_property(pulsar_message_t *message, const char *name, const char *value)
+{
+}
+
+void pulsar_message_set_event_timestamp(pulsar_message_t *message, uint64_t event_timestamp)
+{
+}
+
+void pulsar_message_set_partition_key(pulsar_message_t *message, const char *partition_key)
+{
+    strncpy(message->partition_key, partition_key, sizeof(message->partition_key) - 1);
+}
+
+int pulsar_message_has_partition_key(pulsar_message_t *message)
+{
+    return '\0' != message->partition_key[0];
+}
+
+const char *pulsar_message_get_partitionKey(pulsar_message_t *message)
+{
+    return message->partition_key;
+}
+
+const void *pulsar_message_get_data(pulsar_message_t *message)
+{
+    return message->data;
+}
+
+uint32_t pulsar_message_get_length(pulsar_message_t *message)
+{
+    return (uint32_t) message->len;
+}
+
+void pulsar_message_id_free(pulsar_message_id_t *message_id)
+{
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * In-process stand-in for the pulsar C client used by the benchmark. Sync
+ * sends sleep for the ack latency, async sends are acked by one io thread
+ * per client after the ack latency, in send order. A fraction of the sends
+ * fail with pulsar_result_Timeout when an error rate is set.
+ */
+struct mock_pulsar_stats {
+    uint64_t messages;    // sends acked with pulsar_result_Ok
+    uint64_t bytes;       // payload bytes of those sends
+    uint64_t failed;      // sends failed by error injection
+};
+
+void mock_pulsar_configure(uint32_t ack_latency_us, double error_rate);
+void mock_pulsar_get_stats(struct mock_pulsar_stats *stats);
+void mock_pulsar_reset_stats();
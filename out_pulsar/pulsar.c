@@ -1,73 +1,640 @@
 #include <fluent-bit/flb_output_plugin.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_log_event_decoder.h>
 #include <fluent-bit/flb_utils.h>
+#include <fluent-bit/flb_record_accessor.h>
 
 #include <pulsar/c/client.h>
 
 #include "pulsar_context.h"
+#include "pulsar_buffer.h"
+#include "pulsar_json.h"
+#include "pulsar_gelf.h"
 
-bool flb_pulsar_output_msg(flb_out_pulsar_ctx *ctx, msgpack_object* map, struct flb_time *tm)
+/*
+ * Skip one msgpack object in buf starting at *off, without decoding it.
+ * Returns 0 on success, -1 if the buffer is truncated or malformed.
+ */
+static int pulsar_msgpack_skip(const char *buf, size_t size, size_t *off)
 {
-    char *out_buf;
-    size_t out_size;
-    
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
-    flb_sds_t s = NULL;
+    uint8_t c;
+    size_t len = 0;
+    uint64_t items = 0;
+    const uint8_t *p;
 
-    flb_debug("in produce_message\n");
-    if (flb_log_check(FLB_LOG_DEBUG))
-        msgpack_object_print(stderr, *map);
+    if (*off >= size) {
+        return -1;
+    }
+
+    p = (const uint8_t *) buf + *off;
+    c = *p;
+    *off += 1;
 
-    // Init temporal buffers
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    if (c <= 0x7f || c >= 0xe0 || c == 0xc0 || c == 0xc2 || c == 0xc3) {
+        // fixint, negative fixint, nil, false, true
+        return 0;
+    } else if (c >= 0xa0 && c <= 0xbf) {
+        len = c & 0x1f;
+    } else if (c >= 0x90 && c <= 0x9f) {
+        items = c & 0x0f;
+    } else if (c >= 0x80 && c <= 0x8f) {
+        items = (uint64_t)(c & 0x0f) << 1;
+    } else {
+        switch (c) {
+        case 0xcc: case 0xd0: len = 1; break;
+        case 0xcd: case 0xd1: len = 2; break;
+        case 0xca: case 0xce: case 0xd2: len = 4; break;
+        case 0xcb: case 0xcf: case 0xd3: len = 8; break;
+        case 0xd4: len = 2; break;
+        case 0xd5: len = 3; break;
+        case 0xd6: len = 5; break;
+        case 0xd7: len = 9; break;
+        case 0xd8: len = 17; break;
+        case 0xc4: case 0xd9:
+            if (*off + 1 > size) return -1;
+            len = p[1];
+            *off += 1;
+            break;
+        case 0xc5: case 0xda:
+            if (*off + 2 > size) return -1;
+            len = ((size_t) p[1] << 8) | p[2];
+            *off += 2;
+            break;
+        case 0xc6: case 0xdb:
+            if (*off + 4 > size) return -1;
+            len = ((size_t) p[1] << 24) | ((size_t) p[2] << 16) | ((size_t) p[3] << 8) | p[4];
+            *off += 4;
+            break;
+        case 0xc7:
+            if (*off + 1 > size) return -1;
+            len = (size_t) p[1] + 1;
+            *off += 1;
+            break;
+        case 0xc8:
+            if (*off + 2 > size) return -1;
+            len = (((size_t) p[1] << 8) | p[2]) + 1;
+            *off += 2;
+            break;
+        case 0xc9:
+            if (*off + 4 > size) return -1;
+            len = (((size_t) p[1] << 24) | ((size_t) p[2] << 16) | ((size_t) p[3] << 8) | p[4]) + 1;
+            *off += 4;
+            break;
+        case 0xdc:
+            if (*off + 2 > size) return -1;
+            items = ((uint64_t) p[1] << 8) | p[2];
+            *off += 2;
+            break;
+        case 0xdd:
+            if (*off + 4 > size) return -1;
+            items = ((uint64_t) p[1] << 24) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 8) | p[4];
+            *off += 4;
+            break;
+        case 0xde:
+            if (*off + 2 > size) return -1;
+            items = (((uint64_t) p[1] << 8) | p[2]) << 1;
+            *off += 2;
+            break;
+        case 0xdf:
+            if (*off + 4 > size) return -1;
+            items = (((uint64_t) p[1] << 24) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 8) | p[4]) << 1;
+            *off += 4;
+            break;
+        default:
+            return -1;
+        }
+    }
 
-    msgpack_pack_map(&mp_pck, map->via.map.size);
+    if (*off + len > size) {
+        return -1;
+    }
+    *off += len;
+
+    while (items-- > 0) {
+        if (pulsar_msgpack_skip(buf, size, off) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Locate the raw bytes of the record body inside an event: the body is the
+ * last element of the root array [timestamp, body] (or [[timestamp, metadata], body]),
+ * so it starts right after the first element and ends with the event itself.
+ */
+static int pulsar_msgpack_body_range(const char *event, size_t size, const char **body, size_t *body_size)
+{
+    size_t off = 0;
+    uint8_t c = (uint8_t) event[0];
+
+    if (c >= 0x90 && c <= 0x9f) {
+        off = 1;
+    } else if (c == 0xdc) {
+        off = 3;
+    } else if (c == 0xdd) {
+        off = 5;
+    } else {
+        return -1;
+    }
+
+    if (pulsar_msgpack_skip(event, size, &off) != 0 || off >= size) {
+        return -1;
+    }
+
+    *body = event + off;
+    *body_size = size - off;
+    return 0;
+}
+
+/*
+ * Render a scalar value as a NUL-terminated string into buf, strings are cut
+ * to fit. Returns NULL for other types.
+ */
+static const char* pulsar_scalar_str(const msgpack_object *val, char *buf, size_t size)
+{
+    int len;
+    const char *ptr;
+
+    switch (val->type) {
+    case MSGPACK_OBJECT_STR:
+    case MSGPACK_OBJECT_BIN:
+        ptr = val->type == MSGPACK_OBJECT_STR ? val->via.str.ptr : val->via.bin.ptr;
+        len = val->type == MSGPACK_OBJECT_STR ? val->via.str.size : val->via.bin.size;
+        if (len >= (int) size) {
+            len = size - 1;
+        }
+        memcpy(buf, ptr, len);
+        buf[len] = '\0';
+        return buf;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        snprintf(buf, size, "%"PRIu64, val->via.u64);
+        return buf;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        snprintf(buf, size, "%"PRId64, val->via.i64);
+        return buf;
+    case MSGPACK_OBJECT_BOOLEAN:
+        snprintf(buf, size, "%s", val->via.boolean ? "true" : "false");
+        return buf;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Render the record value selected by the record accessor as a NUL-terminated
+ * key into buf, without allocating. Returns NULL if the record lacks it.
+ */
+static const char* pulsar_record_key(struct flb_record_accessor *ra, msgpack_object *map, char *buf, size_t size)
+{
+    msgpack_object *start_key = NULL;
+    msgpack_object *out_key = NULL;
+    msgpack_object *out_val = NULL;
+
+    if (FLB_TRUE != flb_ra_get_kv_pair(ra, *map, &start_key, &out_key, &out_val) || !out_val) {
+        return NULL;
+    }
+    return pulsar_scalar_str(out_val, buf, size);
+}
+
+// storage of the attributes rendered from a record
+struct pulsar_attrs_buf {
+    char key[PULSAR_MAX_KEY_LEN];
+    char properties[PULSAR_MAX_PROPERTIES_LEN];
+};
+
+// append a name\0value\0 pair to the properties in buf, false if it does not fit
+static bool pulsar_property_append(char *buf, size_t size, size_t *len,
+                                   const char *name, size_t name_len, const char *value)
+{
+    size_t value_len = strlen(value) + 1;
+
+    if (*len + name_len + 1 + value_len > size) {
+        return false;
+    }
+    memcpy(buf + *len, name, name_len);
+    buf[*len + name_len] = '\0';
+    memcpy(buf + *len + name_len + 1, value, value_len);
+    *len += name_len + 1 + value_len;
+    return true;
+}
+
+/*
+ * Render the messageProperties of a record, then the scalar entries of its
+ * metadata with metadataProperties, as name\0value\0 pairs into buf. Fields
+ * the record lacks are left out, as are the ones that do not fit.
+ */
+static size_t pulsar_record_properties(flb_out_pulsar_ctx *ctx, const char *tag, int tag_len, msgpack_object *map,
+                                       msgpack_object *metadata, char *buf, size_t size)
+{
+    uint32_t i;
+    size_t len = 0;
+    const char *value;
+    char value_buf[PULSAR_MAX_KEY_LEN];
+    struct mk_list *head;
+    struct pulsar_msg_property *prop;
+    msgpack_object_kv *kv;
+
+    mk_list_foreach(head, &ctx->properties) {
+        prop = mk_list_entry(head, struct pulsar_msg_property, _head);
+        if (prop->ra) {
+            value = pulsar_record_key(prop->ra, map, value_buf, sizeof(value_buf));
+        } else {
+            snprintf(value_buf, sizeof(value_buf), "%.*s", tag_len, tag);
+            value = value_buf;
+        }
+        if (!value) {
+            continue;
+        }
+        if (!pulsar_property_append(buf, size, &len, prop->name, flb_sds_len(prop->name), value)) {
+            flb_plg_debug(ctx->ins, "message properties exceed %zu bytes, %s is dropped", size, prop->name);
+        }
+    }
+
+    if (!ctx->metadata_properties || !metadata || MSGPACK_OBJECT_MAP != metadata->type) {
+        return len;
+    }
+    for (i = 0; i < metadata->via.map.size; i++) {
+        kv = &metadata->via.map.ptr[i];
+        if (MSGPACK_OBJECT_STR != kv->key.type || 0 == kv->key.via.str.size
+            || !(value = pulsar_scalar_str(&kv->val, value_buf, sizeof(value_buf)))) {
+            continue;
+        }
+        if (!pulsar_property_append(buf, size, &len, kv->key.via.str.ptr, kv->key.via.str.size, value)) {
+            flb_plg_debug(ctx->ins, "message properties exceed %zu bytes, metadata %.*s is dropped",
+                          size, (int) kv->key.via.str.size, kv->key.via.str.ptr);
+        }
+    }
+    return len;
+}
+
+/*
+ * Resolve the message attributes of a record. A templated topic is returned
+ * in *topic, which the caller destroys. Returns -1 if the topic is unknown.
+ */
+static int pulsar_record_attrs(flb_out_pulsar_ctx *ctx, const char *tag, int tag_len, msgpack_object *map,
+                               msgpack_object *metadata, struct flb_time *tm, struct pulsar_msg_attrs *attrs, struct pulsar_attrs_buf *attrs_buf,
+                               flb_sds_t *topic)
+{
+    *topic = NULL;
+    if (ctx->partition_key_ra) {
+        attrs->partition_key = pulsar_record_key(ctx->partition_key_ra, map, attrs_buf->key, sizeof(attrs_buf->key));
+    }
+    if (mk_list_is_empty(&ctx->properties) != 0 || ctx->metadata_properties) {
+        attrs->properties_len = pulsar_record_properties(ctx, tag, tag_len, map, metadata, attrs_buf->properties,
+                                                         sizeof(attrs_buf->properties));
+        attrs->properties = 0 < attrs->properties_len ? attrs_buf->properties : NULL;
+    }
+    attrs->event_time = (uint64_t) tm->tm.tv_sec * 1000 + tm->tm.tv_nsec / 1000000;
 
-    for (int i = 0; i < map->via.map.size; i++) {
-        msgpack_pack_object(&mp_pck, map->via.map.ptr[i].key);
-        msgpack_pack_object(&mp_pck, map->via.map.ptr[i].val);
+    if (ctx->topic_ra) {
+        *topic = flb_ra_translate(ctx->topic_ra, (char *) tag, tag_len, *map, NULL);
+        if (!*topic || 0 == flb_sds_len(*topic)) {
+            flb_plg_error(ctx->ins, "cannot resolve topic of record");
+            if (*topic) {
+                flb_sds_destroy(*topic);
+                *topic = NULL;
+            }
+            pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_TOPIC_UNRESOLVED, 1);
+            return -1;
+        }
+        attrs->topic = *topic;
+        attrs->topic_len = flb_sds_len(*topic);
     }
+    return 0;
+}
+
+/*
+ * Encode a record in the configured schema. The result is appended to buf,
+ * except for MSGPACK where *out points to the original bytes of the record.
+ */
+static int pulsar_encode_record(flb_out_pulsar_ctx *ctx, struct pulsar_buffer *buf,
+                                msgpack_object *map, struct flb_time *tm,
+                                const char *raw, size_t raw_size,
+                                const char **out, size_t *out_size)
+{
+    size_t start = buf->size;
 
     // Parse to schema
     switch (ctx->data_schema)
     {
     case FLB_PULSAR_SCHEMA_MSGP:
         {
-            out_buf = mp_sbuf.data;
-            out_size = mp_sbuf.size;
+            // keys are dropped or renamed: pack the kept ones
+            if (ctx->projection) {
+                if (0 != pulsar_projection_write_msgpack(buf, ctx->projection, map)) {
+                    flb_plg_error(ctx->ins, "error encoding to MSGPACK");
+                    buf->size = start;
+                    pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_ENCODE_ERROR, 1);
+                    return -1;
+                }
+                break;
+            }
+            // the record is already msgpack: hand over its original bytes
+            if (0 == pulsar_msgpack_body_range(raw, raw_size, out, out_size)) {
+                return 0;
+            }
+            // unexpected layout, fall back to packing the decoded map
+            msgpack_packer mp_pck;
+            msgpack_packer_init(&mp_pck, buf, pulsar_buffer_write);
+            if (0 != msgpack_pack_object(&mp_pck, *map)) {
+                flb_plg_error(ctx->ins, "error encoding to MSGPACK");
+                buf->size = start;
+                pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_ENCODE_ERROR, 1);
+                return -1;
+            }
+            break;
+        }
+    case FLB_PULSAR_SCHEMA_GELF:
+        {
+            if (0 != pulsar_gelf_write(buf, &ctx->gelf, map, tm)) {
+                flb_plg_error(ctx->ins, "error encoding to GELF");
+                buf->size = start;
+                pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_ENCODE_ERROR, 1);
+                return -1;
+            }
+            break;
+        }
+    case FLB_PULSAR_SCHEMA_AVRO:
+        {
+            if (0 != pulsar_avro_write(buf, ctx->avro, map)) {
+                flb_plg_error(ctx->ins, "error encoding to AVRO");
+                buf->size = start;
+                pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_ENCODE_ERROR, 1);
+                return -1;
+            }
             break;
         }
     case FLB_PULSAR_SCHEMA_JSON:
     default:
         {
-            s = flb_msgpack_raw_to_json_sds(mp_sbuf.data, mp_sbuf.size);
-            if (!s) {
+            if (0 != pulsar_json_write_projected(buf, ctx->projection, map)) {
                 flb_plg_error(ctx->ins, "error encoding to JSON");
-                msgpack_sbuffer_destroy(&mp_sbuf);
-                return false;
+                buf->size = start;
+                pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_ENCODE_ERROR, 1);
+                return -1;
             }
-            out_buf  = s;
-            out_size = flb_sds_len(out_buf);
             break;
         }
     }
 
-    bool ret = ctx->send_msg_func(ctx, out_buf, out_size);
+    *out = buf->data + start;
+    *out_size = buf->size - start;
+    return 0;
+}
+
+// detailed numbers are exported as metrics, the log line is a coarse heartbeat
+static void pulsar_output_progress(flb_out_pulsar_ctx *ctx, uint32_t records)
+{
+    uint64_t success = atomic_fetch_add_explicit(&ctx->success_number, records, memory_order_relaxed) + records;
+    if ((success - records) / ctx->show_interval != success / ctx->show_interval) {
+        flb_plg_info(ctx->ins, "output progress, total: %"PRIu64", success: %"PRIu64", failed: %"PRIu64", discarded: %"PRIu64,
+            (uint64_t) PULSAR_COUNTER_GET(ctx->total_number), success,
+            (uint64_t) PULSAR_COUNTER_GET(ctx->failed_number), (uint64_t) PULSAR_COUNTER_GET(ctx->discarded_number));
+    }
+}
+
+// room for the properties zstdCompression adds after the ones of the record
+#define PULSAR_ZSTD_PROPERTIES_LEN  64
+
+/*
+ * Hand a payload to the producers. With zstdCompression it goes as a zstd
+ * frame, made in the arena, with the properties consumers decompress it
+ * with; a payload the frame would not make smaller goes as it is.
+ */
+static bool pulsar_send_payload(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_arena *arena,
+                                struct pulsar_msg_attrs *attrs, const char *data, size_t size)
+{
+    size_t len = 0;
+    const char *dict_id;
+    char properties[PULSAR_MAX_PROPERTIES_LEN + PULSAR_ZSTD_PROPERTIES_LEN];
+
+    if (!ctx->zstd || 0 != pulsar_zstd_compress(ctx->zstd, &arena->zstd_cctx, &arena->compress, data, size, &dict_id)) {
+        return ctx->send_msg_func(ctx, flush, attrs, data, size);
+    }
+
+    if (attrs->properties) {
+        memcpy(properties, attrs->properties, attrs->properties_len);
+        len = attrs->properties_len;
+    }
+    pulsar_property_append(properties, sizeof(properties), &len, PULSAR_PROPERTY_COMPRESSION,
+                           sizeof(PULSAR_PROPERTY_COMPRESSION) - 1, "zstd");
+    pulsar_property_append(properties, sizeof(properties), &len, PULSAR_PROPERTY_ZSTD_DICT_ID,
+                           sizeof(PULSAR_PROPERTY_ZSTD_DICT_ID) - 1, dict_id);
+    attrs->properties = properties;
+    attrs->properties_len = len;
+
+    pulsar_metrics_compressed(&ctx->metrics, size, arena->compress.size);
+    return ctx->send_msg_func(ctx, flush, attrs, arena->compress.data, arena->compress.size);
+}
+
+bool flb_pulsar_output_msg(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_arena *arena,
+                           const char *tag, int tag_len, struct flb_log_event *event,
+                           const char *raw, size_t raw_size)
+{
+    bool ret;
+    msgpack_object *map = event->body;
+    struct flb_time *tm = &event->timestamp;
+    flb_sds_t topic = NULL;
+    const char *out_buf;
+    size_t out_size;
+    struct pulsar_attrs_buf attrs_buf;
+    struct pulsar_msg_attrs attrs = { 0 };
+
+    flb_debug("in produce_message\n");
+    if (flb_log_check(FLB_LOG_DEBUG))
+        msgpack_object_print(stderr, *map);
+
+    if (0 != pulsar_record_attrs(ctx, tag, tag_len, map, event->metadata, tm, &attrs, &attrs_buf, &topic)) {
+        return false;
+    }
+
+    pulsar_buffer_reset(&arena->encode);
+    if (0 != pulsar_encode_record(ctx, &arena->encode, map, tm, raw, raw_size, &out_buf, &out_size)) {
+        ret = false;
+        goto out;
+    }
+    if (ctx->zstd && pulsar_zstd_collecting(ctx->zstd)) {
+        pulsar_zstd_sample(ctx->zstd, out_buf, out_size);
+    }
+
+    ret = pulsar_send_payload(ctx, flush, arena, &attrs, out_buf, out_size);
+    if (ret) {
+        pulsar_output_progress(ctx, 1);
+    }
+
+out:
+    if (topic) {
+        flb_sds_destroy(topic);
+    }
+    return ret;
+}
+
+/*
+ * chunkPacking: records sharing topic and partition key are packed into one
+ * message, as newline delimited text or as a msgpack array of the records.
+ */
+struct pulsar_pack {
+    struct pulsar_arena *arena;  // of the flush
+    struct pulsar_buffer *buf;   // the pack buffer of the arena
+    uint32_t records;
+    flb_sds_t topic;
+    bool has_key;
+    char key[PULSAR_MAX_KEY_LEN];
+    char properties[PULSAR_MAX_PROPERTIES_LEN];
+    size_t properties_len;
+    uint64_t event_time;      // of the first record
+};
+
+#define PULSAR_PACK_MSGP_HEADER_SIZE  5
+
+static void pulsar_pack_reset(flb_out_pulsar_ctx *ctx, struct pulsar_pack *pack)
+{
+    pulsar_buffer_reset(pack->buf);
+    pack->records = 0;
+    if (pack->topic) {
+        flb_sds_destroy(pack->topic);
+        pack->topic = NULL;
+    }
+    pack->has_key = false;
+    pack->properties_len = 0;
+
+    // room for an array32 header, filled in once the record count is known
+    if (FLB_PULSAR_SCHEMA_MSGP == ctx->data_schema) {
+        pack->buf->size = PULSAR_PACK_MSGP_HEADER_SIZE;
+    }
+}
+
+static bool pulsar_pack_send(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_pack *pack)
+{
+    bool ret;
+    struct pulsar_msg_attrs attrs = { 0 };
+
+    if (0 == pack->records) {
+        return true;
+    }
+
+    if (FLB_PULSAR_SCHEMA_MSGP == ctx->data_schema) {
+        pack->buf->data[0] = (char) 0xdd;
+        pack->buf->data[1] = (char) (pack->records >> 24);
+        pack->buf->data[2] = (char) (pack->records >> 16);
+        pack->buf->data[3] = (char) (pack->records >> 8);
+        pack->buf->data[4] = (char) pack->records;
+    }
+
+    attrs.partition_key = pack->has_key ? pack->key : NULL;
+    attrs.topic = pack->topic;
+    attrs.topic_len = pack->topic ? flb_sds_len(pack->topic) : 0;
+    attrs.record_count = pack->records;
+    attrs.properties = 0 < pack->properties_len ? pack->properties : NULL;
+    attrs.properties_len = pack->properties_len;
+    attrs.event_time = pack->event_time;
+
+    ret = pulsar_send_payload(ctx, flush, pack->arena, &attrs, pack->buf->data, pack->buf->size);
     if (ret) {
-        ++ctx->success_number;
-        if (0 == ctx->success_number % ctx->show_interval) {
-            flb_plg_info(ctx->ins, "output progress, total: %"PRIu64", success: %"PRIu64", failed: %"PRIu64", discarded: %"PRIu64", last msg: %s",
-                ctx->total_number, ctx->success_number, ctx->failed_number, ctx->discarded_number, out_buf);
+        pulsar_output_progress(ctx, pack->records);
+    } else {
+        atomic_fetch_add_explicit(&ctx->failed_number, pack->records, memory_order_relaxed);
+    }
+
+    pulsar_pack_reset(ctx, pack);
+    return ret;
+}
+
+static bool pulsar_pack_same_target(struct pulsar_pack *pack, struct pulsar_msg_attrs *attrs)
+{
+    if (pack->has_key != (attrs->partition_key != NULL)
+        || (pack->has_key && 0 != strcmp(pack->key, attrs->partition_key))) {
+        return false;
+    }
+    if ((pack->topic != NULL) != (attrs->topic != NULL)
+        || (pack->topic && (flb_sds_len(pack->topic) != attrs->topic_len
+                            || 0 != memcmp(pack->topic, attrs->topic, attrs->topic_len)))) {
+        return false;
+    }
+    // consumers filter on properties, so a message only holds records sharing them
+    if (pack->properties_len != attrs->properties_len
+        || (0 < attrs->properties_len && 0 != memcmp(pack->properties, attrs->properties, attrs->properties_len))) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Add a record to the pack. The pack is sent first when the record goes to
+ * another topic or key, or when the record would make it exceed the byte
+ * limit, and afterwards once it reaches the record limit. Returns false if
+ * the record itself could not be resolved or encoded.
+ */
+static bool pulsar_pack_add(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_pack *pack,
+                            const char *tag, int tag_len, struct flb_log_event *event,
+                            const char *raw, size_t raw_size)
+{
+    bool ret = true;
+    msgpack_object *map = event->body;
+    struct flb_time *tm = &event->timestamp;
+    flb_sds_t topic = NULL;
+    size_t start;
+    size_t len;
+    size_t max_bytes;
+    const char *out_buf;
+    size_t out_size;
+    struct pulsar_attrs_buf attrs_buf;
+    struct pulsar_msg_attrs attrs = { 0 };
+
+    if (0 != pulsar_record_attrs(ctx, tag, tag_len, map, event->metadata, tm, &attrs, &attrs_buf, &topic)) {
+        return false;
+    }
+
+    if (0 < pack->records && !pulsar_pack_same_target(pack, &attrs)) {
+        pulsar_pack_send(ctx, flush, pack);
+    }
+
+    start = pack->buf->size;
+    if (0 != pulsar_encode_record(ctx, pack->buf, map, tm, raw, raw_size, &out_buf, &out_size)
+        || (out_buf != pack->buf->data + start && 0 != pulsar_buffer_append(pack->buf, out_buf, out_size))
+        || (FLB_PULSAR_SCHEMA_MSGP != ctx->data_schema && 0 != pulsar_buffer_putc(pack->buf, '\n'))) {
+        pack->buf->size = start;
+        ret = false;
+        goto out;
+    }
+    if (ctx->zstd && pulsar_zstd_collecting(ctx->zstd)) {
+        pulsar_zstd_sample(ctx->zstd, pack->buf->data + start, out_size);
+    }
+
+    pulsar_adaptive_record(&ctx->adaptive, pack->buf->size - start);
+    max_bytes = pulsar_adaptive_bytes_limit(&ctx->adaptive);
+    if (0 < pack->records && pack->buf->size > max_bytes) {
+        // send the pack without this record, which then starts the next one
+        len = pack->buf->size - start;
+        pack->buf->size = start;
+        pulsar_pack_send(ctx, flush, pack);
+        memmove(pack->buf->data + pack->buf->size, pack->buf->data + start, len);
+        pack->buf->size += len;
+    }
+
+    if (0 == pack->records) {
+        pack->topic = topic;
+        topic = NULL;
+        if (attrs.partition_key) {
+            pack->has_key = true;
+            snprintf(pack->key, sizeof(pack->key), "%s", attrs.partition_key);
         }
+        memcpy(pack->properties, attrs_buf.properties, attrs.properties_len);
+        pack->properties_len = attrs.properties_len;
+        pack->event_time = attrs.event_time;
     }
-    if (s) {
-        flb_sds_destroy(s);
+    ++pack->records;
+
+    if (pack->records >= pulsar_adaptive_records_limit(&ctx->adaptive) || pack->buf->size >= max_bytes) {
+        pulsar_pack_send(ctx, flush, pack);
     }
 
-    msgpack_sbuffer_destroy(&mp_sbuf);
+out:
+    if (topic) {
+        flb_sds_destroy(topic);
+    }
     return ret;
 }
 
@@ -85,34 +652,125 @@ static int cb_pulsar_init(struct flb_output_instance *ins, struct flb_config *co
     return 0;
 }
 
+/*
+ * Send every record of a chunk and wait for the outcome: FLB_OK once all
+ * of them are persisted by the broker, FLB_RETRY otherwise.
+ */
+int flb_pulsar_flush_chunk(flb_out_pulsar_ctx *ctx, const char *tag, int tag_len,
+                           const char *data, size_t size)
+{
+    int ret;
+    const char *raw;
+    size_t raw_size;
+    struct flb_log_event event;
+    struct flb_log_event_decoder decoder;
+    bool sent;
+    double rate;
+    struct pulsar_pack pack;
+    struct pulsar_arena *arena;
+    struct pulsar_flush_ctx *flush;
+
+    flush = flb_pulsar_flush_create();
+    if (!flush) {
+        flb_plg_error(ctx->ins, "allocate flush context failed.");
+        return FLB_RETRY;
+    }
+
+    // encode buffers reused by every record of the chunk, and by the next flushes
+    arena = pulsar_arena_acquire(&ctx->arenas);
+    if (!arena) {
+        flb_plg_error(ctx->ins, "allocate encode buffers failed.");
+        flb_pulsar_flush_release(flush);
+        return FLB_RETRY;
+    }
+
+    if (ctx->chunk_packing) {
+        memset(&pack, 0, sizeof(pack));
+        pack.arena = arena;
+        pack.buf = &arena->pack;
+        pulsar_pack_reset(ctx, &pack);
+    }
+
+    // records are decoded in place, their metadata comes along with the 2.x event format
+    ret = flb_log_event_decoder_init(&decoder, (char *) data, size);
+    if (FLB_EVENT_DECODER_SUCCESS != ret) {
+        flb_plg_error(ctx->ins, "log event decoder initialization error: %d", ret);
+        pulsar_arena_release(&ctx->arenas, arena);
+        flb_pulsar_flush_release(flush);
+        return FLB_RETRY;
+    }
+
+    while (FLB_EVENT_DECODER_SUCCESS == flb_log_event_decoder_next(&decoder, &event)) {
+        PULSAR_COUNTER_INC(ctx->total_number);
+        // the raw bytes of the event, for the MSGPACK schema to reuse its body
+        raw = data + decoder.previous_offset;
+        raw_size = decoder.offset - decoder.previous_offset;
+        if (ctx->chunk_packing) {
+            sent = pulsar_pack_add(ctx, flush, &pack, tag, tag_len, &event, raw, raw_size);
+        } else {
+            sent = flb_pulsar_output_msg(ctx, flush, arena, tag, tag_len, &event, raw, raw_size);
+        }
+        if (!sent) {
+            PULSAR_COUNTER_INC(ctx->failed_number);
+        }
+    }
+
+    flb_log_event_decoder_destroy(&decoder);
+    if (ctx->chunk_packing) {
+        pulsar_pack_send(ctx, flush, &pack);
+        pulsar_pack_reset(ctx, &pack);
+    }
+    // sync sends are done and async payloads were copied, the buffers are free again
+    pulsar_arena_release(&ctx->arenas, arena);
+
+    if (pulsar_adaptive_update(&ctx->adaptive, pulsar_metrics_now_ns(), &rate)) {
+        pulsar_metrics_batching(&ctx->metrics, pulsar_adaptive_records_limit(&ctx->adaptive),
+                                pulsar_adaptive_bytes_limit(&ctx->adaptive), rate);
+        flb_plg_debug(ctx->ins, "adaptive batching: %.0f records/s, %u records, %"PRIu64" bytes per message",
+                      rate, pulsar_adaptive_records_limit(&ctx->adaptive),
+                      pulsar_adaptive_bytes_limit(&ctx->adaptive));
+    }
+
+    ret = flb_pulsar_flush_wait(ctx, flush);
+    flb_pulsar_flush_release(flush);
+    // taken from the atomics of the pool once per chunk, not on every send
+    if (ctx->callback_pool) {
+        pulsar_metrics_pool(&ctx->metrics, atomic_load(&ctx->callback_pool->hits),
+                            atomic_load(&ctx->callback_pool->misses), atomic_load(&ctx->callback_pool->retained));
+    }
+    return ret;
+}
+
 static void cb_pulsar_flush(struct flb_event_chunk *event_chunk,
                             struct flb_output_flush *out_flush,
                             struct flb_input_instance *i_ins,
                             void *out_context,
                             struct flb_config *config)
 {
-    size_t off = 0;
-    struct flb_time tms;
-    msgpack_object *obj;
-    msgpack_unpacked result;
     flb_out_pulsar_ctx *ctx = out_context;
+    int ret = flb_pulsar_flush_chunk(ctx, event_chunk->tag, flb_sds_len(event_chunk->tag),
+                                     event_chunk->data, event_chunk->size);
+    FLB_OUTPUT_RETURN(ret);
+}
 
-    msgpack_unpacked_init(&result);
-    while (MSGPACK_UNPACK_SUCCESS == msgpack_unpack_next(&result, event_chunk->data, event_chunk->size, &off)) {
-        ++ctx->total_number;
-        flb_time_pop_from_msgpack(&tms, &result, &obj);
-        if (!flb_pulsar_output_msg(ctx, obj, &tms)) {
-            ++ctx->failed_number;
-        }
-    }
+static int cb_pulsar_worker_init(void *data, struct flb_config *config)
+{
+    flb_out_pulsar_ctx *ctx = data;
+    return flb_out_pulsar_worker_init(ctx);
+}
 
-    msgpack_unpacked_destroy(&result);
-    FLB_OUTPUT_RETURN(FLB_OK);
+static int cb_pulsar_worker_exit(void *data, struct flb_config *config)
+{
+    flb_out_pulsar_ctx *ctx = data;
+    flb_out_pulsar_worker_exit(ctx);
+    return 0;
 }
 
 static int cb_pulsar_exit(void *data, struct flb_config *config)
 {
     flb_out_pulsar_ctx *ctx = data;
+    // the messages the producers still hold go out before they are closed
+    flb_out_pulsar_drain(ctx);
     flb_plg_info(ctx->ins, "exit pulsar ok!");
     flb_out_pulsar_destroy(ctx);
 
@@ -125,29 +783,205 @@ static struct flb_config_map config_map[] = {
         FLB_CONFIG_MAP_STR, PULSAR_KEY_BROKER_URL, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, pulsar_broker_url),
         "pulsar broker or proxy url."
     },
+    {
+        FLB_CONFIG_MAP_SLIST_3, PULSAR_KEY_CLUSTER, (char *)NULL, FLB_CONFIG_MAP_MULT, FLB_TRUE, offsetof(flb_out_pulsar_ctx, cluster_entries),
+        "another pulsar cluster taking the static topic, as <url> [priority] [weight]; may be repeated."
+    },
+    {
+        FLB_CONFIG_MAP_DOUBLE, OUTPUT_KEY_FAILOVER_ERROR_RATE, PULSAR_CLUSTER_DEFAULT_ERROR_RATE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, failover_error_rate),
+        "error rate above which a cluster is taken out of the traffic."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_FAILOVER_LATENCY, PULSAR_CLUSTER_DEFAULT_LATENCY_MS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, failover_latency_ms),
+        "ack latency, or time without any ack, above which a cluster is taken out of the traffic."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_FAILOVER_RECOVERY, PULSAR_CLUSTER_DEFAULT_RECOVERY_S, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, failover_recovery_s),
+        "seconds a cluster stays out before it is probed, and is probed before it takes its share again."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_DRAIN_TIMEOUT, DEFAULT_DRAIN_TIMEOUT_MS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, drain_timeout_ms),
+        "milliseconds given on exit to flush the messages the producers hold and close them, 0 to close them directly."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_INFLIGHT_MAX_BYTES, DEFAULT_INFLIGHT_MAX_BYTES, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, inflight_max_bytes),
+        "payload bytes of the async sends waiting for their ack above which the output pauses, 0 for no limit."
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_ZSTD_COMPRESSION, "false", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, zstd_compression),
+        "compress the payloads with zstd in the plugin, tagged with the properties to decompress them."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_ZSTD_LEVEL, PULSAR_ZSTD_DEFAULT_LEVEL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, zstd_level),
+        "zstd compression level."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_ZSTD_DICTIONARY, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, zstd_dictionary),
+        "zstd dictionary file, trained from the first records and written there when it does not exist."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_ZSTD_TRAIN_RECORDS, PULSAR_ZSTD_DEFAULT_TRAIN_RECORDS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, zstd_train_records),
+        "records the zstd dictionary is trained on, 0 to only load it."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_ZSTD_DICTIONARY_SIZE, PULSAR_ZSTD_DEFAULT_DICT_SIZE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, zstd_dictionary_size),
+        "max size of a trained zstd dictionary."
+    },
     {
         FLB_CONFIG_MAP_STR, PULSAR_KEY_AUTH_TOKEN, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, pulsar_auth_token),
         "pulsar authentication token."
     },
     {
         FLB_CONFIG_MAP_STR, PULSAR_KEY_TOPIC_NAME, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, pulsar_producer_topic),
-        "pulsar producer topic."
+        "pulsar producer topic, may be a record accessor template like persistent://tenant/$kubernetes['namespace_name']/logs."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_MAX_TOPIC_PRODUCERS, "64", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, max_topic_producers),
+        "templated topic: max number of open topic producers."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_TOPIC_IDLE_TIMEOUT, "300", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, topic_idle_timeout),
+        "templated topic: seconds after which an idle topic producer is closed."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_SPILL_PATH, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, spill_path),
+        "directory of the spill, where messages the broker did not take are kept until they are replayed."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_SPILL_SEGMENT_BYTES, PULSAR_SPILL_DEFAULT_SEGMENT_SIZE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, spill_segment_bytes),
+        "size of a spill segment file."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_SPILL_MAX_BYTES, PULSAR_SPILL_DEFAULT_MAX_SIZE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, spill_max_bytes),
+        "max bytes of the spilled messages not replayed yet."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_SPILL_REPLAY_RATE, PULSAR_SPILL_DEFAULT_REPLAY_RATE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, spill_replay_rate),
+        "max number of spilled messages replayed per second, 0 for no limit."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_DEAD_LETTER_TOPIC, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, dead_letter_topic),
+        "topic where messages rejected for good, like too large or schema incompatible ones, are published once."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_DEAD_LETTER_MAX_BYTES, "1M", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, dead_letter_max_bytes),
+        "dead letter topic: payloads larger than this are cut, the original size is kept in a property."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_FAILURE_LOG_RATE, PULSAR_FAILURE_LOG_DEFAULT_RATE, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, failure_log_rate),
+        "max number of send failure log lines per second, the others are counted by result in a summary line."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, OUTPUT_KEY_FAILURE_LOG_PAYLOAD_BYTES, PULSAR_FAILURE_LOG_DEFAULT_PAYLOAD_BYTES, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, failure_log_payload_bytes),
+        "max bytes of the message payload in a failure log line, 0 to omit the payload."
+    },
+    {
+        FLB_CONFIG_MAP_CLIST, OUTPUT_KEY_INCLUDE_KEYS, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, include_keys),
+        "comma separated key paths to send, e.g. log,kubernetes.pod_name. All keys are sent when unset."
+    },
+    {
+        FLB_CONFIG_MAP_CLIST, OUTPUT_KEY_EXCLUDE_KEYS, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, exclude_keys),
+        "comma separated key paths not to send, e.g. kubernetes.annotations."
+    },
+    {
+        FLB_CONFIG_MAP_CLIST, OUTPUT_KEY_RENAME_KEYS, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, rename_keys),
+        "comma separated renames as <key path>:<new name>, e.g. kubernetes.pod_name:pod."
+    },
+    {
+        FLB_CONFIG_MAP_CLIST, OUTPUT_KEY_MESSAGE_PROPERTIES, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, message_properties),
+        "comma separated record fields copied into message properties, as <field> or <name>:<record accessor>, e.g. level,tag:$TAG."
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_METADATA_PROPERTIES, "false", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, metadata_properties),
+        "copy the scalar entries of the record metadata into message properties."
     },
     {
         FLB_CONFIG_MAP_BOOL, PULSAR_KEY_ASYNC_SEND, "true", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, is_async),
         "is sending a message asynchronous ?"
     },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_SYNC_SEND_WINDOW, "1", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, sync_send_window),
+        "sync send: max number of messages of a flush in flight, 1 sends them one by one."
+    },
     {
         FLB_CONFIG_MAP_INT, OUTPUT_KEY_SHOW_INTERNAL, "200", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, show_interval),
         "show progress interval number."
     },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_PRODUCER_PER_WORKER, "false", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, producer_per_worker),
+        "create a dedicated pulsar producer for every flush worker."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_PRODUCER_STRIPES, "1", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, producer_stripes),
+        "number of producers created on the topic, records are spread across them."
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_STRIPE_KEY_AFFINITY, "true", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, stripe_key_affinity),
+        "producer stripes: records with a partition key always go through the same producer."
+    },
+    {
+        FLB_CONFIG_MAP_INT, PULSAR_KEY_IO_THREADS, "0", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, io_threads),
+        "pulsar client: number of IO threads, 0 for the client default."
+    },
+    {
+        FLB_CONFIG_MAP_INT, PULSAR_KEY_MESSAGE_LISTENER_THREADS, "0", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, message_listener_threads),
+        "pulsar client: number of message listener threads, 0 for the client default."
+    },
     {
         FLB_CONFIG_MAP_INT, OUTPUT_KEY_DATA_SCHEMA, "json", 0, FLB_FALSE, 0,
-        "output data schema: json, msgpack, gelf."
+        "output data schema: json, msgpack, gelf, avro."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_AVRO_SCHEMA_FILE, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, avro_schema_file),
+        "avro schema: path of the JSON file defining the record schema."
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_CHUNK_PACKING, "false", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, chunk_packing),
+        "pack many records into one pulsar message: newline delimited, or a msgpack array for MSGPACK."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_CHUNK_PACKING_MAX_RECORDS, "1000", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, chunk_packing_max_records),
+        "chunk packing: max number of records per message."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_CHUNK_PACKING_MAX_BYTES, "1048576", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, chunk_packing_max_bytes),
+        "chunk packing: max size of a message in bytes, a single larger record is still sent."
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, OUTPUT_KEY_ADAPTIVE_BATCHING, "false", 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, adaptive_batching),
+        "enable chunk packing and size the packs from the record rate and the ack latency, within the chunk packing limits."
     },
     {
-        FLB_CONFIG_MAP_INT, PULSAR_KEY_MEMORY_LIMIT, (char *)NULL, 0, FLB_FALSE, 0,
-        "pulsar client memory limit."
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_ADAPTIVE_BATCHING_MIN_RECORDS, PULSAR_ADAPTIVE_DEFAULT_MIN_RECORDS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, adaptive_min_records),
+        "adaptive batching: min number of records per message."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_ADAPTIVE_BATCHING_DELAY, PULSAR_ADAPTIVE_DEFAULT_DELAY_MS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, adaptive_delay_ms),
+        "adaptive batching: records arriving within this many milliseconds are packed together."
+    },
+    {
+        FLB_CONFIG_MAP_INT, OUTPUT_KEY_ADAPTIVE_BATCHING_LATENCY, PULSAR_ADAPTIVE_DEFAULT_LATENCY_MS, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, adaptive_latency_ms),
+        "adaptive batching: ack latency in milliseconds above which packs grow, 0 to ignore the latency."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_GELF_SHORT_MESSAGE_KEY, PULSAR_GELF_DEFAULT_SHORT_MESSAGE_KEY, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, gelf.short_message_key),
+        "gelf schema: record key of the short message."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_GELF_FULL_MESSAGE_KEY, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, gelf.full_message_key),
+        "gelf schema: record key of the full message."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_GELF_HOST_KEY, PULSAR_GELF_DEFAULT_HOST_KEY, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, gelf.host_key),
+        "gelf schema: record key of the host, the local hostname is used if missing."
+    },
+    {
+        FLB_CONFIG_MAP_STR, OUTPUT_KEY_GELF_LEVEL_KEY, PULSAR_GELF_DEFAULT_LEVEL_KEY, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, gelf.level_key),
+        "gelf schema: record key of the level, numeric or a syslog level name."
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, PULSAR_KEY_MEMORY_LIMIT, (char *)NULL, 0, FLB_FALSE, 0,
+        "pulsar client memory limit of the pending messages, 0 for no limit."
     },
     {
         FLB_CONFIG_MAP_STR, PULSAR_KEY_PRODUCER_NAME, (char *)NULL, 0, FLB_FALSE, 0,
@@ -205,6 +1039,14 @@ static struct flb_config_map config_map[] = {
         FLB_CONFIG_MAP_INT, PULSAR_KEY_MAX_PENDING_MASSAGES_PARTITIONS, (char *)NULL, 0, FLB_FALSE, 0,
         "pulsar producer: number of max pending messages across all the partitions."
     },
+    {
+        FLB_CONFIG_MAP_STR, PULSAR_KEY_PARTITION_KEY, (char *)NULL, 0, FLB_TRUE, offsetof(flb_out_pulsar_ctx, partition_key),
+        "record accessor pattern of the message partition key, e.g. $kubernetes['pod_name']."
+    },
+    {
+        FLB_CONFIG_MAP_STR, PULSAR_KEY_BATCHING_TYPE, (char *)NULL, 0, FLB_FALSE, 0,
+        "pulsar producer batching type: Default or KeyBased."
+    },
     /* EOF */
     {0}
 };
@@ -215,6 +1057,9 @@ struct flb_output_plugin out_pulsar_plugin = {
     .cb_init      = cb_pulsar_init,
     .cb_flush     = cb_pulsar_flush,
     .cb_exit      = cb_pulsar_exit,
+    .cb_worker_init = cb_pulsar_worker_init,
+    .cb_worker_exit = cb_pulsar_worker_exit,
     .config_map   = config_map,
+    .workers      = DEFAULT_WORKERS,
     .flags        = 0,
 };
@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "pulsar_adaptive.h"
+
+// bytes limit headroom over the expected pack size, for records larger than average
+#define ADAPTIVE_BYTES_HEADROOM  1.25
+#define ADAPTIVE_MIN_BYTES       1024
+
+void pulsar_adaptive_init(struct pulsar_adaptive *a)
+{
+    memset(a, 0, sizeof(struct pulsar_adaptive));
+    pthread_mutex_init(&a->lock, NULL);
+}
+
+void pulsar_adaptive_configure(struct pulsar_adaptive *a, bool enabled, uint32_t min_records, uint32_t max_records,
+                               uint64_t max_bytes, int delay_ms, int latency_ms)
+{
+    a->enabled = enabled;
+    a->max_records = 0 < max_records ? max_records : 1;
+    a->min_records = 0 < min_records && min_records <= a->max_records ? min_records : 1;
+    a->max_bytes = max_bytes;
+    a->delay_ms = 0 < delay_ms ? delay_ms : 1;
+    a->latency_ms = latency_ms;
+
+    // static limits, or the bounds until the first window is measured
+    atomic_store(&a->records_limit, a->max_records);
+    atomic_store(&a->bytes_limit, a->max_bytes);
+}
+
+void pulsar_adaptive_destroy(struct pulsar_adaptive *a)
+{
+    pthread_mutex_destroy(&a->lock);
+}
+
+bool pulsar_adaptive_update(struct pulsar_adaptive *a, uint64_t now_ns, double *rate)
+{
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t acks;
+    uint64_t ack_ns;
+    uint64_t elapsed;
+    double target;
+    double latency_ms;
+    double limit_bytes;
+    uint32_t limit_records;
+
+    if (!a->enabled || 0 != pthread_mutex_trylock(&a->lock)) {
+        return false;
+    }
+    if (0 == a->window_start) {
+        a->window_start = now_ns;
+        pthread_mutex_unlock(&a->lock);
+        return false;
+    }
+    elapsed = now_ns - a->window_start;
+    if (elapsed < PULSAR_ADAPTIVE_INTERVAL_NS) {
+        pthread_mutex_unlock(&a->lock);
+        return false;
+    }
+
+    records = atomic_exchange(&a->records, 0);
+    bytes = atomic_exchange(&a->bytes, 0);
+    acks = atomic_exchange(&a->acks, 0);
+    ack_ns = atomic_exchange(&a->ack_ns, 0);
+    a->window_start = now_ns;
+
+    a->rate = (double) records * 1e9 / elapsed;
+    if (0 < records) {
+        a->record_size = (double) bytes / records;
+    }
+
+    // the records arriving within the delay share a message
+    target = a->rate * a->delay_ms / 1000.0;
+
+    // a slow broker costs per message: fewer and larger messages while it lasts
+    if (0 < acks && 0 < a->latency_ms) {
+        latency_ms = (double) ack_ns / acks / 1e6;
+        if (latency_ms > a->latency_ms) {
+            target *= latency_ms / a->latency_ms < PULSAR_ADAPTIVE_MAX_LATENCY_SCALE
+                      ? latency_ms / a->latency_ms : PULSAR_ADAPTIVE_MAX_LATENCY_SCALE;
+        }
+    }
+
+    // smooth over windows, so a single burst does not swing the limits
+    a->target = 0 < a->target ? (a->target + target) / 2 : target;
+
+    if (a->target < a->min_records) {
+        limit_records = a->min_records;
+    } else if (a->target > a->max_records) {
+        limit_records = a->max_records;
+    } else {
+        limit_records = (uint32_t) (a->target + 0.5);
+    }
+
+    limit_bytes = limit_records * a->record_size * ADAPTIVE_BYTES_HEADROOM;
+    if (limit_bytes < ADAPTIVE_MIN_BYTES) {
+        limit_bytes = ADAPTIVE_MIN_BYTES;
+    }
+    if (limit_bytes > a->max_bytes) {
+        limit_bytes = a->max_bytes;
+    }
+
+    atomic_store_explicit(&a->records_limit, limit_records, memory_order_relaxed);
+    atomic_store_explicit(&a->bytes_limit, (uint64_t) limit_bytes, memory_order_relaxed);
+    *rate = a->rate;
+    pthread_mutex_unlock(&a->lock);
+    return true;
+}
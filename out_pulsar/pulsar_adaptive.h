@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define PULSAR_ADAPTIVE_DEFAULT_MIN_RECORDS  "1"
+#define PULSAR_ADAPTIVE_DEFAULT_DELAY_MS     "50"
+#define PULSAR_ADAPTIVE_DEFAULT_LATENCY_MS   "100"
+#define PULSAR_ADAPTIVE_INTERVAL_NS          1000000000ULL
+#define PULSAR_ADAPTIVE_MAX_LATENCY_SCALE    8.0
+
+/*
+ * Adaptive chunkPacking limits. Flush workers report the records they pack
+ * and the send callbacks the ack latency; once per interval the controller
+ * sizes packs to hold the records arriving within `delay_ms`, grown while the
+ * ack latency is above `latency_ms`, within [min_records, max_records] and
+ * max_bytes. The limits are read lock-free by the packing code.
+ */
+struct pulsar_adaptive {
+    bool enabled;
+    uint32_t min_records;
+    uint32_t max_records;
+    uint64_t max_bytes;
+    int delay_ms;
+    int latency_ms;
+
+    // limits in use
+    atomic_uint_fast32_t records_limit;
+    atomic_uint_fast64_t bytes_limit;
+
+    // counters of the current window
+    atomic_uint_fast64_t records;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t acks;
+    atomic_uint_fast64_t ack_ns;
+
+    // controller state, updated by one flush at a time
+    pthread_mutex_t lock;
+    uint64_t window_start;
+    double target;
+    double record_size;
+    double rate;
+};
+
+void pulsar_adaptive_init(struct pulsar_adaptive *a);
+// set the bounds, the limits stay at max_records and max_bytes when not enabled
+void pulsar_adaptive_configure(struct pulsar_adaptive *a, bool enabled, uint32_t min_records, uint32_t max_records,
+                               uint64_t max_bytes, int delay_ms, int latency_ms);
+void pulsar_adaptive_destroy(struct pulsar_adaptive *a);
+
+/*
+ * Run the controller if the window is over and no other flush is doing it.
+ * Returns true when new limits were computed, for the measured `rate`.
+ */
+bool pulsar_adaptive_update(struct pulsar_adaptive *a, uint64_t now_ns, double *rate);
+
+static inline uint32_t pulsar_adaptive_records_limit(struct pulsar_adaptive *a)
+{
+    return (uint32_t) atomic_load_explicit(&a->records_limit, memory_order_relaxed);
+}
+
+static inline uint64_t pulsar_adaptive_bytes_limit(struct pulsar_adaptive *a)
+{
+    return atomic_load_explicit(&a->bytes_limit, memory_order_relaxed);
+}
+
+// a record of `bytes` encoded bytes was packed
+static inline void pulsar_adaptive_record(struct pulsar_adaptive *a, size_t bytes)
+{
+    if (a->enabled) {
+        atomic_fetch_add_explicit(&a->records, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&a->bytes, bytes, memory_order_relaxed);
+    }
+}
+
+// a message sent at send_ns (monotonic) was acked
+static inline void pulsar_adaptive_ack(struct pulsar_adaptive *a, uint64_t send_ns, uint64_t now_ns)
+{
+    if (a->enabled) {
+        atomic_fetch_add_explicit(&a->acks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&a->ack_ns, now_ns - send_ns, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,90 @@
+#include <fluent-bit/flb_mem.h>
+
+#include "pulsar_arena.h"
+#include "pulsar_zstd.h"
+
+void pulsar_arena_pool_init(struct pulsar_arena_pool *pool)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free = NULL;
+    pool->free_count = 0;
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+}
+
+static void arena_free(struct pulsar_arena *arena)
+{
+    pulsar_buffer_destroy(&arena->encode);
+    pulsar_buffer_destroy(&arena->pack);
+    pulsar_buffer_destroy(&arena->compress);
+    pulsar_zstd_cctx_free(arena->zstd_cctx);
+    flb_free(arena);
+}
+
+void pulsar_arena_pool_destroy(struct pulsar_arena_pool *pool)
+{
+    struct pulsar_arena *arena;
+
+    while (pool->free) {
+        arena = pool->free;
+        pool->free = arena->next;
+        arena_free(arena);
+    }
+    pool->free_count = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+struct pulsar_arena* pulsar_arena_acquire(struct pulsar_arena_pool *pool)
+{
+    struct pulsar_arena *arena;
+
+    pthread_mutex_lock(&pool->lock);
+    arena = pool->free;
+    if (arena) {
+        pool->free = arena->next;
+        pool->free_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (arena) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+        arena->next = NULL;
+        return arena;
+    }
+
+    // the buffers get their capacity from the first records written to them
+    atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    arena = flb_calloc(1, sizeof(struct pulsar_arena));
+    if (!arena) {
+        flb_errno();
+    }
+    return arena;
+}
+
+static void arena_trim(struct pulsar_buffer *buf)
+{
+    if (buf->capacity > PULSAR_ARENA_MAX_RETAINED) {
+        pulsar_buffer_destroy(buf);
+    }
+    pulsar_buffer_reset(buf);
+}
+
+void pulsar_arena_release(struct pulsar_arena_pool *pool, struct pulsar_arena *arena)
+{
+    arena_trim(&arena->encode);
+    arena_trim(&arena->pack);
+    arena_trim(&arena->compress);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < PULSAR_ARENA_MAX_FREE) {
+        arena->next = pool->free;
+        pool->free = arena;
+        pool->free_count++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (arena) {
+        arena_free(arena);
+    }
+}
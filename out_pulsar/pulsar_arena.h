@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pulsar_buffer.h"
+
+// buffers grown past this by a large chunk are freed when the flush ends
+#define PULSAR_ARENA_MAX_RETAINED  (4 * 1024 * 1024)
+// arenas kept for reuse, about one per concurrent flush
+#define PULSAR_ARENA_MAX_FREE      16
+
+/*
+ * Encode buffers of one flush. A flush takes an arena from the pool, its
+ * encoders reset and refill the buffers record after record, and the arena
+ * goes back to the pool with its capacity once the flush is done, so steady
+ * flushes do not allocate. Async payloads are copied to the callback pool
+ * before the send, so nothing in an arena outlives its flush.
+ */
+struct pulsar_arena {
+    struct pulsar_buffer encode;   // a record, when records are sent one by one
+    struct pulsar_buffer pack;     // the message being packed, with chunkPacking
+    struct pulsar_buffer compress; // the zstd frame of a payload, with zstdCompression
+    void *zstd_cctx;               // compression context, kept with the arena
+    struct pulsar_arena *next;
+};
+
+struct pulsar_arena_pool {
+    pthread_mutex_t lock;
+    struct pulsar_arena *free;
+    uint32_t free_count;
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+};
+
+void pulsar_arena_pool_init(struct pulsar_arena_pool *pool);
+void pulsar_arena_pool_destroy(struct pulsar_arena_pool *pool);
+
+// an arena with empty buffers, NULL if it cannot be allocated
+struct pulsar_arena* pulsar_arena_acquire(struct pulsar_arena_pool *pool);
+void pulsar_arena_release(struct pulsar_arena_pool *pool, struct pulsar_arena *arena);
@@ -0,0 +1,693 @@
+#include <stdio.h>
+
+#include <fluent-bit/flb_output_plugin.h>
+#include <fluent-bit/flb_pack.h>
+
+#include "pulsar_avro.h"
+
+#define AVRO_MAX_SCHEMA_SIZE  (1 << 20)
+
+static const msgpack_object avro_nil = { .type = MSGPACK_OBJECT_NIL };
+
+static const struct {
+    const char *name;
+    enum pulsar_avro_kind kind;
+} avro_primitives[] = {
+    { "null", PULSAR_AVRO_NULL }, { "boolean", PULSAR_AVRO_BOOLEAN }, { "int", PULSAR_AVRO_INT },
+    { "long", PULSAR_AVRO_LONG }, { "float", PULSAR_AVRO_FLOAT }, { "double", PULSAR_AVRO_DOUBLE },
+    { "bytes", PULSAR_AVRO_BYTES }, { "string", PULSAR_AVRO_STRING },
+};
+
+struct avro_parser {
+    struct flb_output_instance *ins;
+    struct pulsar_avro_schema *schema;
+};
+
+static inline int str_equals(const msgpack_object *o, const char *str)
+{
+    return MSGPACK_OBJECT_STR == o->type && o->via.str.size == strlen(str)
+        && 0 == memcmp(o->via.str.ptr, str, o->via.str.size);
+}
+
+static const msgpack_object* map_get(const msgpack_object *map, const char *key)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->via.map.size; i++) {
+        if (str_equals(&map->via.map.ptr[i].key, key)) {
+            return &map->via.map.ptr[i].val;
+        }
+    }
+    return NULL;
+}
+
+static struct pulsar_avro_type* type_new(struct avro_parser *p, enum pulsar_avro_kind kind)
+{
+    struct pulsar_avro_type *type = flb_calloc(1, sizeof(struct pulsar_avro_type));
+    if (!type) {
+        flb_errno();
+        return NULL;
+    }
+    type->kind = kind;
+    type->next = p->schema->types;
+    p->schema->types = type;
+    return type;
+}
+
+static void type_free(struct pulsar_avro_type *type)
+{
+    uint32_t i;
+
+    if (type->name) {
+        flb_sds_destroy(type->name);
+    }
+    for (i = 0; type->fields && i < type->field_count; i++) {
+        if (type->fields[i].name) {
+            flb_sds_destroy(type->fields[i].name);
+        }
+    }
+    for (i = 0; type->symbols && i < type->symbol_count; i++) {
+        if (type->symbols[i]) {
+            flb_sds_destroy(type->symbols[i]);
+        }
+    }
+    flb_free(type->fields);
+    flb_free(type->field_index);
+    flb_free(type->symbols);
+    flb_free(type->branches);
+    flb_free(type);
+}
+
+// full name of a named type: a dotted name is already full, others get the namespace
+static flb_sds_t full_name(const msgpack_object *name, const char *ns)
+{
+    flb_sds_t ret;
+
+    if (!ns || !*ns || memchr(name->via.str.ptr, '.', name->via.str.size)) {
+        return flb_sds_create_len(name->via.str.ptr, name->via.str.size);
+    }
+    ret = flb_sds_create_size(strlen(ns) + 1 + name->via.str.size);
+    if (!ret) {
+        return NULL;
+    }
+    flb_sds_printf(&ret, "%s.%.*s", ns, (int) name->via.str.size, name->via.str.ptr);
+    return ret;
+}
+
+static struct pulsar_avro_type* find_named(struct avro_parser *p, const msgpack_object *name, const char *ns)
+{
+    struct pulsar_avro_type *type;
+    flb_sds_t full = full_name(name, ns);
+
+    if (!full) {
+        return NULL;
+    }
+    for (type = p->schema->types; type; type = type->next) {
+        if (type->name && 0 == strcmp(type->name, full)) {
+            break;
+        }
+    }
+    flb_sds_destroy(full);
+    return type;
+}
+
+static struct pulsar_avro_type* parse_type(struct avro_parser *p, const msgpack_object *o, const char *ns);
+
+// sort the field indexes by name, records have few fields
+static void sort_field_index(struct pulsar_avro_type *type)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t idx;
+
+    for (i = 1; i < type->field_count; i++) {
+        idx = type->field_index[i];
+        for (j = i; 0 < j && 0 < strcmp(type->fields[type->field_index[j - 1]].name, type->fields[idx].name); j--) {
+            type->field_index[j] = type->field_index[j - 1];
+        }
+        type->field_index[j] = idx;
+    }
+}
+
+static int parse_record(struct avro_parser *p, struct pulsar_avro_type *type, const msgpack_object *o,
+                        const char *ns)
+{
+    uint32_t i;
+    const msgpack_object *fields = map_get(o, "fields");
+    const msgpack_object *field;
+    const msgpack_object *name;
+    const msgpack_object *ftype;
+
+    if (!fields || MSGPACK_OBJECT_ARRAY != fields->type || PULSAR_AVRO_MAX_FIELDS < fields->via.array.size) {
+        flb_plg_error(p->ins, "avro record %s needs a list of at most %d fields", type->name, PULSAR_AVRO_MAX_FIELDS);
+        return -1;
+    }
+
+    type->field_count = fields->via.array.size;
+    type->fields = flb_calloc(type->field_count + 1, sizeof(struct pulsar_avro_field));
+    type->field_index = flb_calloc(type->field_count + 1, sizeof(uint32_t));
+    if (!type->fields || !type->field_index) {
+        flb_errno();
+        return -1;
+    }
+
+    for (i = 0; i < type->field_count; i++) {
+        field = &fields->via.array.ptr[i];
+        name = MSGPACK_OBJECT_MAP == field->type ? map_get(field, "name") : NULL;
+        ftype = MSGPACK_OBJECT_MAP == field->type ? map_get(field, "type") : NULL;
+        if (!name || MSGPACK_OBJECT_STR != name->type || !ftype) {
+            flb_plg_error(p->ins, "avro record %s: field %u needs a name and a type", type->name, i);
+            return -1;
+        }
+        type->fields[i].name = flb_sds_create_len(name->via.str.ptr, name->via.str.size);
+        if (!type->fields[i].name) {
+            return -1;
+        }
+        type->fields[i].type = parse_type(p, ftype, ns);
+        if (!type->fields[i].type) {
+            return -1;
+        }
+        type->fields[i].def = map_get(field, "default");
+        type->field_index[i] = i;
+    }
+
+    // record keys are resolved by a binary search on the field names
+    sort_field_index(type);
+    return 0;
+}
+
+static int parse_enum(struct avro_parser *p, struct pulsar_avro_type *type, const msgpack_object *o)
+{
+    uint32_t i;
+    const msgpack_object *symbols = map_get(o, "symbols");
+
+    if (!symbols || MSGPACK_OBJECT_ARRAY != symbols->type || 0 == symbols->via.array.size) {
+        flb_plg_error(p->ins, "avro enum %s needs a list of symbols", type->name);
+        return -1;
+    }
+    type->symbol_count = symbols->via.array.size;
+    type->symbols = flb_calloc(type->symbol_count, sizeof(flb_sds_t));
+    if (!type->symbols) {
+        flb_errno();
+        return -1;
+    }
+    for (i = 0; i < type->symbol_count; i++) {
+        if (MSGPACK_OBJECT_STR != symbols->via.array.ptr[i].type) {
+            flb_plg_error(p->ins, "avro enum %s: symbols must be strings", type->name);
+            return -1;
+        }
+        type->symbols[i] = flb_sds_create_len(symbols->via.array.ptr[i].via.str.ptr,
+                                              symbols->via.array.ptr[i].via.str.size);
+        if (!type->symbols[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// record, enum and fixed: registered under their name before their body is parsed
+static struct pulsar_avro_type* parse_named(struct avro_parser *p, enum pulsar_avro_kind kind,
+                                            const msgpack_object *o, const char *ns)
+{
+    int ret;
+    char inner_ns[256];
+    const msgpack_object *name = map_get(o, "name");
+    const msgpack_object *nspace = map_get(o, "namespace");
+    const msgpack_object *size;
+    struct pulsar_avro_type *type;
+    char *dot;
+
+    if (!name || MSGPACK_OBJECT_STR != name->type) {
+        flb_plg_error(p->ins, "avro named type without a name");
+        return NULL;
+    }
+    if (nspace && MSGPACK_OBJECT_STR == nspace->type) {
+        snprintf(inner_ns, sizeof(inner_ns), "%.*s", (int) nspace->via.str.size, nspace->via.str.ptr);
+        ns = inner_ns;
+    }
+
+    type = type_new(p, kind);
+    if (!type) {
+        return NULL;
+    }
+    type->name = full_name(name, ns);
+    if (!type->name) {
+        return NULL;
+    }
+
+    // names inside are relative to the namespace of the full name
+    snprintf(inner_ns, sizeof(inner_ns), "%s", type->name);
+    dot = strrchr(inner_ns, '.');
+    if (dot) {
+        *dot = '\0';
+    } else {
+        inner_ns[0] = '\0';
+    }
+
+    switch (kind) {
+    case PULSAR_AVRO_RECORD:
+        ret = parse_record(p, type, o, inner_ns);
+        break;
+    case PULSAR_AVRO_ENUM:
+        ret = parse_enum(p, type, o);
+        break;
+    default:
+        size = map_get(o, "size");
+        if (!size || MSGPACK_OBJECT_POSITIVE_INTEGER != size->type) {
+            flb_plg_error(p->ins, "avro fixed %s needs a size", type->name);
+            return NULL;
+        }
+        type->size = size->via.u64;
+        ret = 0;
+        break;
+    }
+    return 0 == ret ? type : NULL;
+}
+
+static struct pulsar_avro_type* parse_type(struct avro_parser *p, const msgpack_object *o, const char *ns)
+{
+    size_t i;
+    const msgpack_object *kind;
+    const msgpack_object *items;
+    struct pulsar_avro_type *type;
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_STR:
+        for (i = 0; i < sizeof(avro_primitives) / sizeof(avro_primitives[0]); i++) {
+            if (str_equals(o, avro_primitives[i].name)) {
+                return type_new(p, avro_primitives[i].kind);
+            }
+        }
+        type = find_named(p, o, ns);
+        if (!type) {
+            flb_plg_error(p->ins, "unknown avro type %.*s", (int) o->via.str.size, o->via.str.ptr);
+        }
+        return type;
+    case MSGPACK_OBJECT_ARRAY:
+        type = type_new(p, PULSAR_AVRO_UNION);
+        if (!type) {
+            return NULL;
+        }
+        type->branch_count = o->via.array.size;
+        type->branches = flb_calloc(type->branch_count + 1, sizeof(struct pulsar_avro_type *));
+        if (!type->branches) {
+            flb_errno();
+            return NULL;
+        }
+        for (i = 0; i < type->branch_count; i++) {
+            type->branches[i] = parse_type(p, &o->via.array.ptr[i], ns);
+            if (!type->branches[i]) {
+                return NULL;
+            }
+        }
+        return type;
+    case MSGPACK_OBJECT_MAP:
+        kind = map_get(o, "type");
+        if (!kind) {
+            break;
+        }
+        if (str_equals(kind, "record") || str_equals(kind, "error")) {
+            return parse_named(p, PULSAR_AVRO_RECORD, o, ns);
+        } else if (str_equals(kind, "enum")) {
+            return parse_named(p, PULSAR_AVRO_ENUM, o, ns);
+        } else if (str_equals(kind, "fixed")) {
+            return parse_named(p, PULSAR_AVRO_FIXED, o, ns);
+        } else if (str_equals(kind, "array") || str_equals(kind, "map")) {
+            items = map_get(o, str_equals(kind, "array") ? "items" : "values");
+            if (!items) {
+                break;
+            }
+            type = type_new(p, str_equals(kind, "array") ? PULSAR_AVRO_ARRAY : PULSAR_AVRO_MAP);
+            if (!type) {
+                return NULL;
+            }
+            type->items = parse_type(p, items, ns);
+            return type->items ? type : NULL;
+        }
+        // a primitive with attributes, e.g. a logical type: encoded as the primitive
+        return parse_type(p, kind, ns);
+    default:
+        break;
+    }
+
+    flb_plg_error(p->ins, "invalid avro type definition");
+    return NULL;
+}
+
+static flb_sds_t read_file(struct flb_output_instance *ins, const char *path)
+{
+    FILE *fp;
+    size_t len;
+    flb_sds_t content;
+    char tmp[4096];
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        flb_errno();
+        flb_plg_error(ins, "cannot open avro schema file %s", path);
+        return NULL;
+    }
+    content = flb_sds_create_size(sizeof(tmp));
+    while (content && 0 < (len = fread(tmp, 1, sizeof(tmp), fp))) {
+        if (AVRO_MAX_SCHEMA_SIZE < flb_sds_len(content) + len) {
+            flb_plg_error(ins, "avro schema file %s is larger than %d bytes", path, AVRO_MAX_SCHEMA_SIZE);
+            flb_sds_destroy(content);
+            content = NULL;
+            break;
+        }
+        if (0 != flb_sds_cat_safe(&content, tmp, len)) {
+            flb_sds_destroy(content);
+            content = NULL;
+        }
+    }
+    fclose(fp);
+    return content;
+}
+
+struct pulsar_avro_schema* pulsar_avro_schema_create(struct flb_output_instance *ins, const char *path)
+{
+    int ret;
+    int root_type;
+    size_t mp_size;
+    size_t consumed;
+    size_t off = 0;
+    struct avro_parser parser;
+    struct pulsar_avro_schema *schema;
+
+    schema = flb_calloc(1, sizeof(struct pulsar_avro_schema));
+    if (!schema) {
+        flb_errno();
+        return NULL;
+    }
+    msgpack_unpacked_init(&schema->unpacked);
+
+    schema->json = read_file(ins, path);
+    if (!schema->json) {
+        goto error;
+    }
+
+    ret = flb_pack_json(schema->json, flb_sds_len(schema->json), &schema->mp_buf, &mp_size,
+                        &root_type, &consumed);
+    if (0 != ret || MSGPACK_UNPACK_SUCCESS != msgpack_unpack_next(&schema->unpacked, schema->mp_buf, mp_size, &off)) {
+        flb_plg_error(ins, "avro schema file %s is not valid JSON", path);
+        goto error;
+    }
+
+    parser.ins = ins;
+    parser.schema = schema;
+    schema->root = parse_type(&parser, &schema->unpacked.data, NULL);
+    if (!schema->root) {
+        goto error;
+    }
+    if (PULSAR_AVRO_RECORD != schema->root->kind) {
+        flb_plg_error(ins, "avro schema of %s must be a record", path);
+        goto error;
+    }
+    schema->name = flb_sds_create(schema->root->name);
+    if (!schema->name) {
+        goto error;
+    }
+    return schema;
+
+error:
+    pulsar_avro_schema_destroy(schema);
+    return NULL;
+}
+
+void pulsar_avro_schema_destroy(struct pulsar_avro_schema *schema)
+{
+    struct pulsar_avro_type *type;
+
+    if (!schema) {
+        return;
+    }
+    while (schema->types) {
+        type = schema->types;
+        schema->types = type->next;
+        type_free(type);
+    }
+    msgpack_unpacked_destroy(&schema->unpacked);
+    if (schema->mp_buf) {
+        flb_free(schema->mp_buf);
+    }
+    if (schema->json) {
+        flb_sds_destroy(schema->json);
+    }
+    if (schema->name) {
+        flb_sds_destroy(schema->name);
+    }
+    flb_free(schema);
+}
+
+/*
+ * encoding
+ */
+
+static int write_long(struct pulsar_buffer *buf, int64_t n)
+{
+    uint64_t v = ((uint64_t) n << 1) ^ (uint64_t) (n >> 63);
+    char *p;
+
+    if (0 != pulsar_buffer_reserve(buf, 10)) {
+        return -1;
+    }
+    p = buf->data + buf->size;
+    while (v > 0x7f) {
+        *p++ = (char) ((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    buf->size = p - buf->data;
+    return 0;
+}
+
+static int write_bytes(struct pulsar_buffer *buf, const char *ptr, size_t len)
+{
+    if (0 != write_long(buf, (int64_t) len)) {
+        return -1;
+    }
+    return pulsar_buffer_append(buf, ptr, len);
+}
+
+// floats and doubles are little endian
+static int write_fixed64(struct pulsar_buffer *buf, uint64_t v, int n)
+{
+    int i;
+
+    if (0 != pulsar_buffer_reserve(buf, n)) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        buf->data[buf->size++] = (char) (v >> (i * 8));
+    }
+    return 0;
+}
+
+static inline int64_t as_int(const msgpack_object *o)
+{
+    return MSGPACK_OBJECT_POSITIVE_INTEGER == o->type ? (int64_t) o->via.u64 : o->via.i64;
+}
+
+static inline int is_int(const msgpack_object *o)
+{
+    return (MSGPACK_OBJECT_POSITIVE_INTEGER == o->type && o->via.u64 <= INT64_MAX)
+        || MSGPACK_OBJECT_NEGATIVE_INTEGER == o->type;
+}
+
+static int enum_index(const struct pulsar_avro_type *type, const msgpack_object *o)
+{
+    uint32_t i;
+
+    if (MSGPACK_OBJECT_STR != o->type) {
+        return -1;
+    }
+    for (i = 0; i < type->symbol_count; i++) {
+        if (flb_sds_len(type->symbols[i]) == o->via.str.size
+            && 0 == memcmp(type->symbols[i], o->via.str.ptr, o->via.str.size)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Whether a value can be written as a type, to pick a union branch. Exact
+ * matches are tried first, so an integer goes to a long rather than a double.
+ */
+static int accepts(const struct pulsar_avro_type *type, const msgpack_object *o, int exact)
+{
+    switch (type->kind) {
+    case PULSAR_AVRO_NULL:
+        return MSGPACK_OBJECT_NIL == o->type;
+    case PULSAR_AVRO_BOOLEAN:
+        return MSGPACK_OBJECT_BOOLEAN == o->type;
+    case PULSAR_AVRO_INT:
+        return is_int(o) && INT32_MIN <= as_int(o) && as_int(o) <= INT32_MAX;
+    case PULSAR_AVRO_LONG:
+        return is_int(o);
+    case PULSAR_AVRO_FLOAT:
+    case PULSAR_AVRO_DOUBLE:
+        return MSGPACK_OBJECT_FLOAT32 == o->type || MSGPACK_OBJECT_FLOAT64 == o->type
+            || (!exact && is_int(o));
+    case PULSAR_AVRO_STRING:
+        return MSGPACK_OBJECT_STR == o->type || (!exact && MSGPACK_OBJECT_BIN == o->type);
+    case PULSAR_AVRO_BYTES:
+        return MSGPACK_OBJECT_BIN == o->type || (!exact && MSGPACK_OBJECT_STR == o->type);
+    case PULSAR_AVRO_ENUM:
+        return 0 <= enum_index(type, o);
+    case PULSAR_AVRO_FIXED:
+        return (MSGPACK_OBJECT_STR == o->type || MSGPACK_OBJECT_BIN == o->type) && type->size == o->via.str.size;
+    case PULSAR_AVRO_RECORD:
+    case PULSAR_AVRO_MAP:
+        return MSGPACK_OBJECT_MAP == o->type;
+    case PULSAR_AVRO_ARRAY:
+        return MSGPACK_OBJECT_ARRAY == o->type;
+    default:
+        return 0;
+    }
+}
+
+static int write_value(struct pulsar_buffer *buf, const struct pulsar_avro_type *type, const msgpack_object *o);
+
+static int write_record(struct pulsar_buffer *buf, const struct pulsar_avro_type *type, const msgpack_object *o)
+{
+    uint32_t i;
+    int cmp;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+    const msgpack_object_kv *kv;
+    const struct pulsar_avro_field *field;
+    const msgpack_object *slots[PULSAR_AVRO_MAX_FIELDS] = { NULL };
+
+    // resolve every key of the record to its field, keys without a field are dropped
+    for (i = 0; i < o->via.map.size; i++) {
+        kv = &o->via.map.ptr[i];
+        if (MSGPACK_OBJECT_STR != kv->key.type) {
+            continue;
+        }
+        lo = 0;
+        hi = type->field_count;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            field = &type->fields[type->field_index[mid]];
+            cmp = strncmp(field->name, kv->key.via.str.ptr, kv->key.via.str.size);
+            if (0 == cmp && flb_sds_len(field->name) > kv->key.via.str.size) {
+                cmp = 1;
+            }
+            if (0 == cmp) {
+                if (!slots[type->field_index[mid]]) {
+                    slots[type->field_index[mid]] = &kv->val;
+                }
+                break;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+
+    for (i = 0; i < type->field_count; i++) {
+        field = &type->fields[i];
+        if (0 != write_value(buf, field->type, slots[i] ? slots[i] : (field->def ? field->def : &avro_nil))) {
+            flb_debug("[out_pulsar] record field '%s' does not match the avro schema of %s", field->name, type->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_value(struct pulsar_buffer *buf, const struct pulsar_avro_type *type, const msgpack_object *o)
+{
+    uint32_t i;
+    union {
+        float f;
+        uint32_t u;
+    } f32;
+    union {
+        double d;
+        uint64_t u;
+    } f64;
+
+    if (PULSAR_AVRO_UNION != type->kind && !accepts(type, o, 0)) {
+        return -1;
+    }
+
+    switch (type->kind) {
+    case PULSAR_AVRO_NULL:
+        return 0;
+    case PULSAR_AVRO_BOOLEAN:
+        return pulsar_buffer_putc(buf, o->via.boolean ? 1 : 0);
+    case PULSAR_AVRO_INT:
+    case PULSAR_AVRO_LONG:
+        return write_long(buf, as_int(o));
+    case PULSAR_AVRO_FLOAT:
+        f32.f = is_int(o) ? (float) as_int(o) : (float) o->via.f64;
+        return write_fixed64(buf, f32.u, 4);
+    case PULSAR_AVRO_DOUBLE:
+        f64.d = is_int(o) ? (double) as_int(o) : o->via.f64;
+        return write_fixed64(buf, f64.u, 8);
+    case PULSAR_AVRO_STRING:
+    case PULSAR_AVRO_BYTES:
+        return write_bytes(buf, o->via.str.ptr, o->via.str.size);
+    case PULSAR_AVRO_FIXED:
+        return pulsar_buffer_append(buf, o->via.str.ptr, o->via.str.size);
+    case PULSAR_AVRO_ENUM:
+        return write_long(buf, enum_index(type, o));
+    case PULSAR_AVRO_RECORD:
+        return write_record(buf, type, o);
+    case PULSAR_AVRO_ARRAY:
+        // a single block with all of the items, then the empty block
+        if (0 < o->via.array.size && 0 != write_long(buf, o->via.array.size)) {
+            return -1;
+        }
+        for (i = 0; i < o->via.array.size; i++) {
+            if (0 != write_value(buf, type->items, &o->via.array.ptr[i])) {
+                return -1;
+            }
+        }
+        return write_long(buf, 0);
+    case PULSAR_AVRO_MAP:
+        if (0 < o->via.map.size && 0 != write_long(buf, o->via.map.size)) {
+            return -1;
+        }
+        for (i = 0; i < o->via.map.size; i++) {
+            if (MSGPACK_OBJECT_STR != o->via.map.ptr[i].key.type
+                || 0 != write_bytes(buf, o->via.map.ptr[i].key.via.str.ptr, o->via.map.ptr[i].key.via.str.size)
+                || 0 != write_value(buf, type->items, &o->via.map.ptr[i].val)) {
+                return -1;
+            }
+        }
+        return write_long(buf, 0);
+    case PULSAR_AVRO_UNION:
+        for (i = 0; i < type->branch_count; i++) {
+            if (accepts(type->branches[i], o, 1)) {
+                break;
+            }
+        }
+        if (i == type->branch_count) {
+            for (i = 0; i < type->branch_count; i++) {
+                if (accepts(type->branches[i], o, 0)) {
+                    break;
+                }
+            }
+        }
+        if (i == type->branch_count || 0 != write_long(buf, i)) {
+            return -1;
+        }
+        return write_value(buf, type->branches[i], o);
+    default:
+        return -1;
+    }
+}
+
+int pulsar_avro_write(struct pulsar_buffer *buf, const struct pulsar_avro_schema *schema,
+                      const msgpack_object *map)
+{
+    if (MSGPACK_OBJECT_MAP != map->type) {
+        return -1;
+    }
+    return write_record(buf, schema->root, map);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <msgpack.h>
+#include <fluent-bit/flb_sds.h>
+
+#include "pulsar_buffer.h"
+
+#define PULSAR_AVRO_MAX_FIELDS  256
+
+struct flb_output_instance;
+
+enum pulsar_avro_kind {
+    PULSAR_AVRO_NULL,
+    PULSAR_AVRO_BOOLEAN,
+    PULSAR_AVRO_INT,
+    PULSAR_AVRO_LONG,
+    PULSAR_AVRO_FLOAT,
+    PULSAR_AVRO_DOUBLE,
+    PULSAR_AVRO_BYTES,
+    PULSAR_AVRO_STRING,
+    PULSAR_AVRO_RECORD,
+    PULSAR_AVRO_ENUM,
+    PULSAR_AVRO_ARRAY,
+    PULSAR_AVRO_MAP,
+    PULSAR_AVRO_UNION,
+    PULSAR_AVRO_FIXED,
+};
+
+struct pulsar_avro_type;
+
+struct pulsar_avro_field {
+    flb_sds_t name;
+    struct pulsar_avro_type *type;
+    const msgpack_object *def;   // default value from the schema, or NULL
+};
+
+// a compiled schema type, named types may be referenced from many places
+struct pulsar_avro_type {
+    enum pulsar_avro_kind kind;
+    flb_sds_t name;                      // full name of a record, enum or fixed
+
+    struct pulsar_avro_field *fields;    // record fields in schema order
+    uint32_t *field_index;               // field indexes sorted by name
+    uint32_t field_count;
+
+    flb_sds_t *symbols;                  // enum
+    uint32_t symbol_count;
+
+    struct pulsar_avro_type *items;      // array items, map values
+    struct pulsar_avro_type **branches;  // union
+    uint32_t branch_count;
+    size_t size;                         // fixed
+
+    struct pulsar_avro_type *next;       // every type of the schema, to free them
+};
+
+/*
+ * An Avro record schema compiled into a plan of types. A record is encoded
+ * in one pass: the keys of its map are resolved to field indexes, then the
+ * fields are written in schema order as the Avro binary encoding.
+ */
+struct pulsar_avro_schema {
+    flb_sds_t json;                  // schema definition registered on the producer
+    flb_sds_t name;                  // full name of the top-level record
+    char *mp_buf;                    // the schema as msgpack, holds the defaults
+    msgpack_unpacked unpacked;
+    struct pulsar_avro_type *root;
+    struct pulsar_avro_type *types;
+};
+
+struct pulsar_avro_schema* pulsar_avro_schema_create(struct flb_output_instance *ins, const char *path);
+void pulsar_avro_schema_destroy(struct pulsar_avro_schema *schema);
+
+// append the Avro binary encoding of a record map, -1 if it does not fit the schema
+int pulsar_avro_write(struct pulsar_buffer *buf, const struct pulsar_avro_schema *schema,
+                      const msgpack_object *map);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <fluent-bit/flb_mem.h>
+
+#define PULSAR_BUFFER_INIT_SIZE  4096
+
+// growable byte buffer, reused by encoders across the records of a flush
+struct pulsar_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static inline int pulsar_buffer_init(struct pulsar_buffer *buf, size_t capacity)
+{
+    buf->size = 0;
+    buf->capacity = capacity;
+    buf->data = flb_malloc(capacity);
+    if (!buf->data) {
+        flb_errno();
+        buf->capacity = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void pulsar_buffer_destroy(struct pulsar_buffer *buf)
+{
+    if (buf->data) {
+        flb_free(buf->data);
+    }
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+static inline void pulsar_buffer_reset(struct pulsar_buffer *buf)
+{
+    buf->size = 0;
+}
+
+// make sure at least n more bytes can be written without reallocation
+static inline int pulsar_buffer_reserve(struct pulsar_buffer *buf, size_t n)
+{
+    char *tmp;
+    size_t capacity;
+
+    if (buf->size + n <= buf->capacity) {
+        return 0;
+    }
+
+    capacity = buf->capacity ? buf->capacity : PULSAR_BUFFER_INIT_SIZE;
+    while (capacity < buf->size + n) {
+        capacity <<= 1;
+    }
+
+    tmp = flb_realloc(buf->data, capacity);
+    if (!tmp) {
+        flb_errno();
+        return -1;
+    }
+    buf->data = tmp;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static inline int pulsar_buffer_append(struct pulsar_buffer *buf, const char *data, size_t len)
+{
+    if (pulsar_buffer_reserve(buf, len) != 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    return 0;
+}
+
+static inline int pulsar_buffer_putc(struct pulsar_buffer *buf, char c)
+{
+    if (pulsar_buffer_reserve(buf, 1) != 0) {
+        return -1;
+    }
+    buf->data[buf->size++] = c;
+    return 0;
+}
+
+// write callback of a msgpack_packer appending to a pulsar_buffer
+static inline int pulsar_buffer_write(void *data, const char *buf, size_t len)
+{
+    return pulsar_buffer_append((struct pulsar_buffer *) data, buf, len);
+}
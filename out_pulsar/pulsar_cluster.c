@@ -0,0 +1,257 @@
+#include <fluent-bit/flb_output_plugin.h>
+
+#include "pulsar_cluster.h"
+#include "pulsar_metrics.h"
+
+// weight of the last window in the averages
+#define CLUSTER_EWMA_ALPHA        0.5
+// a probed cluster must do better than the limits by this much to recover
+#define CLUSTER_RECOVERY_MARGIN   0.8
+
+int pulsar_cluster_set_init(struct pulsar_cluster_set *set, struct flb_output_instance *ins,
+                            struct pulsar_metrics *metrics, int count, double max_error_rate,
+                            int max_latency_ms, int recovery_s)
+{
+    memset(set, 0, sizeof(struct pulsar_cluster_set));
+    pthread_mutex_init(&set->lock, NULL);
+    set->ins = ins;
+    set->metrics = metrics;
+    set->max_error_rate = max_error_rate;
+    set->max_latency_ms = max_latency_ms;
+    set->recovery_ms = 0 < recovery_s ? recovery_s * 1000 : 0;
+    atomic_init(&set->seq, 0);
+    atomic_init(&set->next_update_ns, 0);
+
+    set->clusters = flb_calloc(count, sizeof(struct pulsar_cluster));
+    if (!set->clusters) {
+        flb_errno();
+        return -1;
+    }
+    set->count = count;
+    return 0;
+}
+
+void pulsar_cluster_set_destroy(struct pulsar_cluster_set *set)
+{
+    int i;
+    struct pulsar_cluster *c;
+
+    for (i = 0; i < set->count; i++) {
+        c = &set->clusters[i];
+        if (!c->owned) {
+            continue;
+        }
+        if (c->producer) {
+            pulsar_producer_close(c->producer);
+            pulsar_producer_free(c->producer);
+        }
+        if (c->client) {
+            pulsar_client_close(c->client);
+            pulsar_client_free(c->client);
+        }
+    }
+    if (set->clusters) {
+        flb_free(set->clusters);
+    }
+    set->clusters = NULL;
+    set->count = 0;
+    pthread_mutex_destroy(&set->lock);
+}
+
+static inline int cluster_state(struct pulsar_cluster *c)
+{
+    return atomic_load_explicit(&c->state, memory_order_relaxed);
+}
+
+// FNV-1a, the cluster of a partition key
+static uint32_t cluster_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Weighted pick among the clusters in `state` of the lowest priority having
+ * any, NULL if no cluster is in that state.
+ */
+static struct pulsar_cluster* cluster_pick(struct pulsar_cluster_set *set, int state, uint32_t n)
+{
+    int i;
+    int priority = 0;
+    bool found = false;
+    uint32_t total = 0;
+    struct pulsar_cluster *c;
+
+    for (i = 0; i < set->count; i++) {
+        c = &set->clusters[i];
+        if ((state < 0 || cluster_state(c) == state) && (!found || c->priority < priority)) {
+            priority = c->priority;
+            found = true;
+        }
+    }
+    if (!found) {
+        return NULL;
+    }
+
+    for (i = 0; i < set->count; i++) {
+        c = &set->clusters[i];
+        if ((state < 0 || cluster_state(c) == state) && c->priority == priority) {
+            total += c->weight;
+        }
+    }
+    n %= total;
+    for (i = 0; i < set->count; i++) {
+        c = &set->clusters[i];
+        if ((state < 0 || cluster_state(c) == state) && c->priority == priority) {
+            if (n < (uint32_t) c->weight) {
+                return c;
+            }
+            n -= c->weight;
+        }
+    }
+    return NULL;
+}
+
+struct pulsar_cluster* pulsar_cluster_select(struct pulsar_cluster_set *set, const char *key, uint64_t now_ns)
+{
+    uint32_t seq;
+    uint32_t n;
+    struct pulsar_cluster *c;
+
+    pulsar_cluster_update(set, now_ns);
+
+    seq = atomic_fetch_add_explicit(&set->seq, 1, memory_order_relaxed);
+    if (0 == seq % PULSAR_CLUSTER_PROBE_EVERY) {
+        c = cluster_pick(set, PULSAR_CLUSTER_PROBING, seq / PULSAR_CLUSTER_PROBE_EVERY);
+        if (c) {
+            return c;
+        }
+    }
+
+    // a key keeps its cluster, and so the order of its messages, while the healthy set holds
+    n = key ? cluster_hash(key) : seq;
+    c = cluster_pick(set, PULSAR_CLUSTER_HEALTHY, n);
+    if (!c) {
+        c = cluster_pick(set, PULSAR_CLUSTER_PROBING, n);
+    }
+    if (!c) {
+        c = cluster_pick(set, -1, n);
+    }
+    return c;
+}
+
+static const char* cluster_state_str(int state)
+{
+    switch (state) {
+    case PULSAR_CLUSTER_DOWN:
+        return "down";
+    case PULSAR_CLUSTER_PROBING:
+        return "probing";
+    default:
+        return "healthy";
+    }
+}
+
+static void cluster_set_state(struct pulsar_cluster_set *set, struct pulsar_cluster *c, int state,
+                              uint64_t now_ns, const char *why)
+{
+    atomic_store_explicit(&c->state, state, memory_order_relaxed);
+    c->state_ns = now_ns;
+    pulsar_metrics_cluster(set->metrics, c->url, state);
+    if (PULSAR_CLUSTER_DOWN == state) {
+        flb_plg_warn(set->ins, "pulsar cluster %s is down: %s, error rate %.2f, ack latency %.0fms",
+                     c->url, why, c->error_rate, c->latency_ms);
+    } else {
+        flb_plg_info(set->ins, "pulsar cluster %s is %s, error rate %.2f, ack latency %.0fms",
+                     c->url, cluster_state_str(state), c->error_rate, c->latency_ms);
+    }
+}
+
+// fold the window into the averages of the cluster and move it between states
+static void cluster_update(struct pulsar_cluster_set *set, struct pulsar_cluster *c, uint64_t now_ns)
+{
+    uint64_t acks = atomic_exchange(&c->acks, 0);
+    uint64_t errors = atomic_exchange(&c->errors, 0);
+    uint64_t ack_ns = atomic_exchange(&c->ack_ns, 0);
+    uint64_t progress_ns = atomic_load_explicit(&c->progress_ns, memory_order_relaxed);
+    int64_t inflight = atomic_load_explicit(&c->inflight, memory_order_relaxed);
+    int state = cluster_state(c);
+    double margin = PULSAR_CLUSTER_PROBING == state ? CLUSTER_RECOVERY_MARGIN : 1.0;
+    const char *why = NULL;
+
+    if (PULSAR_CLUSTER_MIN_SAMPLES <= acks + errors
+        || (PULSAR_CLUSTER_PROBING == state && 0 < acks + errors)) {
+        c->error_rate = CLUSTER_EWMA_ALPHA * errors / (acks + errors) + (1 - CLUSTER_EWMA_ALPHA) * c->error_rate;
+    }
+    if (0 < acks) {
+        c->latency_ms = CLUSTER_EWMA_ALPHA * ack_ns / acks / 1e6 + (1 - CLUSTER_EWMA_ALPHA) * c->latency_ms;
+    }
+
+    // a cluster that stopped answering is caught before its sends time out
+    if (0 < inflight && progress_ns < now_ns
+        && (now_ns - progress_ns) / 1000000 >= (uint64_t) set->max_latency_ms) {
+        why = "no ack";
+    } else if (c->error_rate > set->max_error_rate * margin) {
+        why = "errors";
+    } else if (c->latency_ms > set->max_latency_ms * margin) {
+        why = "latency";
+    }
+
+    switch (state) {
+    case PULSAR_CLUSTER_HEALTHY:
+        if (why) {
+            cluster_set_state(set, c, PULSAR_CLUSTER_DOWN, now_ns, why);
+        }
+        break;
+    case PULSAR_CLUSTER_DOWN:
+        if ((now_ns - c->state_ns) / 1000000 >= (uint64_t) set->recovery_ms) {
+            // the averages start over with the probes
+            c->error_rate = 0;
+            c->latency_ms = 0;
+            c->probes = 0;
+            cluster_set_state(set, c, PULSAR_CLUSTER_PROBING, now_ns, NULL);
+        }
+        break;
+    case PULSAR_CLUSTER_PROBING:
+        if (why) {
+            cluster_set_state(set, c, PULSAR_CLUSTER_DOWN, now_ns, why);
+            break;
+        }
+        c->probes += acks + errors;
+        if ((now_ns - c->state_ns) / 1000000 >= (uint64_t) set->recovery_ms
+            && PULSAR_CLUSTER_MIN_SAMPLES <= c->probes) {
+            cluster_set_state(set, c, PULSAR_CLUSTER_HEALTHY, now_ns, NULL);
+        }
+        break;
+    }
+}
+
+void pulsar_cluster_update(struct pulsar_cluster_set *set, uint64_t now_ns)
+{
+    int i;
+    uint64_t next_ns = atomic_load_explicit(&set->next_update_ns, memory_order_relaxed);
+
+    if (now_ns < next_ns || 0 != pthread_mutex_trylock(&set->lock)) {
+        return;
+    }
+    // checked again under the lock, another thread may have just run it
+    next_ns = atomic_load_explicit(&set->next_update_ns, memory_order_relaxed);
+    if (now_ns < next_ns) {
+        pthread_mutex_unlock(&set->lock);
+        return;
+    }
+    atomic_store_explicit(&set->next_update_ns, now_ns + PULSAR_CLUSTER_INTERVAL_NS, memory_order_relaxed);
+
+    // the first call only opens the window
+    if (0 < next_ns) {
+        for (i = 0; i < set->count; i++) {
+            cluster_update(set, &set->clusters[i], now_ns);
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <pulsar/c/client.h>
+
+#define PULSAR_CLUSTER_DEFAULT_ERROR_RATE   "0.2"
+#define PULSAR_CLUSTER_DEFAULT_LATENCY_MS   "2000"
+#define PULSAR_CLUSTER_DEFAULT_RECOVERY_S   "30"
+#define PULSAR_CLUSTER_INTERVAL_NS          1000000000ULL
+// one message in PULSAR_CLUSTER_PROBE_EVERY goes to a cluster under probe
+#define PULSAR_CLUSTER_PROBE_EVERY          100
+// sends of a window below which the error rate is not trusted
+#define PULSAR_CLUSTER_MIN_SAMPLES          10
+
+struct flb_output_instance;
+struct pulsar_metrics;
+
+enum pulsar_cluster_state {
+    PULSAR_CLUSTER_HEALTHY = 0,
+    PULSAR_CLUSTER_DOWN,
+    PULSAR_CLUSTER_PROBING,
+};
+
+/*
+ * A pulsar cluster taking the static topic, with its own client and
+ * producer. The sends report their outcome, and once per interval the
+ * controller turns the counters of the window into the health of the
+ * cluster.
+ */
+struct pulsar_cluster {
+    const char *url;
+    int priority;
+    int weight;
+    bool owned;        // client and producer are closed with the set
+    pulsar_client_t *client;
+    pulsar_producer_t *producer;
+
+    atomic_int state;
+
+    // counters of the current window
+    atomic_uint_fast64_t acks;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t ack_ns;
+    // sends not completed, and when they last made progress
+    atomic_int_fast64_t inflight;
+    atomic_uint_fast64_t progress_ns;
+
+    // controller state
+    double latency_ms;
+    double error_rate;
+    uint64_t state_ns;
+    uint64_t probes;   // sends answered since the probing started
+};
+
+/*
+ * Clusters sharing the traffic of the static topic. Messages go to the
+ * healthy clusters of the lowest priority, in proportion to their weight,
+ * and a keyed message always to the same one while that set holds.
+ *
+ * A cluster goes down when its error rate is above `max_error_rate`, its
+ * average ack latency above `max_latency_ms`, or its sends made no progress
+ * for `max_latency_ms`. It is probed with a trickle of the traffic once it
+ * has been down for `recovery_ms`, and takes its share again after a
+ * `recovery_ms` of healthy probing, so a flapping cluster does not pull the
+ * traffic back and forth. With no healthy cluster, the ones under probe and
+ * then all of them take the traffic, by priority.
+ */
+struct pulsar_cluster_set {
+    struct flb_output_instance *ins;
+    struct pulsar_metrics *metrics;
+    int count;
+    struct pulsar_cluster *clusters;
+
+    double max_error_rate;
+    int max_latency_ms;
+    int recovery_ms;
+
+    atomic_uint seq;
+    atomic_uint_fast64_t next_update_ns;
+    pthread_mutex_t lock;
+};
+
+int pulsar_cluster_set_init(struct pulsar_cluster_set *set, struct flb_output_instance *ins,
+                            struct pulsar_metrics *metrics, int count, double max_error_rate,
+                            int max_latency_ms, int recovery_s);
+// close the producers and clients the set owns
+void pulsar_cluster_set_destroy(struct pulsar_cluster_set *set);
+
+// the cluster a message goes to, after the partition key if any
+struct pulsar_cluster* pulsar_cluster_select(struct pulsar_cluster_set *set, const char *key, uint64_t now_ns);
+
+// run the controller if the window is over and no other thread is doing it
+void pulsar_cluster_update(struct pulsar_cluster_set *set, uint64_t now_ns);
+
+// a message was handed to the producer of the cluster
+static inline void pulsar_cluster_sent(struct pulsar_cluster *c, uint64_t now_ns)
+{
+    // progress is measured from the first send of an idle cluster
+    if (0 == atomic_fetch_add_explicit(&c->inflight, 1, memory_order_relaxed)) {
+        atomic_store_explicit(&c->progress_ns, now_ns, memory_order_relaxed);
+    }
+}
+
+/*
+ * The send made at send_ns completed. `failed` is for the failures the
+ * cluster is to blame for; a message it rejects for good was still answered,
+ * which counts like an ack.
+ */
+static inline void pulsar_cluster_done(struct pulsar_cluster *c, bool failed, uint64_t send_ns, uint64_t now_ns)
+{
+    atomic_fetch_sub_explicit(&c->inflight, 1, memory_order_relaxed);
+    atomic_store_explicit(&c->progress_ns, now_ns, memory_order_relaxed);
+    if (failed) {
+        atomic_fetch_add_explicit(&c->errors, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&c->acks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->ack_ns, now_ns - send_ns, memory_order_relaxed);
+    }
+}
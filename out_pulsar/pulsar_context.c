@@ -1,61 +1,762 @@
+#include <errno.h>
+#include <unistd.h>
+
 #include <fluent-bit/flb_output_plugin.h>
+#include <fluent-bit/flb_thread_storage.h>
+#include <fluent-bit/flb_record_accessor.h>
+#include <fluent-bit/flb_slist.h>
+#include <fluent-bit/flb_utils.h>
 
 #include <pulsar/c/version.h>
 #include <pulsar/c/authentication.h>
 #include <pulsar/c/client.h>
 #include "pulsar_context.h"
 
-#define PULSAR_DEFAULT_MEMORY_LIMIT 8088608
 #define PULSAR_AUTH_TOKEN_MASK_LEN  16
 
+// producer of the current flush worker thread, if it owns one
+FLB_TLS_DEFINE(struct pulsar_worker, pulsar_worker_tls);
+static pthread_once_t pulsar_worker_tls_once = PTHREAD_ONCE_INIT;
+
+static void pulsar_worker_tls_init(void)
+{
+    FLB_TLS_INIT(pulsar_worker_tls);
+}
+
+// FNV-1a, the stripe of a partition key
+static uint32_t pulsar_stripe_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+pulsar_producer_t* flb_out_pulsar_producer(flb_out_pulsar_ctx* ctx, const struct pulsar_msg_attrs* attrs)
+{
+    uint32_t stripe;
+    struct pulsar_worker *worker = FLB_TLS_GET(pulsar_worker_tls);
+    if (worker && worker->ctx == ctx && worker->producer) {
+        return worker->producer;
+    }
+    if (!ctx->stripes) {
+        return ctx->producer;
+    }
+
+    // a key always takes the same stripe, which keeps the order of its records
+    if (ctx->stripe_key_affinity && attrs->partition_key) {
+        stripe = pulsar_stripe_hash(attrs->partition_key);
+    } else {
+        stripe = atomic_fetch_add_explicit(&ctx->stripe_seq, 1, memory_order_relaxed);
+    }
+    return ctx->stripes[stripe % (uint32_t) ctx->producer_stripes];
+}
+
+/*
+ * Producer on the configured topic. Producer names must be unique per topic,
+ * so a configured one is suffixed. Callers serialize on producer_lock.
+ */
+static pulsar_result pulsar_create_suffixed_producer(flb_out_pulsar_ctx *ctx, const char *suffix,
+                                                     pulsar_producer_t **producer)
+{
+    pulsar_result err;
+    const char *name;
+    char *orig_name = NULL;
+    char suffixed_name[256];
+
+    name = pulsar_producer_configuration_get_producer_name(ctx->producer_conf);
+    if (name && 0 < strlen(name)) {
+        orig_name = flb_strdup(name);
+        snprintf(suffixed_name, sizeof(suffixed_name), "%s-%s", orig_name, suffix);
+        pulsar_producer_configuration_set_producer_name(ctx->producer_conf, suffixed_name);
+    }
+
+    err = pulsar_client_create_producer(ctx->client, ctx->pulsar_producer_topic, ctx->producer_conf, producer);
+
+    if (orig_name) {
+        pulsar_producer_configuration_set_producer_name(ctx->producer_conf, orig_name);
+        flb_free(orig_name);
+    }
+    return err;
+}
+
+#define PULSAR_FLUSH_WAIT_MARGIN_MS  5000
+// wait for the acks when the producer has no send timeout, a lost callback must not hang a flush
+#define PULSAR_FLUSH_WAIT_DEFAULT_MS  30000
+// period of the checks of the drain on exit
+#define PULSAR_DRAIN_POLL_MS  10
+
+// conditions waited on with pulsar_send_deadline, on the monotonic clock so clock steps do not move it
+static void pulsar_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// deadline of a wait of the producer send timeout, or a default without one, plus a margin
+static void pulsar_send_deadline(flb_out_pulsar_ctx *ctx, struct timespec *deadline)
+{
+    int timeout_ms = pulsar_producer_configuration_get_send_timeout(ctx->producer_conf);
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    if (0 >= timeout_ms) {
+        timeout_ms = PULSAR_FLUSH_WAIT_DEFAULT_MS;
+    }
+    timeout_ms += PULSAR_FLUSH_WAIT_MARGIN_MS;
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+struct pulsar_flush_ctx* flb_pulsar_flush_create()
+{
+    struct pulsar_flush_ctx *flush = flb_calloc(1, sizeof(struct pulsar_flush_ctx));
+    if (!flush) {
+        flb_errno();
+        return NULL;
+    }
+
+    pthread_mutex_init(&flush->lock, NULL);
+    pulsar_cond_init(&flush->cond);
+    flush->refs = 1;
+    return flush;
+}
+
+static void pulsar_flush_unref(struct pulsar_flush_ctx *flush)
+{
+    // caller holds the lock, which is released here
+    if (0 < --flush->refs) {
+        pthread_mutex_unlock(&flush->lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&flush->lock);
+    pthread_cond_destroy(&flush->cond);
+    pthread_mutex_destroy(&flush->lock);
+    flb_free(flush);
+}
+
+void flb_pulsar_flush_release(struct pulsar_flush_ctx* flush)
+{
+    pthread_mutex_lock(&flush->lock);
+    pulsar_flush_unref(flush);
+}
+
+/*
+ * Wait until every async send of the flush has been acked. Returns FLB_RETRY
+ * if any send failed or the acks did not arrive within the producer send
+ * timeout (or PULSAR_FLUSH_WAIT_DEFAULT_MS without one, plus a margin), so
+ * fluent-bit keeps the chunk and retries it later.
+ */
+int flb_pulsar_flush_wait(flb_out_pulsar_ctx* ctx, struct pulsar_flush_ctx* flush)
+{
+    int ret = 0;
+    uint32_t pending;
+    uint32_t failed;
+    struct timespec deadline;
+
+    pulsar_send_deadline(ctx, &deadline);
+    pthread_mutex_lock(&flush->lock);
+    while (0 < flush->pending && ETIMEDOUT != ret) {
+        ret = pthread_cond_timedwait(&flush->cond, &flush->lock, &deadline);
+    }
+    pending = flush->pending;
+    failed = flush->failed;
+    pthread_mutex_unlock(&flush->lock);
+
+    if (0 < pending) {
+        flb_plg_warn(ctx->ins, "%u messages not acked in time, retry the chunk", pending);
+        return FLB_RETRY;
+    }
+    if (0 < failed) {
+        flb_plg_warn(ctx->ins, "%u messages failed to send, retry the chunk", failed);
+        return FLB_RETRY;
+    }
+    return FLB_OK;
+}
+
+// results after which sending the message again cannot succeed
+static bool pulsar_result_retryable(pulsar_result code)
+{
+    switch (code) {
+    case pulsar_result_InvalidMessage:
+    case pulsar_result_MessageTooBig:
+    case pulsar_result_InvalidTopicName:
+    case pulsar_result_TopicNotFound:
+    case pulsar_result_TopicTerminated:
+    case pulsar_result_AuthorizationError:
+    case pulsar_result_IncompatibleSchema:
+    case pulsar_result_CryptoError:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// keep a message the broker did not take in the spill, returns 0 if it was stored
+static int pulsar_spill_message(flb_out_pulsar_ctx *ctx, pulsar_result code, struct pulsar_msg_attrs *attrs,
+                                const char *data, size_t len)
+{
+    struct pulsar_spill_entry entry;
+
+    if (!ctx->spill || !pulsar_result_retryable(code)) {
+        return -1;
+    }
+
+    entry.topic = attrs->topic;
+    entry.topic_len = attrs->topic ? attrs->topic_len : 0;
+    entry.partition_key = attrs->partition_key;
+    entry.record_count = attrs->record_count;
+    entry.properties = attrs->properties;
+    entry.properties_len = attrs->properties ? attrs->properties_len : 0;
+    entry.event_time = attrs->event_time;
+    entry.payload = data;
+    entry.payload_len = len;
+    if (pulsar_spill_append(ctx->spill, &entry) != 0) {
+        return -1;
+    }
+
+    flb_plg_debug(ctx->ins, "pulsar message spilled: %s", pulsar_result_str(code));
+    pulsar_metrics_spilled(&ctx->metrics, PULSAR_MSG_RECORDS(attrs));
+    return 0;
+}
+
+static int pulsar_dead_letter_async(flb_out_pulsar_ctx *ctx, struct pulsar_callback_ctx *pcctx, pulsar_result code,
+                                    struct pulsar_msg_attrs *attrs);
+
+// async sends started or completed, counted for the drain on exit and the metrics
+static inline void pulsar_inflight_add(flb_out_pulsar_ctx *ctx, int delta)
+{
+    atomic_fetch_add_explicit(&ctx->inflight, delta, memory_order_relaxed);
+    pulsar_metrics_inflight(&ctx->metrics, delta);
+}
+
+// take `bytes` from the in-flight budget if they fit, or if nothing is in flight
+static bool pulsar_budget_try(flb_out_pulsar_ctx *ctx, size_t bytes)
+{
+    int_fast64_t held = atomic_load(&ctx->inflight_bytes);
+
+    do {
+        if (0 < ctx->inflight_max_bytes && 0 < held
+            && ctx->inflight_max_bytes < (uint64_t) held + bytes) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&ctx->inflight_bytes, &held, held + (int_fast64_t) bytes));
+    pulsar_metrics_inflight_bytes(&ctx->metrics, (int64_t) bytes);
+    return true;
+}
+
+/*
+ * Account the payload of an async send. Over inflightMaxBytes the output is
+ * paused: the flush waits for the callbacks to give bytes back, so fluent-bit
+ * keeps the next chunks in its own buffers, and gets a failure once the
+ * deadline of the flush wait expired; the flush is then stalled and its
+ * next sends fail at once. A message larger than the budget still goes
+ * alone. Returns 0 once the bytes are taken.
+ */
+static int pulsar_budget_acquire(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, size_t bytes)
+{
+    int ret = 0;
+    bool taken;
+    bool stalled;
+    struct timespec deadline;
+
+    if (pulsar_budget_try(ctx, bytes)) {
+        return 0;
+    }
+    pthread_mutex_lock(&flush->lock);
+    stalled = flush->stalled;
+    pthread_mutex_unlock(&flush->lock);
+    if (stalled) {
+        return -1;
+    }
+    if (!atomic_exchange(&ctx->budget_paused, true)) {
+        flb_plg_warn(ctx->ins, "%"PRId64" bytes in flight, over %s %zu, output paused until the broker acks",
+                     (int64_t) atomic_load(&ctx->inflight_bytes), OUTPUT_KEY_INFLIGHT_MAX_BYTES,
+                     ctx->inflight_max_bytes);
+    }
+
+    pulsar_send_deadline(ctx, &deadline);
+    pthread_mutex_lock(&ctx->budget_lock);
+    // registered before the check, a callback giving bytes back after it signals
+    atomic_fetch_add(&ctx->budget_waiters, 1);
+    while (!(taken = pulsar_budget_try(ctx, bytes)) && ETIMEDOUT != ret) {
+        ret = pthread_cond_timedwait(&ctx->budget_cond, &ctx->budget_lock, &deadline);
+    }
+    atomic_fetch_sub(&ctx->budget_waiters, 1);
+    pthread_mutex_unlock(&ctx->budget_lock);
+    if (!taken) {
+        pthread_mutex_lock(&flush->lock);
+        flush->stalled = true;
+        pthread_mutex_unlock(&flush->lock);
+        flb_plg_warn(ctx->ins, "%s still exceeded after the send timeout, retry the chunk",
+                     OUTPUT_KEY_INFLIGHT_MAX_BYTES);
+        return -1;
+    }
+    return 0;
+}
+
+static void pulsar_budget_release(flb_out_pulsar_ctx *ctx, size_t bytes)
+{
+    int_fast64_t held = atomic_fetch_sub(&ctx->inflight_bytes, (int_fast64_t) bytes) - (int_fast64_t) bytes;
+
+    pulsar_metrics_inflight_bytes(&ctx->metrics, -(int64_t) bytes);
+    if (0 == ctx->inflight_max_bytes) {
+        return;
+    }
+    // resumed below half of the budget, so a saturated budget does not flood the log
+    if ((uint64_t) held <= ctx->inflight_max_bytes / 2 && atomic_load(&ctx->budget_paused)
+        && atomic_exchange(&ctx->budget_paused, false)) {
+        flb_plg_info(ctx->ins, "%"PRId64" bytes in flight, output resumed", (int64_t) held);
+    }
+    if (0 < atomic_load(&ctx->budget_waiters)) {
+        pthread_mutex_lock(&ctx->budget_lock);
+        pthread_cond_broadcast(&ctx->budget_cond);
+        pthread_mutex_unlock(&ctx->budget_lock);
+    }
+}
+
 void flb_pulsar_send_callback(pulsar_result code, pulsar_message_id_t *msgId, void *data)
 {
+    bool failed = false;
     struct pulsar_callback_ctx *pcctx = (struct pulsar_callback_ctx*)data;
-    if (pulsar_result_Ok == code) {
-        // ...
+    struct pulsar_flush_ctx *flush = pcctx->flush;
+    flb_out_pulsar_ctx *ctx = pcctx->ctx;
+    struct pulsar_msg_attrs attrs = { 0 };
+
+    pulsar_inflight_add(ctx, -1);
+    if (pcctx->cluster) {
+        pulsar_cluster_done(pcctx->cluster, pulsar_result_Ok != code && pulsar_result_retryable(code),
+                            pcctx->send_ns, pulsar_metrics_now_ns());
+        pcctx->cluster = NULL;
+    }
+    if (pcctx->dead_letter) {
+        // published once, the message is dropped if the dead-letter topic fails too
+        if (pulsar_result_Ok == code) {
+            pulsar_metrics_dead_letter(&ctx->metrics, pulsar_result_str(pcctx->code), PULSAR_MSG_RECORDS(pcctx));
+        } else {
+            pulsar_failure_log_write(&ctx->failure_log, "pulsar dead-letter publish failed", code, NULL, 0);
+            PULSAR_COUNTER_INC(ctx->discarded_number);
+            pulsar_metrics_discarded(&ctx->metrics, pulsar_result_str(pcctx->code), PULSAR_MSG_RECORDS(pcctx), pcctx->send_ns);
+            failed = true;
+        }
+    } else if (pulsar_result_Ok == code) {
+        pulsar_metrics_sent(&ctx->metrics, PULSAR_MSG_RECORDS(pcctx), pulsar_message_get_length(pcctx->msg), pcctx->send_ns);
+        pulsar_adaptive_ack(&ctx->adaptive, pcctx->send_ns, pulsar_metrics_now_ns());
     } else {
-        flb_plg_info(pcctx->ctx->ins, "pulsar discard message: %s, msg: %s", pulsar_result_str(code), pulsar_message_get_data(pcctx->msg));
-        ++pcctx->ctx->discarded_number;
+        if (pcctx->topic_producer) {
+            attrs.topic = pcctx->topic_producer->topic;
+            attrs.topic_len = flb_sds_len(pcctx->topic_producer->topic);
+        }
+        if (pulsar_message_has_partition_key(pcctx->msg)) {
+            attrs.partition_key = pulsar_message_get_partitionKey(pcctx->msg);
+        }
+        attrs.record_count = pcctx->record_count;
+        if (0 < pcctx->properties_len) {
+            attrs.properties = pcctx->payload + pulsar_message_get_length(pcctx->msg);
+            attrs.properties_len = pcctx->properties_len;
+        }
+        attrs.event_time = pcctx->event_time;
+
+        // a spilled message is replayed later, so it does not fail the flush
+        if (0 != pulsar_spill_message(ctx, code, &attrs, pulsar_message_get_data(pcctx->msg),
+                                      pulsar_message_get_length(pcctx->msg))) {
+            // the callback of the dead-letter send completes the message
+            if (0 == pulsar_dead_letter_async(ctx, pcctx, code, &attrs)) {
+                if (NULL != msgId) {
+                    pulsar_message_id_free(msgId);
+                }
+                return;
+            }
+            pulsar_failure_log_write(&ctx->failure_log, "pulsar discard message", code,
+                                     pulsar_message_get_data(pcctx->msg), pulsar_message_get_length(pcctx->msg));
+            PULSAR_COUNTER_INC(ctx->discarded_number);
+            pulsar_metrics_discarded(&ctx->metrics, pulsar_result_str(code), PULSAR_MSG_RECORDS(pcctx), pcctx->send_ns);
+            failed = true;
+        }
     }
     if (NULL != msgId) {
         pulsar_message_id_free(msgId);
     }
 
+    if (pcctx->topic_producer) {
+        pulsar_topic_map_release(pcctx->topic_producer);
+    }
+
+    // the payload is referenced by the message, free the message first
+    pulsar_message_free(pcctx->msg);
+    pulsar_budget_release(ctx, pcctx->inflight_bytes);
+    pulsar_callback_pool_put(ctx->callback_pool, pcctx);
+
+    pthread_mutex_lock(&flush->lock);
+    if (failed) {
+        ++flush->failed;
+    }
+    // wakes the flush waiting for room in the send window, or for the last ack
+    --flush->pending;
+    pthread_cond_signal(&flush->cond);
+    pulsar_flush_unref(flush);
+}
+
+static void pulsar_msg_set_attrs(pulsar_message_t *message, struct pulsar_msg_attrs *attrs)
+{
+    char count[16];
+    const char *name;
+    const char *value;
+    const char *end;
+
+    if (attrs->partition_key) {
+        pulsar_message_set_partition_key(message, attrs->partition_key);
+    }
+    if (0 < attrs->record_count) {
+        snprintf(count, sizeof(count), "%u", attrs->record_count);
+        pulsar_message_set_property(message, PULSAR_PROPERTY_RECORD_COUNT, count);
+    }
+    if (attrs->properties) {
+        end = attrs->properties + attrs->properties_len;
+        for (name = attrs->properties; name < end; name = value + strlen(value) + 1) {
+            value = name + strlen(name) + 1;
+            pulsar_message_set_property(message, name, value);
+        }
+    }
+    if (0 < attrs->event_time) {
+        pulsar_message_set_event_timestamp(message, attrs->event_time);
+    }
+}
+
+// the rejected message with why and where it failed, the payload is referenced, not copied
+static pulsar_message_t* pulsar_dead_letter_message(flb_out_pulsar_ctx *ctx, pulsar_result code,
+                                                    struct pulsar_msg_attrs *attrs, const char *data, size_t len)
+{
+    char size[32];
+    pulsar_message_t *message = pulsar_message_create();
+
+    // a payload rejected for its size would be rejected again, it is cut instead
+    if (len > ctx->dead_letter_max_bytes) {
+        snprintf(size, sizeof(size), "%zu", len);
+        pulsar_message_set_property(message, PULSAR_PROPERTY_DEAD_LETTER_SIZE, size);
+        len = ctx->dead_letter_max_bytes;
+    }
+    pulsar_message_set_allocated_content(message, (void *) data, len);
+    pulsar_msg_set_attrs(message, attrs);
+    pulsar_message_set_property(message, PULSAR_PROPERTY_DEAD_LETTER_RESULT, pulsar_result_str(code));
+    pulsar_message_set_property(message, PULSAR_PROPERTY_DEAD_LETTER_TOPIC,
+                                attrs->topic ? attrs->topic : ctx->pulsar_producer_topic);
+    return message;
+}
+
+// publish a message rejected for good to the dead-letter topic, returns 0 if it was taken
+static int pulsar_dead_letter_send(flb_out_pulsar_ctx *ctx, pulsar_result code, struct pulsar_msg_attrs *attrs,
+                                   const char *data, size_t len)
+{
+    pulsar_result ret;
+    pulsar_message_t *message;
+
+    if (!ctx->dead_letter_producer || pulsar_result_retryable(code)) {
+        return -1;
+    }
+
+    message = pulsar_dead_letter_message(ctx, code, attrs, data, len);
+    ret = pulsar_producer_send(ctx->dead_letter_producer, message);
+    pulsar_message_free(message);
+    if (pulsar_result_Ok != ret) {
+        pulsar_failure_log_write(&ctx->failure_log, "pulsar dead-letter publish failed", ret, NULL, 0);
+        return -1;
+    }
+    pulsar_metrics_dead_letter(&ctx->metrics, pulsar_result_str(code), PULSAR_MSG_RECORDS(attrs));
+    return 0;
+}
+
+/*
+ * Same from the send callback, where a blocking send could stall the client
+ * thread: the callback context is handed over to an async send, whose
+ * callback completes the message. Returns 0 if the send was started.
+ */
+static int pulsar_dead_letter_async(flb_out_pulsar_ctx *ctx, struct pulsar_callback_ctx *pcctx, pulsar_result code,
+                                    struct pulsar_msg_attrs *attrs)
+{
+    pulsar_message_t *message;
+
+    if (!ctx->dead_letter_producer || pulsar_result_retryable(code)) {
+        return -1;
+    }
+
+    message = pulsar_dead_letter_message(ctx, code, attrs, pcctx->payload, pulsar_message_get_length(pcctx->msg));
+    // attrs may reference the topic producer, release it once the message is built
+    if (pcctx->topic_producer) {
+        pulsar_topic_map_release(pcctx->topic_producer);
+        pcctx->topic_producer = NULL;
+    }
     pulsar_message_free(pcctx->msg);
-    flb_free(pcctx);
+    pcctx->msg = message;
+    pcctx->dead_letter = true;
+    pcctx->code = code;
+    pcctx->send_ns = pulsar_metrics_now_ns();
+
+    pulsar_inflight_add(ctx, 1);
+    pulsar_producer_send_async(ctx->dead_letter_producer, message, flb_pulsar_send_callback, pcctx);
+    return 0;
+}
+
+static void pulsar_flush_mark_failed(struct pulsar_flush_ctx *flush)
+{
+    pthread_mutex_lock(&flush->lock);
+    ++flush->failed;
+    pthread_mutex_unlock(&flush->lock);
+}
+
+/*
+ * Producer of the message topic, a templated topic also yields its map entry
+ * and pulsarCluster the cluster to tell how the send went.
+ */
+static pulsar_producer_t* pulsar_msg_producer(flb_out_pulsar_ctx *ctx, struct pulsar_msg_attrs *attrs,
+                                              struct pulsar_topic_producer **entry, struct pulsar_cluster **cluster)
+{
+    *entry = NULL;
+    *cluster = NULL;
+    if (!attrs->topic && ctx->clusters) {
+        *cluster = pulsar_cluster_select(ctx->clusters, attrs->partition_key, pulsar_metrics_now_ns());
+        return (*cluster)->producer;
+    }
+    if (!attrs->topic) {
+        return flb_out_pulsar_producer(ctx, attrs);
+    }
+
+    *entry = pulsar_topic_map_acquire(ctx->topic_map, attrs->topic, attrs->topic_len);
+    return *entry ? (*entry)->producer : NULL;
 }
 
 // send messages synchronously
-bool pulsar_send_msg(flb_out_pulsar_ctx *ctx, const char* data, size_t len) {
+bool pulsar_send_msg(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_msg_attrs *attrs, const char* data, size_t len) {
+    struct pulsar_topic_producer *entry;
+    struct pulsar_cluster *cluster;
+    pulsar_producer_t *producer = pulsar_msg_producer(ctx, attrs, &entry, &cluster);
+    if (!producer) {
+        pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_PRODUCER_UNAVAILABLE, PULSAR_MSG_RECORDS(attrs));
+        pulsar_flush_mark_failed(flush);
+        return false;
+    }
+
+    uint64_t send_ns = pulsar_metrics_now_ns();
     pulsar_message_t* message = pulsar_message_create();
-    pulsar_message_set_content(message, data, len);
-    pulsar_result ret = pulsar_producer_send(ctx->producer, message);
+    // the send blocks until the broker responds, so the payload does not need a copy
+    pulsar_message_set_allocated_content(message, (void *) data, len);
+    pulsar_msg_set_attrs(message, attrs);
+    if (cluster) {
+        pulsar_cluster_sent(cluster, send_ns);
+    }
+    pulsar_result ret = pulsar_producer_send(producer, message);
     pulsar_message_free(message);
+    if (entry) {
+        pulsar_topic_map_release(entry);
+    }
+    if (cluster) {
+        pulsar_cluster_done(cluster, pulsar_result_Ok != ret && pulsar_result_retryable(ret), send_ns,
+                            pulsar_metrics_now_ns());
+    }
 
     if (pulsar_result_Ok == ret) {
+        pulsar_metrics_sent(&ctx->metrics, PULSAR_MSG_RECORDS(attrs), len, send_ns);
+        pulsar_adaptive_ack(&ctx->adaptive, send_ns, pulsar_metrics_now_ns());
+        return true;
+    } else if (0 == pulsar_spill_message(ctx, ret, attrs, data, len)
+               || 0 == pulsar_dead_letter_send(ctx, ret, attrs, data, len)) {
         return true;
     } else {
-        flb_plg_info(ctx->ins, "pulsar publish message failed: %s, msg: %s", pulsar_result_str(ret), data);
+        pulsar_failure_log_write(&ctx->failure_log, "pulsar publish message failed", ret, data, len);
+        pulsar_metrics_failed(&ctx->metrics, pulsar_result_str(ret), PULSAR_MSG_RECORDS(attrs));
+        pulsar_flush_mark_failed(flush);
         return false;
     }
 }
 
 // send messages asynchronously
-bool pulsar_async_send(flb_out_pulsar_ctx *ctx, const char* data, size_t len) {
+bool pulsar_async_send(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_msg_attrs *attrs, const char* data, size_t len) {
+    struct pulsar_topic_producer *entry;
+    struct pulsar_cluster *cluster;
+    pulsar_producer_t *producer;
+    size_t properties_len = attrs->properties ? attrs->properties_len : 0;
+
+    // taken before the payload is copied, the budget bounds the memory it holds
+    if (0 != pulsar_budget_acquire(ctx, flush, len + properties_len)) {
+        pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_INFLIGHT_BUDGET, PULSAR_MSG_RECORDS(attrs));
+        pulsar_flush_mark_failed(flush);
+        return false;
+    }
+
+    producer = pulsar_msg_producer(ctx, attrs, &entry, &cluster);
+    if (!producer) {
+        pulsar_budget_release(ctx, len + properties_len);
+        pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_PRODUCER_UNAVAILABLE, PULSAR_MSG_RECORDS(attrs));
+        pulsar_flush_mark_failed(flush);
+        return false;
+    }
+
+    struct pulsar_callback_ctx *pcctx = pulsar_callback_pool_get(ctx->callback_pool, len + properties_len);
+    if (!pcctx) {
+        pulsar_budget_release(ctx, len + properties_len);
+        if (entry) {
+            pulsar_topic_map_release(entry);
+        }
+        pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_OUT_OF_MEMORY, PULSAR_MSG_RECORDS(attrs));
+        pulsar_flush_mark_failed(flush);
+        return false;
+    }
+
+    // the payload lives in the pooled context until the send callback returns it
+    memcpy(pcctx->payload, data, len);
+    if (0 < properties_len) {
+        memcpy(pcctx->payload + len, attrs->properties, properties_len);
+    }
     pulsar_message_t* message = pulsar_message_create();
-    pulsar_message_set_content(message, data, len);
+    pulsar_message_set_allocated_content(message, pcctx->payload, len);
+    pulsar_msg_set_attrs(message, attrs);
 
-    struct pulsar_callback_ctx *pcctx = flb_calloc(1, sizeof(struct pulsar_callback_ctx));
     pcctx->ctx = ctx;
     pcctx->msg = message;
-    
-    pulsar_producer_send_async(ctx->producer, message, flb_pulsar_send_callback, pcctx);
+    pcctx->flush = flush;
+    pcctx->topic_producer = entry;
+    pcctx->cluster = cluster;
+    pcctx->record_count = attrs->record_count;
+    pcctx->properties_len = properties_len;
+    pcctx->inflight_bytes = len + properties_len;
+    pcctx->event_time = attrs->event_time;
+    pcctx->dead_letter = false;
+    pcctx->send_ns = pulsar_metrics_now_ns();
+
+    // the callback may run before send_async returns, so account for it first
+    pthread_mutex_lock(&flush->lock);
+    ++flush->pending;
+    ++flush->refs;
+    pthread_mutex_unlock(&flush->lock);
+    pulsar_inflight_add(ctx, 1);
+    if (cluster) {
+        pulsar_cluster_sent(cluster, pcctx->send_ns);
+    }
+
+    pulsar_producer_send_async(producer, message, flb_pulsar_send_callback, pcctx);
     return true;
 }
 
+// replay thread of the spill: send a spilled message again, synchronously
+static int pulsar_spill_replay(void *data, struct pulsar_spill_entry *entry)
+{
+    flb_out_pulsar_ctx *ctx = data;
+    pulsar_result ret;
+    uint64_t send_ns;
+    pulsar_producer_t *producer;
+    pulsar_message_t *message;
+    struct pulsar_topic_producer *topic_producer;
+    struct pulsar_cluster *cluster;
+    struct pulsar_msg_attrs attrs = { 0 };
+
+    // spilled by a run with another kind of topic configuration
+    if ((entry->topic != NULL) != (ctx->topic_map != NULL)) {
+        flb_plg_error(ctx->ins, "drop spilled message of topic %s, it does not match %s",
+                      entry->topic ? entry->topic : ctx->pulsar_producer_topic, PULSAR_KEY_TOPIC_NAME);
+        pulsar_metrics_failed(&ctx->metrics, PULSAR_METRICS_TOPIC_UNRESOLVED, PULSAR_MSG_RECORDS(entry));
+        return 1;
+    }
+
+    attrs.partition_key = entry->partition_key;
+    attrs.topic = entry->topic;
+    attrs.topic_len = entry->topic_len;
+    attrs.record_count = entry->record_count;
+    attrs.properties = entry->properties;
+    attrs.properties_len = entry->properties_len;
+    attrs.event_time = entry->event_time;
+    producer = pulsar_msg_producer(ctx, &attrs, &topic_producer, &cluster);
+    if (!producer) {
+        return -1;
+    }
+
+    message = pulsar_message_create();
+    pulsar_message_set_allocated_content(message, (void *) entry->payload, entry->payload_len);
+    pulsar_msg_set_attrs(message, &attrs);
+    send_ns = pulsar_metrics_now_ns();
+    if (cluster) {
+        pulsar_cluster_sent(cluster, send_ns);
+    }
+    ret = pulsar_producer_send(producer, message);
+    pulsar_message_free(message);
+    if (topic_producer) {
+        pulsar_topic_map_release(topic_producer);
+    }
+    if (cluster) {
+        pulsar_cluster_done(cluster, pulsar_result_Ok != ret && pulsar_result_retryable(ret), send_ns,
+                            pulsar_metrics_now_ns());
+    }
+
+    if (pulsar_result_Ok == ret) {
+        pulsar_metrics_replayed(&ctx->metrics, PULSAR_MSG_RECORDS(entry));
+        return 0;
+    }
+    if (!pulsar_result_retryable(ret)) {
+        if (0 == pulsar_dead_letter_send(ctx, ret, &attrs, entry->payload, entry->payload_len)) {
+            return 1;
+        }
+        pulsar_failure_log_write(&ctx->failure_log, "drop spilled message", ret, NULL, 0);
+        pulsar_metrics_failed(&ctx->metrics, pulsar_result_str(ret), PULSAR_MSG_RECORDS(entry));
+        return 1;
+    }
+    flb_plg_debug(ctx->ins, "replay of spilled messages failed: %s, retry later", pulsar_result_str(ret));
+    return -1;
+}
+
+/*
+ * Windowed sync mode: messages are sent asynchronously, but a flush keeps at
+ * most syncSendWindow of them in flight. The flush still waits for all acks
+ * before it returns, so the durability is the one of the sync mode.
+ */
+bool pulsar_window_send(flb_out_pulsar_ctx *ctx, struct pulsar_flush_ctx *flush, struct pulsar_msg_attrs *attrs, const char* data, size_t len) {
+    int ret = 0;
+    struct timespec deadline;
+
+    // the window frees up with the acks, which come within the same deadline as the ones of the flush
+    pulsar_send_deadline(ctx, &deadline);
+    pthread_mutex_lock(&flush->lock);
+    while (!flush->stalled && (uint32_t) ctx->sync_send_window <= flush->pending && ETIMEDOUT != ret) {
+        ret = pthread_cond_timedwait(&flush->cond, &flush->lock, &deadline);
+    }
+    if (flush->stalled || (uint32_t) ctx->sync_send_window <= flush->pending) {
+        // the chunk is retried anyway, the records left are not waited for one by one
+        if (!flush->stalled) {
+            flush->stalled = true;
+            flb_plg_warn(ctx->ins, "%u messages not acked in time, %s is full", flush->pending,
+                         OUTPUT_KEY_SYNC_SEND_WINDOW);
+        }
+        ++flush->failed;
+        pthread_mutex_unlock(&flush->lock);
+        pulsar_metrics_failed(&ctx->metrics, pulsar_result_str(pulsar_result_Timeout), PULSAR_MSG_RECORDS(attrs));
+        return false;
+    }
+    pthread_mutex_unlock(&flush->lock);
+
+    return pulsar_async_send(ctx, flush, attrs, data, len);
+}
+
 const char* get_msg_send_async(flb_out_pulsar_ctx *ctx) {
     return ctx->is_async ? "true" : "false";
 }
+const char* get_config_producer_per_worker(flb_out_pulsar_ctx *ctx) {
+    return ctx->producer_per_worker ? "true" : "false";
+}
+uint32_t get_config_callback_pool_size(flb_out_pulsar_ctx *ctx) {
+    return ctx->callback_pool ? ctx->callback_pool->size : 0;
+}
+int get_config_workers(flb_out_pulsar_ctx *ctx) {
+    return ctx->ins->tp_workers;
+}
 const uint32_t get_config_show_interval(flb_out_pulsar_ctx *ctx) {
     return ctx->show_interval;
 }
@@ -66,10 +767,15 @@ const char* get_config_output_schema(flb_out_pulsar_ctx *ctx) {
         return "MSGPACK";
     case FLB_PULSAR_SCHEMA_GELF:
         return "GELF";
+    case FLB_PULSAR_SCHEMA_AVRO:
+        return "AVRO";
     default:
         return "JSON";
     }
 }
+static int get_config_key_count(struct mk_list *keys) {
+    return keys ? mk_list_size(keys) : 0;
+}
 const char* get_pulsar_url(flb_out_pulsar_ctx *ctx) {
     return ctx->pulsar_broker_url;
 }
@@ -124,6 +830,18 @@ const char* get_producer_compression_type(flb_out_pulsar_ctx *ctx) {
         return "";
     }
 }
+const char* get_producer_batching_type(flb_out_pulsar_ctx *ctx) {
+    switch (pulsar_producer_configuration_get_batching_type(ctx->producer_conf))
+    {
+    case pulsar_KeyBasedBatching:
+        return "KeyBased";
+    default:
+        return "Default";
+    }
+}
+const char* get_config_partition_key(flb_out_pulsar_ctx *ctx) {
+    return ctx->partition_key ? ctx->partition_key : "";
+}
 int64_t get_producer_initial_sequence_id(flb_out_pulsar_ctx *ctx) {
     return pulsar_producer_configuration_get_initial_sequence_id(ctx->producer_conf);
 }
@@ -190,19 +908,158 @@ const char* get_producer_crypto_failure_action(flb_out_pulsar_ctx *ctx) {
     }
 }
 
+static void pulsar_msg_properties_destroy(flb_out_pulsar_ctx *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pulsar_msg_property *prop;
+
+    mk_list_foreach_safe(head, tmp, &ctx->properties) {
+        prop = mk_list_entry(head, struct pulsar_msg_property, _head);
+        mk_list_del(&prop->_head);
+        if (prop->ra) {
+            flb_ra_destroy(prop->ra);
+        }
+        flb_sds_destroy(prop->name);
+        flb_free(prop);
+    }
+}
+
+/*
+ * Entries of messageProperties are a top level field name, or name:pattern
+ * with a record accessor pattern, $TAG standing for the record tag.
+ */
+static int pulsar_msg_properties_create(flb_out_pulsar_ctx *ctx)
+{
+    const char *sep;
+    flb_sds_t pattern;
+    struct mk_list *head;
+    struct flb_slist_entry *entry;
+    struct pulsar_msg_property *prop;
+
+    if (!ctx->message_properties) {
+        return 0;
+    }
+
+    mk_list_foreach(head, ctx->message_properties) {
+        entry = mk_list_entry(head, struct flb_slist_entry, _head);
+        prop = flb_calloc(1, sizeof(struct pulsar_msg_property));
+        if (!prop) {
+            flb_errno();
+            return -1;
+        }
+        mk_list_add(&prop->_head, &ctx->properties);
+
+        sep = '$' == entry->str[0] ? NULL : strchr(entry->str, ':');
+        if (sep) {
+            prop->name = flb_sds_create_len(entry->str, sep - entry->str);
+            pattern = flb_sds_create(sep + 1);
+        } else {
+            prop->name = flb_sds_create(entry->str);
+            pattern = flb_sds_create_size(flb_sds_len(entry->str) + 1);
+            if (pattern) {
+                flb_sds_printf(&pattern, "$%s", entry->str);
+            }
+        }
+        if (!prop->name || !pattern || 0 == flb_sds_len(prop->name) || '$' == prop->name[0]) {
+            flb_plg_error(ctx->ins, "invalid %s entry '%s', expected <field> or <name>:<pattern>",
+                          OUTPUT_KEY_MESSAGE_PROPERTIES, entry->str);
+            if (pattern) {
+                flb_sds_destroy(pattern);
+            }
+            return -1;
+        }
+
+        if (0 != strcmp(pattern, "$TAG")) {
+            prop->ra = flb_ra_create(pattern, FLB_TRUE);
+            if (!prop->ra) {
+                flb_plg_error(ctx->ins, "invalid %s pattern: %s", OUTPUT_KEY_MESSAGE_PROPERTIES, pattern);
+                flb_sds_destroy(pattern);
+                return -1;
+            }
+        }
+        flb_sds_destroy(pattern);
+    }
+    return 0;
+}
+
+/*
+ * pulsarBrokerUrl is the first cluster, with the client and producer already
+ * created, then every pulsarCluster entry, as <url> [priority] [weight], gets
+ * its own client and producer on the same topic with the same configuration.
+ */
+static int pulsar_clusters_create(flb_out_pulsar_ctx *ctx)
+{
+    int i = 0;
+    int n;
+    pulsar_result err;
+    struct mk_list *head;
+    struct flb_config_map_val *mv;
+    struct pulsar_cluster *c;
+
+    ctx->clusters = flb_calloc(1, sizeof(struct pulsar_cluster_set));
+    if (!ctx->clusters) {
+        flb_errno();
+        return -1;
+    }
+    if (0 != pulsar_cluster_set_init(ctx->clusters, ctx->ins, &ctx->metrics, mk_list_size(ctx->cluster_entries) + 1,
+                                     ctx->failover_error_rate, ctx->failover_latency_ms, ctx->failover_recovery_s)) {
+        return -1;
+    }
+
+    c = &ctx->clusters->clusters[0];
+    c->url = ctx->pulsar_broker_url;
+    c->priority = 0;
+    c->weight = 1;
+    c->client = ctx->client;
+    c->producer = ctx->producer;
+    pulsar_metrics_cluster(&ctx->metrics, c->url, PULSAR_CLUSTER_HEALTHY);
+
+    flb_config_map_foreach(head, mv, ctx->cluster_entries) {
+        c = &ctx->clusters->clusters[++i];
+        n = mk_list_size(mv->val.list);
+        c->url = flb_slist_entry_get(mv->val.list, 0)->str;
+        c->priority = 1 < n ? atoi(flb_slist_entry_get(mv->val.list, 1)->str) : 0;
+        c->weight = 2 < n ? atoi(flb_slist_entry_get(mv->val.list, 2)->str) : 1;
+        if (3 < n || c->priority < 0 || c->weight <= 0) {
+            flb_plg_error(ctx->ins, "invalid %s '%s', expected <url> [priority] [weight]", PULSAR_KEY_CLUSTER, c->url);
+            return -1;
+        }
+
+        c->owned = true;
+        c->client = pulsar_client_create(c->url, ctx->client_conf);
+        if (!c->client) {
+            flb_plg_error(ctx->ins, "create pulsar client of %s failed !", c->url);
+            return -1;
+        }
+        err = pulsar_client_create_producer(c->client, ctx->pulsar_producer_topic, ctx->producer_conf, &c->producer);
+        if (err != pulsar_result_Ok) {
+            flb_plg_error(ctx->ins, "Failed to create pulsar producer on %s: %s", c->url, pulsar_result_str(err));
+            return -1;
+        }
+        pulsar_metrics_cluster(&ctx->metrics, c->url, PULSAR_CLUSTER_HEALTHY);
+    }
+    return 0;
+}
+
 // int context
 flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struct flb_config* config)
 {
+    int i;
     int ret;
     pulsar_result err;
     const char *pvalue;
-    long memory_limit = 0;
+    char suffix[32];
+    char dead_letter_name[256];
+    pulsar_string_map_t *properties;
+    int64_t memory_limit = 0;
     long send_timeout = 0;
     long batch_max_msg = 0;
     long batch_max_bytes = 0;
     long batch_max_delay = 0;
     long max_pending_msg = 0;
     long max_pending_par = 0;
+    long pool_size = 0;
     char config_log[1 << 12] = { 0 };
     char *plog = config_log;
 
@@ -218,25 +1075,58 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
     ctx->pulsar_broker_url = NULL;
     ctx->pulsar_auth_token = NULL;
     ctx->pulsar_producer_topic = NULL;
+    ctx->partition_key = NULL;
+    ctx->partition_key_ra = NULL;
+    ctx->topic_ra = NULL;
+    ctx->topic_map = NULL;
+    ctx->spill = NULL;
+    ctx->projection = NULL;
+    ctx->avro = NULL;
+    mk_list_init(&ctx->properties);
     ctx->client = NULL;
     ctx->producer = NULL;
+    ctx->stripes = NULL;
+    ctx->dead_letter_conf = NULL;
+    ctx->dead_letter_producer = NULL;
+    ctx->clusters = NULL;
+    ctx->zstd = NULL;
     ctx->authentication = NULL;
     ctx->client_conf = NULL;
     ctx->producer_conf = NULL;
-    ctx->total_number = 0;
-    ctx->failed_number = 0;
-    ctx->success_number = 0;
-    ctx->discarded_number = 0;
+    ctx->callback_pool = NULL;
+    atomic_init(&ctx->total_number, 0);
+    atomic_init(&ctx->failed_number, 0);
+    atomic_init(&ctx->success_number, 0);
+    atomic_init(&ctx->discarded_number, 0);
+    atomic_init(&ctx->inflight, 0);
+    atomic_init(&ctx->drain_deadline_ns, 0);
+    atomic_init(&ctx->inflight_bytes, 0);
+    atomic_init(&ctx->budget_waiters, 0);
+    atomic_init(&ctx->budget_paused, false);
+    pthread_mutex_init(&ctx->budget_lock, NULL);
+    pulsar_cond_init(&ctx->budget_cond);
+    atomic_init(&ctx->worker_seq, 0);
+    atomic_init(&ctx->stripe_seq, 0);
+    pthread_mutex_init(&ctx->producer_lock, NULL);
+    pulsar_adaptive_init(&ctx->adaptive);
+    pulsar_arena_pool_init(&ctx->arenas);
+    if (0 != pulsar_metrics_init(&ctx->metrics, ins)) {
+        flb_plg_error(ins, "register pulsar metrics failed.");
+        flb_out_pulsar_destroy(ctx);
+        return NULL;
+    }
+    pthread_once(&pulsar_worker_tls_once, pulsar_worker_tls_init);
     ctx->data_schema = FLB_PULSAR_SCHEMA_JSON;
     ctx->show_interval = DEFAULT_SHOW_INTERVAL;
 
     // load config
     ret = flb_output_config_map_set(ins, (void*) ctx);
     if (ret < 0) {
-        flb_free(ctx);
         flb_plg_error(ins, "unable to load output configuration.");
+        flb_out_pulsar_destroy(ctx);
         return NULL;
     }
+    pulsar_failure_log_init(&ctx->failure_log, ins, ctx->failure_log_rate, ctx->failure_log_payload_bytes);
 
     // check url and topic
     if (ctx->pulsar_broker_url == NULL || ctx->pulsar_producer_topic == NULL) {
@@ -245,8 +1135,106 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         return NULL;
     }
 
+    // record accessor of the message partition key
+    if (ctx->partition_key && 0 < strlen(ctx->partition_key)) {
+        ctx->partition_key_ra = flb_ra_create(ctx->partition_key, FLB_TRUE);
+        if (!ctx->partition_key_ra) {
+            flb_plg_error(ins, "invalid %s: %s", PULSAR_KEY_PARTITION_KEY, ctx->partition_key);
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    // message properties, a plain field name is also the property name
+    if (0 != pulsar_msg_properties_create(ctx)) {
+        flb_out_pulsar_destroy(ctx);
+        return NULL;
+    }
+
     // init pulsar producer send function
-    ctx->send_msg_func = (ctx->is_async ? pulsar_async_send : pulsar_send_msg);
+    if (ctx->is_async) {
+        ctx->send_msg_func = pulsar_async_send;
+    } else if (1 < ctx->sync_send_window) {
+        ctx->send_msg_func = pulsar_window_send;
+    } else {
+        ctx->sync_send_window = 1;
+        ctx->send_msg_func = pulsar_send_msg;
+    }
+    // without workers a flush runs on the engine thread, waiting for acks there would stall every plugin
+    if (pulsar_send_msg != ctx->send_msg_func && 1 > ins->tp_workers) {
+        flb_plg_warn(ins, "%s and %s wait for acks in the flush, which needs a worker: workers set to 1",
+                     PULSAR_KEY_ASYNC_SEND, OUTPUT_KEY_SYNC_SEND_WINDOW);
+        ins->tp_workers = 1;
+    }
+
+    // parse data schema
+    pvalue = flb_output_get_property(OUTPUT_KEY_DATA_SCHEMA, ins);
+    if (pvalue) {
+        if (0 == strcasecmp("JSON", pvalue)) {
+            ctx->data_schema = FLB_PULSAR_SCHEMA_JSON;
+        } else if (0 == strcasecmp("MSGPACK", pvalue)) {
+            ctx->data_schema = FLB_PULSAR_SCHEMA_MSGP;
+        } else if (0 == strcasecmp("GELF", pvalue)) {
+            ctx->data_schema = FLB_PULSAR_SCHEMA_GELF;
+            pulsar_gelf_conf_init(&ctx->gelf);
+        } else if (0 == strcasecmp("AVRO", pvalue)) {
+            ctx->data_schema = FLB_PULSAR_SCHEMA_AVRO;
+        } else {
+            flb_plg_warn(ins, "unsupported output schema type: %s", pvalue);
+        }
+    }
+
+    // avro records are encoded after the schema file, which is registered on the producers
+    if (FLB_PULSAR_SCHEMA_AVRO == ctx->data_schema) {
+        if (!ctx->avro_schema_file || 0 == flb_sds_len(ctx->avro_schema_file)) {
+            flb_out_pulsar_destroy(ctx);
+            flb_plg_error(ins, "MUST be specify field '%s' with the AVRO schema.", OUTPUT_KEY_AVRO_SCHEMA_FILE);
+            return NULL;
+        }
+        ctx->avro = pulsar_avro_schema_create(ins, ctx->avro_schema_file);
+        if (!ctx->avro) {
+            flb_plg_error(ins, "load avro schema %s failed !", ctx->avro_schema_file);
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+        if (ctx->chunk_packing || ctx->adaptive_batching) {
+            flb_plg_warn(ins, "%s is ignored with the AVRO schema", ctx->adaptive_batching
+                         ? OUTPUT_KEY_ADAPTIVE_BATCHING : OUTPUT_KEY_CHUNK_PACKING);
+            ctx->chunk_packing = false;
+            ctx->adaptive_batching = false;
+        }
+    }
+
+    // payloads compressed by the plugin, consumers decompress them after the message properties
+    if (ctx->zstd_compression) {
+        if (ctx->avro) {
+            flb_plg_warn(ins, "%s is ignored with the AVRO schema", OUTPUT_KEY_ZSTD_COMPRESSION);
+            ctx->zstd_compression = false;
+        } else {
+            pvalue = flb_output_get_property(PULSAR_KEY_COMPRESSION_TYPE, ins);
+            if (pvalue && 0 != strcasecmp("NONE", pvalue)) {
+                flb_plg_warn(ins, "%s %s compresses the zstd frames of %s again", PULSAR_KEY_COMPRESSION_TYPE,
+                             pvalue, OUTPUT_KEY_ZSTD_COMPRESSION);
+            }
+            ctx->zstd = pulsar_zstd_create(ins, ctx->zstd_level, ctx->zstd_dictionary,
+                                           0 < ctx->zstd_train_records ? ctx->zstd_train_records : 0,
+                                           ctx->zstd_dictionary_size);
+            if (!ctx->zstd) {
+                flb_out_pulsar_destroy(ctx);
+                flb_plg_error(ins, "create zstd compression failed !");
+                return NULL;
+            }
+        }
+    }
+
+    // adaptive batching tunes the packs of chunkPacking, bounded by its limits
+    if (ctx->adaptive_batching && !ctx->chunk_packing) {
+        flb_plg_info(ins, "%s enables %s", OUTPUT_KEY_ADAPTIVE_BATCHING, OUTPUT_KEY_CHUNK_PACKING);
+        ctx->chunk_packing = true;
+    }
+    pulsar_adaptive_configure(&ctx->adaptive, ctx->adaptive_batching, ctx->adaptive_min_records,
+                              ctx->chunk_packing_max_records, ctx->chunk_packing_max_bytes,
+                              ctx->adaptive_delay_ms, ctx->adaptive_latency_ms);
 
     /*
      * config and create pulsar client
@@ -258,8 +1246,20 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
     }
 
     pvalue = flb_output_get_property(PULSAR_KEY_MEMORY_LIMIT, ins);
-    if (pvalue && PULSAR_DEFAULT_MEMORY_LIMIT < (memory_limit = atol(pvalue))) {
-        pulsar_client_configuration_set_memory_limit(ctx->client_conf, memory_limit);
+    if (pvalue) {
+        memory_limit = flb_utils_size_to_bytes(pvalue);
+        if (0 > memory_limit) {
+            flb_plg_error(ins, "invalid %s: %s", PULSAR_KEY_MEMORY_LIMIT, pvalue);
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+        pulsar_client_configuration_set_memory_limit(ctx->client_conf, (uint64_t) memory_limit);
+    }
+    if (0 < ctx->io_threads) {
+        pulsar_client_configuration_set_io_threads(ctx->client_conf, ctx->io_threads);
+    }
+    if (0 < ctx->message_listener_threads) {
+        pulsar_client_configuration_set_message_listener_threads(ctx->client_conf, ctx->message_listener_threads);
     }
     
     ctx->client = pulsar_client_create(ctx->pulsar_broker_url, ctx->client_conf);
@@ -340,6 +1340,18 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         pulsar_producer_configuration_set_batching_max_publish_delay_ms(ctx->producer_conf, batch_max_delay);
     }
 
+    // set batchingType
+    pvalue = flb_output_get_property(PULSAR_KEY_BATCHING_TYPE, ins);
+    if (pvalue) {
+        if (0 == strcasecmp("Default", pvalue)) {
+            pulsar_producer_configuration_set_batching_type(ctx->producer_conf, pulsar_DefaultBatching);
+        } else if (0 == strcasecmp("KeyBased", pvalue)) {
+            pulsar_producer_configuration_set_batching_type(ctx->producer_conf, pulsar_KeyBasedBatching);
+        } else {
+            flb_plg_warn(ins, "unsupported pulsar %s: %s", PULSAR_KEY_BATCHING_TYPE, pvalue);
+        }
+    }
+
     // set blockIfQueueFull
     pvalue = flb_output_get_property(PULSAR_KEY_BLOCK_IF_QUEUE_FULL, ins);
     if (pvalue) {
@@ -388,39 +1400,201 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         }
     }
 
-    // create pulsar producer
-    err = pulsar_client_create_producer(ctx->client, ctx->pulsar_producer_topic, ctx->producer_conf, &ctx->producer);
-    if (err != pulsar_result_Ok) {
+    // set schema info
+    if (ctx->avro) {
+        properties = pulsar_string_map_create();
+        pulsar_producer_configuration_set_schema_info(ctx->producer_conf, pulsar_Avro, ctx->avro->name,
+                                                      ctx->avro->json, properties);
+        pulsar_string_map_free(properties);
+    }
+
+    // failover clusters take the static topic, each with one producer
+    if (ctx->cluster_entries && 0 < mk_list_size(ctx->cluster_entries)) {
+        if (strchr(ctx->pulsar_producer_topic, '$')) {
+            flb_plg_warn(ins, "%s is ignored with a templated topic", PULSAR_KEY_CLUSTER);
+            ctx->cluster_entries = NULL;
+        } else {
+            if (ctx->producer_per_worker) {
+                flb_plg_warn(ins, "%s is ignored with %s", OUTPUT_KEY_PRODUCER_PER_WORKER, PULSAR_KEY_CLUSTER);
+                ctx->producer_per_worker = false;
+            }
+            if (1 < ctx->producer_stripes) {
+                flb_plg_warn(ins, "%s is ignored with %s", OUTPUT_KEY_PRODUCER_STRIPES, PULSAR_KEY_CLUSTER);
+                ctx->producer_stripes = 1;
+            }
+        }
+    }
+
+    // a topic with record accessor parts gets its producers per resolved name
+    if (strchr(ctx->pulsar_producer_topic, '$')) {
+        ctx->topic_ra = flb_ra_create(ctx->pulsar_producer_topic, FLB_TRUE);
+        if (!ctx->topic_ra) {
+            flb_plg_error(ins, "invalid %s template: %s", PULSAR_KEY_TOPIC_NAME, ctx->pulsar_producer_topic);
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+        ctx->topic_map = pulsar_topic_map_create(ins, ctx->client, ctx->producer_conf,
+                                                 ctx->max_topic_producers, ctx->topic_idle_timeout);
+        if (!ctx->topic_map) {
+            flb_out_pulsar_destroy(ctx);
+            flb_plg_error(ins, "create topic producer map failed !");
+            return NULL;
+        }
+        if (ctx->producer_per_worker) {
+            flb_plg_warn(ins, "%s is ignored with a templated topic", OUTPUT_KEY_PRODUCER_PER_WORKER);
+            ctx->producer_per_worker = false;
+        }
+        if (1 < ctx->producer_stripes) {
+            flb_plg_warn(ins, "%s is ignored with a templated topic", OUTPUT_KEY_PRODUCER_STRIPES);
+            ctx->producer_stripes = 1;
+        }
+    } else if (1 < ctx->producer_stripes) {
+        if (ctx->producer_per_worker) {
+            flb_plg_warn(ins, "%s is ignored with %s", OUTPUT_KEY_PRODUCER_PER_WORKER, OUTPUT_KEY_PRODUCER_STRIPES);
+            ctx->producer_per_worker = false;
+        }
+        ctx->stripes = flb_calloc(ctx->producer_stripes, sizeof(pulsar_producer_t*));
+        if (!ctx->stripes) {
+            flb_errno();
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+        for (i = 0; i < ctx->producer_stripes; i++) {
+            snprintf(suffix, sizeof(suffix), "stripe-%d", i);
+            err = pulsar_create_suffixed_producer(ctx, suffix, &ctx->stripes[i]);
+            if (err != pulsar_result_Ok) {
+                flb_plg_error(ins, "Failed to create pulsar producer stripe #%d: %s", i, pulsar_result_str(err));
+                flb_out_pulsar_destroy(ctx);
+                return NULL;
+            }
+        }
+    } else {
+        // create pulsar producer
+        err = pulsar_client_create_producer(ctx->client, ctx->pulsar_producer_topic, ctx->producer_conf, &ctx->producer);
+        if (err != pulsar_result_Ok) {
+            flb_out_pulsar_destroy(ctx);
+            flb_plg_error(ins, "Failed to create pulsar producer: %s\n", pulsar_result_str(err));
+            return NULL;
+        }
+    }
+
+    if (ctx->cluster_entries && 0 < mk_list_size(ctx->cluster_entries) && 0 != pulsar_clusters_create(ctx)) {
         flb_out_pulsar_destroy(ctx);
-        flb_plg_error(ins, "Failed to create pulsar producer: %s\n", pulsar_result_str(err));
         return NULL;
     }
     
-    // parse data schema
-    pvalue = flb_output_get_property(OUTPUT_KEY_DATA_SCHEMA, ins);
-    if (pvalue) {
-        if (0 == strcasecmp("JSON", pvalue)) {
-            ctx->data_schema = FLB_PULSAR_SCHEMA_JSON;
-        } else if (0 == strcasecmp("MSGPACK", pvalue)) {
-            ctx->data_schema = FLB_PULSAR_SCHEMA_MSGP;
-        } else if (0 == strcasecmp("GELF", pvalue)) {
-            ctx->data_schema = FLB_PULSAR_SCHEMA_GELF;
-        } else {
-            flb_plg_warn(ins, "unsupported output schema type: %s", pvalue);
+    // rejected messages go to the dead-letter topic one by one, and without blocking the send callbacks
+    if (ctx->dead_letter_topic && 0 < flb_sds_len(ctx->dead_letter_topic)) {
+        ctx->dead_letter_conf = pulsar_producer_configuration_create();
+        pvalue = get_producer_name(ctx);
+        if (pvalue && 0 < strlen(pvalue)) {
+            snprintf(dead_letter_name, sizeof(dead_letter_name), "%s-dead-letter", pvalue);
+            pulsar_producer_configuration_set_producer_name(ctx->dead_letter_conf, dead_letter_name);
+        }
+        pulsar_producer_configuration_set_send_timeout(ctx->dead_letter_conf, get_producer_send_timeout(ctx));
+        pulsar_producer_configuration_set_batching_enabled(ctx->dead_letter_conf, 0);
+        pulsar_producer_configuration_set_block_if_queue_full(ctx->dead_letter_conf, 0);
+        err = pulsar_client_create_producer(ctx->client, ctx->dead_letter_topic, ctx->dead_letter_conf,
+                                            &ctx->dead_letter_producer);
+        if (err != pulsar_result_Ok) {
+            flb_plg_error(ins, "Failed to create dead-letter producer on %s: %s", ctx->dead_letter_topic,
+                          pulsar_result_str(err));
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    // callback contexts of the async path, one per message the producers may hold pending
+    if (ctx->send_msg_func != pulsar_send_msg) {
+        pool_size = get_producer_max_pending_messages(ctx);
+        if (ctx->producer_per_worker && 0 < ctx->ins->tp_workers) {
+            pool_size *= ctx->ins->tp_workers;
+        } else if (ctx->stripes) {
+            pool_size *= ctx->producer_stripes;
+        } else if (ctx->clusters) {
+            pool_size *= ctx->clusters->count;
+        }
+        ctx->callback_pool = pulsar_callback_pool_create(0 < pool_size ? pool_size : 0);
+        if (!ctx->callback_pool) {
+            flb_out_pulsar_destroy(ctx);
+            flb_plg_error(ins, "create callback pool failed !");
+            return NULL;
         }
     }
 
+    // spill of the messages the broker did not take, replayed by its own thread
+    if (ctx->spill_path && 0 < flb_sds_len(ctx->spill_path)) {
+        ctx->spill = pulsar_spill_create(ins, ctx->spill_path, ctx->spill_segment_bytes, ctx->spill_max_bytes,
+                                         ctx->spill_replay_rate, pulsar_spill_replay, ctx);
+        if (!ctx->spill) {
+            flb_plg_error(ins, "create spill in %s failed !", ctx->spill_path);
+            flb_out_pulsar_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    // key projection, applied by the encoders of every schema
+    ctx->projection = pulsar_projection_create(ins, ctx->include_keys, ctx->exclude_keys, ctx->rename_keys);
+    if (!ctx->projection && 0 < get_config_key_count(ctx->include_keys) + get_config_key_count(ctx->exclude_keys)
+                                + get_config_key_count(ctx->rename_keys)) {
+        flb_out_pulsar_destroy(ctx);
+        flb_plg_error(ins, "parse key projection failed !");
+        return NULL;
+    }
+    ctx->gelf.projection = ctx->projection;
+
     // print config
     flb_plg_info(ins, "fluent-bit pulsar output plugin config:\n"
         "    show progress interval:                 %u\n"
         "    output data schema:                     %s\n"
+        "    avro schema:                            %s\n"
         "    pulsar client version:                  %u\n"
         "    is send message by async:               %s\n"
+        "    sync send window:                       %d\n"
+        "    workers:                                %d\n"
+        "    producer per worker:                    %s\n"
+        "    producer stripes:                       %d\n"
+        "    producer stripe key affinity:           %s\n"
+        "    io threads:                             %d\n"
+        "    message listener threads:               %d\n"
+        "    callback pool size:                     %u\n"
+        "    chunk packing:                          %s\n"
+        "    chunk packing max records:              %d\n"
+        "    chunk packing max bytes:                %d\n"
+        "    adaptive batching:                      %s\n"
+        "    adaptive batching min records:          %d\n"
+        "    adaptive batching delay:                %d\n"
+        "    adaptive batching latency:              %d\n"
+        "    spill path:                             %s\n"
+        "    spill max bytes:                        %zu\n"
+        "    spill replay rate:                      %d\n"
+        "    dead letter topic:                      %s\n"
+        "    dead letter max bytes:                  %zu\n"
+        "    failure log rate:                       %d\n"
+        "    failure log payload bytes:              %zu\n"
+        "    drain timeout ms:                       %d\n"
+        "    inflight max bytes:                     %zu\n"
+        "    include keys:                           %d\n"
+        "    exclude keys:                           %d\n"
+        "    rename keys:                            %d\n"
+        "    message properties:                     %d\n"
+        "    metadata properties:                    %s\n"
         "    pulsar url:                             %s\n"
+        "    failover clusters:                      %d\n"
+        "    failover error rate:                    %.2f\n"
+        "    failover latency ms:                    %d\n"
+        "    failover recovery seconds:              %d\n"
+        "    zstd compression:                       %s\n"
+        "    zstd level:                             %d\n"
+        "    zstd dictionary:                        %s\n"
+        "    zstd dictionary train records:          %d\n"
+        "    zstd dictionary size:                   %zu\n"
         "    auth token:                             %s\n"
         "    memory limit:                           %"PRIu64"\n"
         "    producer name:                          %s\n"
         "    topic:                                  %s\n"
+        "    max topic producers:                    %d\n"
+        "    topic producer idle timeout:            %d\n"
         "    send timeout:                           %d\n"
         "    compress type:                          %s\n"
         "    initial sequence id:                    %"PRId64"\n"
@@ -428,9 +1602,11 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         "    max pending messages across partitions: %d\n"
         "    partitions routing mode:                %s\n"
         "    hashing schema:                         %s\n"
+        "    partition key:                          %s\n"
         "    lazy start partitioned producers:       %d\n"
         "    block if queue full:                    %s\n"
         "    batching enabled:                       %s\n"
+        "    batching type:                          %s\n"
         "    batching max messages:                  %u\n"
         "    batching max bytes:                     %u\n"
         "    batching max publish delay:             %u\n"
@@ -438,13 +1614,54 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         "    crypto failure action:                  %s\n",
         get_config_show_interval(ctx),
         get_config_output_schema(ctx),
+        ctx->avro ? ctx->avro->name : "",
         PULSAR_VERSION,
         get_msg_send_async(ctx),
+        ctx->sync_send_window,
+        get_config_workers(ctx),
+        get_config_producer_per_worker(ctx),
+        ctx->stripes ? ctx->producer_stripes : 1,
+        ctx->stripe_key_affinity ? "true" : "false",
+        pulsar_client_configuration_get_io_threads(ctx->client_conf),
+        pulsar_client_configuration_get_message_listener_threads(ctx->client_conf),
+        get_config_callback_pool_size(ctx),
+        ctx->chunk_packing ? "true" : "false",
+        ctx->chunk_packing_max_records,
+        ctx->chunk_packing_max_bytes,
+        ctx->adaptive_batching ? "true" : "false",
+        ctx->adaptive_min_records,
+        ctx->adaptive_delay_ms,
+        ctx->adaptive_latency_ms,
+        ctx->spill ? ctx->spill_path : "",
+        ctx->spill_max_bytes,
+        ctx->spill_replay_rate,
+        ctx->dead_letter_producer ? ctx->dead_letter_topic : "",
+        ctx->dead_letter_max_bytes,
+        ctx->failure_log_rate,
+        ctx->failure_log_payload_bytes,
+        ctx->drain_timeout_ms,
+        ctx->inflight_max_bytes,
+        get_config_key_count(ctx->include_keys),
+        get_config_key_count(ctx->exclude_keys),
+        get_config_key_count(ctx->rename_keys),
+        mk_list_size(&ctx->properties),
+        ctx->metadata_properties ? "true" : "false",
         get_pulsar_url(ctx),
+        ctx->clusters ? ctx->clusters->count : 1,
+        ctx->failover_error_rate,
+        ctx->failover_latency_ms,
+        ctx->failover_recovery_s,
+        ctx->zstd ? "true" : "false",
+        ctx->zstd_level,
+        ctx->zstd_dictionary ? ctx->zstd_dictionary : "",
+        ctx->zstd_train_records,
+        ctx->zstd_dictionary_size,
         get_pulsar_auth_token(ctx),
         get_pulsar_memory_limit(ctx),
         get_producer_name(ctx),
         get_producer_topic(ctx),
+        ctx->max_topic_producers,
+        ctx->topic_idle_timeout,
         get_producer_send_timeout(ctx),
         get_producer_compression_type(ctx),
         get_producer_initial_sequence_id(ctx),
@@ -452,9 +1669,11 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
         get_producer_max_pending_messages_across_partitions(ctx),
         get_producer_partitions_routing_mode(ctx),
         get_producer_hashing_scheme(ctx),
+        get_config_partition_key(ctx),
         get_producer_lazy_start_partitioned_producers(ctx),
         get_producer_block_if_queue_full(ctx),
         get_producer_batching_enabled(ctx),
+        get_producer_batching_type(ctx),
         get_producer_batching_max_messages(ctx),
         get_producer_batching_max_allowed_size_in_bytes(ctx),
         get_producer_batching_max_publish_delay_ms(ctx),
@@ -464,17 +1683,205 @@ flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struc
     return ctx;
 }
 
+/*
+ * Flush and close callbacks of one drain. Worker exits drain in parallel,
+ * each one waits for its own producer only. A callback may run after its
+ * drain gave up waiting, the last reference frees the drain.
+ */
+struct pulsar_drain {
+    atomic_int pending;   // callbacks not run yet
+    atomic_int refs;      // the drainer plus every callback not run yet
+};
+
+static struct pulsar_drain* pulsar_drain_create()
+{
+    struct pulsar_drain *drain = flb_malloc(sizeof(struct pulsar_drain));
+    if (!drain) {
+        flb_errno();
+        return NULL;
+    }
+    atomic_init(&drain->pending, 0);
+    atomic_init(&drain->refs, 1);
+    return drain;
+}
+
+static void pulsar_drain_unref(struct pulsar_drain *drain)
+{
+    if (1 == atomic_fetch_sub_explicit(&drain->refs, 1, memory_order_acq_rel)) {
+        flb_free(drain);
+    }
+}
+
+// completion of a flush or close started by the drain
+static void pulsar_drain_callback(pulsar_result result, void *data)
+{
+    struct pulsar_drain *drain = data;
+    atomic_fetch_sub_explicit(&drain->pending, 1, memory_order_release);
+    pulsar_drain_unref(drain);
+}
+
+static void pulsar_drain_flush(pulsar_producer_t *producer, void *data)
+{
+    struct pulsar_drain *drain = data;
+    atomic_fetch_add_explicit(&drain->refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&drain->pending, 1, memory_order_relaxed);
+    pulsar_producer_flush_async(producer, pulsar_drain_callback, drain);
+}
+
+static void pulsar_drain_close(pulsar_producer_t *producer, void *data)
+{
+    struct pulsar_drain *drain = data;
+    atomic_fetch_add_explicit(&drain->refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&drain->pending, 1, memory_order_relaxed);
+    pulsar_producer_close_async(producer, pulsar_drain_callback, drain);
+}
+
+// call fn on every producer of the context, except the per worker ones
+static void pulsar_foreach_producer(flb_out_pulsar_ctx *ctx, void (*fn)(pulsar_producer_t *, void *), void *data)
+{
+    int i;
+
+    if (ctx->producer) {
+        fn(ctx->producer, data);
+    }
+    if (ctx->stripes) {
+        for (i = 0; i < ctx->producer_stripes; i++) {
+            if (ctx->stripes[i]) {
+                fn(ctx->stripes[i], data);
+            }
+        }
+    }
+    if (ctx->clusters) {
+        for (i = 0; i < ctx->clusters->count; i++) {
+            if (ctx->clusters->clusters[i].owned && ctx->clusters->clusters[i].producer) {
+                fn(ctx->clusters->clusters[i].producer, data);
+            }
+        }
+    }
+    if (ctx->topic_map) {
+        pulsar_topic_map_foreach(ctx->topic_map, fn, data);
+    }
+    if (ctx->dead_letter_producer) {
+        fn(ctx->dead_letter_producer, data);
+    }
+}
+
+// wait for the callbacks of the drain, false if the deadline comes first
+static bool pulsar_drain_wait(struct pulsar_drain *drain, uint64_t deadline_ns)
+{
+    while (0 < atomic_load_explicit(&drain->pending, memory_order_acquire)) {
+        if (pulsar_metrics_now_ns() >= deadline_ns) {
+            return false;
+        }
+        usleep(PULSAR_DRAIN_POLL_MS * 1000);
+    }
+    return true;
+}
+
+// deadline of all the drains of the shutdown, drainTimeoutMs after the first one started
+static uint64_t pulsar_drain_deadline(flb_out_pulsar_ctx *ctx)
+{
+    uint_fast64_t expected = 0;
+    uint_fast64_t deadline_ns = pulsar_metrics_now_ns() + (uint64_t) ctx->drain_timeout_ms * 1000000;
+
+    if (!atomic_compare_exchange_strong(&ctx->drain_deadline_ns, &expected, deadline_ns)) {
+        return expected;
+    }
+    return deadline_ns;
+}
+
+/*
+ * Flush the producers, so the messages batched or pending in them get their
+ * ack, then close them, all before the deadline. Closing a producer fails
+ * the messages it still holds, which go to the spill if there is one, and
+ * makes the close of the destroy return without waiting for the broker.
+ */
+void flb_out_pulsar_drain(flb_out_pulsar_ctx* ctx)
+{
+    bool closed;
+    int64_t inflight;
+    int64_t left;
+    uint64_t start_ns = pulsar_metrics_now_ns();
+    uint64_t deadline_ns;
+    struct pulsar_drain *drain;
+
+    if (0 >= ctx->drain_timeout_ms) {
+        return;
+    }
+    // the worker exits may have used part of the time already
+    deadline_ns = pulsar_drain_deadline(ctx);
+
+    // the replay would keep the producers busy
+    pulsar_spill_stop(ctx->spill);
+
+    drain = pulsar_drain_create();
+    if (!drain) {
+        return;
+    }
+    inflight = atomic_load(&ctx->inflight);
+    pulsar_foreach_producer(ctx, pulsar_drain_flush, drain);
+    pulsar_drain_wait(drain, deadline_ns);
+    left = atomic_load(&ctx->inflight);
+
+    pulsar_foreach_producer(ctx, pulsar_drain_close, drain);
+    closed = pulsar_drain_wait(drain, deadline_ns);
+    pulsar_drain_unref(drain);
+
+    if (0 < left) {
+        flb_plg_warn(ctx->ins, "drain: %"PRId64" in-flight messages acked, %"PRId64" abandoned after %dms%s",
+                     inflight > left ? inflight - left : 0, left, ctx->drain_timeout_ms,
+                     ctx->spill ? ", they go to the spill" : "");
+    } else {
+        flb_plg_info(ctx->ins, "drain: %"PRId64" in-flight messages acked in %"PRIu64"ms",
+                     inflight, (pulsar_metrics_now_ns() - start_ns) / 1000000);
+    }
+    if (!closed) {
+        flb_plg_warn(ctx->ins, "drain: producers not closed within %dms", ctx->drain_timeout_ms);
+    }
+}
+
 // close plugin
 void flb_out_pulsar_destroy(flb_out_pulsar_ctx* ctx)
 {
+    int i;
+
     if (!ctx) {
         return;
     }
 
+    // the replay uses the producers, while closing them may still spill messages
+    pulsar_spill_stop(ctx->spill);
+
     if (ctx->producer) {
         pulsar_producer_close(ctx->producer);
         pulsar_producer_free(ctx->producer);
     }
+    if (ctx->stripes) {
+        for (i = 0; i < ctx->producer_stripes; i++) {
+            if (ctx->stripes[i]) {
+                pulsar_producer_close(ctx->stripes[i]);
+                pulsar_producer_free(ctx->stripes[i]);
+            }
+        }
+        flb_free(ctx->stripes);
+    }
+    if (ctx->clusters) {
+        pulsar_cluster_set_destroy(ctx->clusters);
+        flb_free(ctx->clusters);
+    }
+
+    if (ctx->topic_map) {
+        pulsar_topic_map_destroy(ctx->topic_map);
+    }
+
+    // closing the producers above may still publish to the dead-letter topic
+    if (ctx->dead_letter_producer) {
+        pulsar_producer_close(ctx->dead_letter_producer);
+        pulsar_producer_free(ctx->dead_letter_producer);
+    }
+    if (ctx->dead_letter_conf) {
+        pulsar_producer_configuration_free(ctx->dead_letter_conf);
+    }
 
     if (ctx->producer_conf) {
         pulsar_producer_configuration_free(ctx->producer_conf);
@@ -493,15 +1900,103 @@ void flb_out_pulsar_destroy(flb_out_pulsar_ctx* ctx)
         pulsar_client_configuration_free(ctx->client_conf);
     }
 
-    if (ctx->pulsar_broker_url) {
-        flb_free(ctx->pulsar_broker_url);
+    // all callbacks have run once the client is closed
+    pulsar_spill_destroy(ctx->spill);
+
+    if (ctx->callback_pool) {
+        flb_plg_info(ctx->ins, "callback pool stats, size: %u, hits: %"PRIu64", misses: %"PRIu64,
+            ctx->callback_pool->size,
+            (uint64_t) atomic_load(&ctx->callback_pool->hits),
+            (uint64_t) atomic_load(&ctx->callback_pool->misses));
+        pulsar_callback_pool_destroy(ctx->callback_pool);
     }
-    if (ctx->pulsar_auth_token) {
-        flb_free(ctx->pulsar_auth_token);
+    flb_plg_debug(ctx->ins, "flush arena stats, hits: %"PRIu64", misses: %"PRIu64,
+        (uint64_t) atomic_load(&ctx->arenas.hits), (uint64_t) atomic_load(&ctx->arenas.misses));
+    pulsar_arena_pool_destroy(&ctx->arenas);
+
+    // url, token and topic belong to the config map
+    if (ctx->partition_key_ra) {
+        flb_ra_destroy(ctx->partition_key_ra);
     }
-    if (ctx->pulsar_producer_topic) {
-        flb_free(ctx->pulsar_producer_topic);
+    if (ctx->topic_ra) {
+        flb_ra_destroy(ctx->topic_ra);
     }
+    pulsar_projection_destroy(ctx->projection);
+    pulsar_avro_schema_destroy(ctx->avro);
+    // waits for a training still running
+    pulsar_zstd_destroy(ctx->zstd);
+    pulsar_msg_properties_destroy(ctx);
 
+    pulsar_failure_log_destroy(&ctx->failure_log);
+    pulsar_metrics_destroy(&ctx->metrics);
+    pthread_mutex_destroy(&ctx->producer_lock);
+    pthread_cond_destroy(&ctx->budget_cond);
+    pthread_mutex_destroy(&ctx->budget_lock);
+    pulsar_adaptive_destroy(&ctx->adaptive);
     flb_free(ctx);
 }
+
+// called in every flush worker thread when it starts
+int flb_out_pulsar_worker_init(flb_out_pulsar_ctx* ctx)
+{
+    pulsar_result err;
+    char suffix[32];
+    struct pulsar_worker *worker;
+
+    // the shared producer is thread-safe, a dedicated one only removes contention on its queue
+    if (!ctx->producer_per_worker) {
+        return 0;
+    }
+
+    worker = flb_calloc(1, sizeof(struct pulsar_worker));
+    if (!worker) {
+        flb_errno();
+        return -1;
+    }
+    worker->ctx = ctx;
+    worker->id = atomic_fetch_add(&ctx->worker_seq, 1);
+
+    // producer names must be unique per topic, so the configured one is suffixed with the worker id
+    snprintf(suffix, sizeof(suffix), "%u", worker->id);
+    pthread_mutex_lock(&ctx->producer_lock);
+    err = pulsar_create_suffixed_producer(ctx, suffix, &worker->producer);
+    pthread_mutex_unlock(&ctx->producer_lock);
+
+    if (err != pulsar_result_Ok) {
+        flb_plg_error(ctx->ins, "Failed to create pulsar producer for worker #%u: %s", worker->id, pulsar_result_str(err));
+        flb_free(worker);
+        return -1;
+    }
+
+    FLB_TLS_SET(pulsar_worker_tls, worker);
+    flb_plg_info(ctx->ins, "worker #%u uses its own pulsar producer", worker->id);
+    return 0;
+}
+
+// called in every flush worker thread before it exits
+void flb_out_pulsar_worker_exit(flb_out_pulsar_ctx* ctx)
+{
+    uint64_t deadline_ns;
+    struct pulsar_drain *drain;
+    struct pulsar_worker *worker = FLB_TLS_GET(pulsar_worker_tls);
+    if (!worker || worker->ctx != ctx) {
+        return;
+    }
+
+    if (worker->producer) {
+        // the same drain as on exit, for the messages of this producer
+        if (0 < ctx->drain_timeout_ms && (drain = pulsar_drain_create())) {
+            deadline_ns = pulsar_drain_deadline(ctx);
+            pulsar_drain_flush(worker->producer, drain);
+            pulsar_drain_wait(drain, deadline_ns);
+            pulsar_drain_close(worker->producer, drain);
+            pulsar_drain_wait(drain, deadline_ns);
+            pulsar_drain_unref(drain);
+        }
+        pulsar_producer_close(worker->producer);
+        pulsar_producer_free(worker->producer);
+    }
+
+    FLB_TLS_SET(pulsar_worker_tls, NULL);
+    flb_free(worker);
+}
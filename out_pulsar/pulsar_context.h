@@ -1,17 +1,81 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pulsar_adaptive.h"
+#include "pulsar_arena.h"
+#include "pulsar_avro.h"
+#include "pulsar_cluster.h"
+#include "pulsar_failure_log.h"
+#include "pulsar_gelf.h"
+#include "pulsar_metrics.h"
+#include "pulsar_pool.h"
+#include "pulsar_projection.h"
+#include "pulsar_spill.h"
+#include "pulsar_topic.h"
+#include "pulsar_zstd.h"
+
 #define DEFAULT_SHOW_INTERVAL  200
+#define DEFAULT_WORKERS        1
+#define DEFAULT_DRAIN_TIMEOUT_MS  "5000"
+#define DEFAULT_INFLIGHT_MAX_BYTES  "0"
 
 #define FLB_PULSAR_SCHEMA_JSON 0
 #define FLB_PULSAR_SCHEMA_MSGP 1
 #define FLB_PULSAR_SCHEMA_GELF 2
+#define FLB_PULSAR_SCHEMA_AVRO 3
 
 // define pulsar output plugin configuration keys
 #define OUTPUT_KEY_SHOW_INTERNAL  "showInterval"
 #define OUTPUT_KEY_DATA_SCHEMA  "dataSchema"
+#define OUTPUT_KEY_AVRO_SCHEMA_FILE  "avroSchemaFile"
+#define OUTPUT_KEY_PRODUCER_PER_WORKER  "producerPerWorker"
+#define OUTPUT_KEY_PRODUCER_STRIPES  "producerStripes"
+#define OUTPUT_KEY_STRIPE_KEY_AFFINITY  "producerStripeKeyAffinity"
+#define OUTPUT_KEY_GELF_SHORT_MESSAGE_KEY  "gelfShortMessageKey"
+#define OUTPUT_KEY_GELF_FULL_MESSAGE_KEY  "gelfFullMessageKey"
+#define OUTPUT_KEY_GELF_HOST_KEY  "gelfHostKey"
+#define OUTPUT_KEY_GELF_LEVEL_KEY  "gelfLevelKey"
+#define OUTPUT_KEY_CHUNK_PACKING  "chunkPacking"
+#define OUTPUT_KEY_CHUNK_PACKING_MAX_RECORDS  "chunkPackingMaxRecords"
+#define OUTPUT_KEY_CHUNK_PACKING_MAX_BYTES  "chunkPackingMaxBytes"
+#define OUTPUT_KEY_ADAPTIVE_BATCHING  "adaptiveBatching"
+#define OUTPUT_KEY_ADAPTIVE_BATCHING_MIN_RECORDS  "adaptiveBatchingMinRecords"
+#define OUTPUT_KEY_ADAPTIVE_BATCHING_DELAY  "adaptiveBatchingDelayMs"
+#define OUTPUT_KEY_ADAPTIVE_BATCHING_LATENCY  "adaptiveBatchingLatencyMs"
+#define OUTPUT_KEY_MAX_TOPIC_PRODUCERS  "maxTopicProducers"
+#define OUTPUT_KEY_TOPIC_IDLE_TIMEOUT  "topicProducerIdleTimeout"
+#define OUTPUT_KEY_SYNC_SEND_WINDOW  "syncSendWindow"
+#define OUTPUT_KEY_SPILL_PATH  "spillPath"
+#define OUTPUT_KEY_SPILL_SEGMENT_BYTES  "spillSegmentBytes"
+#define OUTPUT_KEY_SPILL_MAX_BYTES  "spillMaxBytes"
+#define OUTPUT_KEY_SPILL_REPLAY_RATE  "spillReplayRate"
+#define OUTPUT_KEY_INCLUDE_KEYS  "includeKeys"
+#define OUTPUT_KEY_EXCLUDE_KEYS  "excludeKeys"
+#define OUTPUT_KEY_RENAME_KEYS  "renameKeys"
+#define OUTPUT_KEY_MESSAGE_PROPERTIES  "messageProperties"
+#define OUTPUT_KEY_METADATA_PROPERTIES  "metadataProperties"
+#define OUTPUT_KEY_FAILURE_LOG_RATE  "failureLogRate"
+#define OUTPUT_KEY_FAILURE_LOG_PAYLOAD_BYTES  "failureLogPayloadBytes"
+#define OUTPUT_KEY_DEAD_LETTER_TOPIC  "deadLetterTopic"
+#define OUTPUT_KEY_DEAD_LETTER_MAX_BYTES  "deadLetterMaxBytes"
+#define OUTPUT_KEY_FAILOVER_ERROR_RATE  "failoverErrorRate"
+#define OUTPUT_KEY_FAILOVER_LATENCY  "failoverLatencyMs"
+#define OUTPUT_KEY_FAILOVER_RECOVERY  "failoverRecoverySeconds"
+#define OUTPUT_KEY_DRAIN_TIMEOUT  "drainTimeoutMs"
+#define OUTPUT_KEY_INFLIGHT_MAX_BYTES  "inflightMaxBytes"
+#define OUTPUT_KEY_ZSTD_COMPRESSION  "zstdCompression"
+#define OUTPUT_KEY_ZSTD_LEVEL  "zstdLevel"
+#define OUTPUT_KEY_ZSTD_DICTIONARY  "zstdDictionary"
+#define OUTPUT_KEY_ZSTD_TRAIN_RECORDS  "zstdDictionaryTrainRecords"
+#define OUTPUT_KEY_ZSTD_DICTIONARY_SIZE  "zstdDictionarySize"
 #define PULSAR_KEY_MEMORY_LIMIT  "memoryLimitBytes"
 #define PULSAR_KEY_BROKER_URL  "pulsarBrokerUrl"
 #define PULSAR_KEY_AUTH_TOKEN  "pulsarAuthToken"
+#define PULSAR_KEY_CLUSTER  "pulsarCluster"
+#define PULSAR_KEY_IO_THREADS  "ioThreads"
+#define PULSAR_KEY_MESSAGE_LISTENER_THREADS  "messageListenerThreads"
 #define PULSAR_KEY_ASYNC_SEND  "isAsyncSend"
 #define PULSAR_KEY_PRODUCER_NAME  "producerName"
 #define PULSAR_KEY_TOPIC_NAME  "topicName"
@@ -28,6 +92,49 @@
 #define PULSAR_KEY_MESSAGE_ROUTING_MODE  "messageRoutingMode"
 #define PULSAR_KEY_MAX_PENDING_MASSAGES  "maxPendingMessages"
 #define PULSAR_KEY_MAX_PENDING_MASSAGES_PARTITIONS  "maxPendingMessagesAcrossPartitions"
+#define PULSAR_KEY_PARTITION_KEY  "partitionKey"
+#define PULSAR_KEY_BATCHING_TYPE  "batchingType"
+
+#define PULSAR_MAX_KEY_LEN  512
+#define PULSAR_MAX_PROPERTIES_LEN  1024
+
+// message property holding the number of records packed in a message
+#define PULSAR_PROPERTY_RECORD_COUNT  "record_count"
+// properties of a dead-letter message: the rejecting result, the topic, the payload size if cut
+#define PULSAR_PROPERTY_DEAD_LETTER_RESULT  "dead_letter_result"
+#define PULSAR_PROPERTY_DEAD_LETTER_TOPIC  "dead_letter_topic"
+#define PULSAR_PROPERTY_DEAD_LETTER_SIZE  "dead_letter_size"
+// properties of a payload compressed by zstdCompression: "zstd", and the dictionary id or "0"
+#define PULSAR_PROPERTY_COMPRESSION  "compression"
+#define PULSAR_PROPERTY_ZSTD_DICT_ID  "zstd_dict_id"
+
+// completion state of the messages sent by one flush
+struct pulsar_flush_ctx {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t refs;      // the flush itself plus every pending callback
+    uint32_t pending;   // async sends not acked yet
+    uint32_t failed;    // sends that did not reach the broker
+    bool stalled;       // no ack freed the send window or the in-flight budget in time, the next sends fail at once
+};
+
+// per message attributes taken from the record
+struct pulsar_msg_attrs {
+    const char *partition_key;
+    const char *topic;        // NULL for the static topic
+    size_t topic_len;
+    uint32_t record_count;    // records packed in the message, 0 for a single record
+    const char *properties;   // name\0value\0 pairs of messageProperties, or NULL
+    size_t properties_len;
+    uint64_t event_time;      // record time in ms since the epoch, 0 if unknown
+};
+
+// message property copied from a record field, or from the tag when ra is NULL
+struct pulsar_msg_property {
+    flb_sds_t name;
+    struct flb_record_accessor *ra;
+    struct mk_list _head;
+};
 
 // plugin context
 typedef struct _flb_out_pulsar_context
@@ -35,29 +142,171 @@ typedef struct _flb_out_pulsar_context
     char* pulsar_broker_url;
     char* pulsar_auth_token;
     char* pulsar_producer_topic;
+    char* partition_key;
 
     bool is_async;
+    int sync_send_window;
+    bool producer_per_worker;
+    int io_threads;
+    int message_listener_threads;
+
+    // producers on the same topic, records are spread across them
+    int producer_stripes;
+    bool stripe_key_affinity;
+    pulsar_producer_t **stripes;
+    atomic_uint stripe_seq;
+
     uint32_t show_interval;
     uint32_t data_schema;
-    uint64_t total_number;
-    uint64_t failed_number;
-    uint64_t success_number;
-    uint64_t discarded_number;
+    struct pulsar_gelf_conf gelf;
+    flb_sds_t avro_schema_file;
+    struct pulsar_avro_schema *avro;
+
+    // keys kept, dropped and renamed by the encoders
+    struct mk_list *include_keys;
+    struct mk_list *exclude_keys;
+    struct mk_list *rename_keys;
+    struct pulsar_projection *projection;
+
+    // record fields copied into message properties
+    struct mk_list *message_properties;
+    struct mk_list properties;
+    bool metadata_properties;
+
+    bool chunk_packing;
+    int chunk_packing_max_records;
+    int chunk_packing_max_bytes;
+
+    // chunkPacking limits tuned from the record rate and ack latency
+    bool adaptive_batching;
+    int adaptive_min_records;
+    int adaptive_delay_ms;
+    int adaptive_latency_ms;
+    struct pulsar_adaptive adaptive;
+
+    struct flb_record_accessor *partition_key_ra;
+
+    // templated topic: producers are created per resolved topic name
+    int max_topic_producers;
+    int topic_idle_timeout;
+    struct flb_record_accessor *topic_ra;
+    struct pulsar_topic_map *topic_map;
+
+    // messages the broker did not take are kept on disk and replayed
+    flb_sds_t spill_path;
+    size_t spill_segment_bytes;
+    size_t spill_max_bytes;
+    int spill_replay_rate;
+    struct pulsar_spill *spill;
+
+    // rejected messages are published once to the dead-letter topic
+    flb_sds_t dead_letter_topic;
+    size_t dead_letter_max_bytes;
+    pulsar_producer_configuration_t *dead_letter_conf;
+    pulsar_producer_t *dead_letter_producer;
+
+    // more clusters next to pulsarBrokerUrl, traffic moves away from the unhealthy ones
+    struct mk_list *cluster_entries;
+    double failover_error_rate;
+    int failover_latency_ms;
+    int failover_recovery_s;
+    struct pulsar_cluster_set *clusters;
+
+    // payloads compressed by the plugin, with a dictionary shared with the consumers
+    bool zstd_compression;
+    int zstd_level;
+    flb_sds_t zstd_dictionary;
+    int zstd_train_records;
+    size_t zstd_dictionary_size;
+    struct pulsar_zstd *zstd;
+
+    // on exit the producers are flushed and closed within drain_timeout_ms
+    int drain_timeout_ms;
+    atomic_uint_fast64_t drain_deadline_ns;   // set by the first drain, shared by the worker exits and the exit
+
+    // payload bytes of the async sends, held until their callback; above
+    // inflight_max_bytes the sends wait for callbacks to free some
+    size_t inflight_max_bytes;
+    atomic_int_fast64_t inflight_bytes;
+    atomic_int budget_waiters;
+    atomic_bool budget_paused;
+    pthread_mutex_t budget_lock;
+    pthread_cond_t budget_cond;
+
+    // send failures are logged at a limited rate
+    int failure_log_rate;
+    size_t failure_log_payload_bytes;
+    struct pulsar_failure_log failure_log;
+
+    // updated from flush workers and pulsar callback threads
+    atomic_uint_fast64_t total_number;
+    atomic_uint_fast64_t failed_number;
+    atomic_uint_fast64_t success_number;
+    atomic_uint_fast64_t discarded_number;
+    atomic_int_fast64_t inflight;   // async sends waiting for their callback
+    atomic_uint worker_seq;
+    struct pulsar_metrics metrics;
 
     pulsar_client_t *client;
     pulsar_producer_t *producer;
     pulsar_authentication_t *authentication;
     pulsar_client_configuration_t *client_conf;
     pulsar_producer_configuration_t *producer_conf;
+    struct pulsar_callback_pool *callback_pool;
+    struct pulsar_arena_pool arenas;
+
+    // serializes producer creation from worker threads
+    pthread_mutex_t producer_lock;
 
     struct flb_output_instance *ins;
-    bool (*send_msg_func)(struct _flb_out_pulsar_context*, const char*, size_t);
+    bool (*send_msg_func)(struct _flb_out_pulsar_context*, struct pulsar_flush_ctx*, struct pulsar_msg_attrs*, const char*, size_t);
 } flb_out_pulsar_ctx;
 
+// per worker state, when producerPerWorker is enabled
+struct pulsar_worker {
+    flb_out_pulsar_ctx *ctx;
+    uint32_t id;
+    pulsar_producer_t *producer;
+};
+
 struct pulsar_callback_ctx {
     flb_out_pulsar_ctx *ctx;
     pulsar_message_t *msg;
+    struct pulsar_flush_ctx *flush;
+    struct pulsar_topic_producer *topic_producer;
+    struct pulsar_cluster *cluster;  // told the outcome of the send, NULL without pulsarCluster
+    uint32_t record_count;  // records packed in the message, 0 for a single record
+    uint64_t send_ns;       // monotonic time of the send, for the ack latency
+    uint64_t event_time;
+    size_t properties_len;  // properties are kept behind the payload, to spill them
+    size_t inflight_bytes;  // taken from the in-flight budget until the callback
+    bool dead_letter;       // sent to the dead-letter topic after `code` rejected it
+    pulsar_result code;
+
+    // message payload, owned by the context until the send callback
+    char *payload;
+    size_t payload_capacity;
+
+    // pool bookkeeping, pool_index is PULSAR_POOL_NIL for heap entries
+    uint32_t pool_index;
+    atomic_uint pool_next;
 };
 
+#define PULSAR_COUNTER_INC(c)     atomic_fetch_add_explicit(&(c), 1, memory_order_relaxed)
+#define PULSAR_COUNTER_GET(c)     atomic_load_explicit(&(c), memory_order_relaxed)
+
+// number of records carried by a message, from its attributes or callback context
+#define PULSAR_MSG_RECORDS(attrs)  (0 < (attrs)->record_count ? (attrs)->record_count : 1)
+
 flb_out_pulsar_ctx* flb_out_pulsar_create(struct flb_output_instance *ins, struct flb_config* config);
 void flb_out_pulsar_destroy(flb_out_pulsar_ctx* ctx);
+// flush the messages held by the producers and close them, waiting at most drainTimeoutMs
+void flb_out_pulsar_drain(flb_out_pulsar_ctx* ctx);
+struct pulsar_flush_ctx* flb_pulsar_flush_create();
+int flb_pulsar_flush_wait(flb_out_pulsar_ctx* ctx, struct pulsar_flush_ctx* flush);
+void flb_pulsar_flush_release(struct pulsar_flush_ctx* flush);
+int flb_pulsar_flush_chunk(flb_out_pulsar_ctx* ctx, const char* tag, int tag_len, const char* data, size_t size);
+
+int flb_out_pulsar_worker_init(flb_out_pulsar_ctx* ctx);
+void flb_out_pulsar_worker_exit(flb_out_pulsar_ctx* ctx);
+pulsar_producer_t* flb_out_pulsar_producer(flb_out_pulsar_ctx* ctx, const struct pulsar_msg_attrs* attrs);
@@ -0,0 +1,107 @@
+#include <fluent-bit/flb_output_plugin.h>
+
+#include "pulsar_failure_log.h"
+#include "pulsar_metrics.h"
+
+#define FAILURE_LOG_REPORT_NS  1000000000ULL
+
+void pulsar_failure_log_init(struct pulsar_failure_log *log, struct flb_output_instance *ins,
+                             int rate, size_t payload_bytes)
+{
+    memset(log, 0, sizeof(struct pulsar_failure_log));
+    pthread_mutex_init(&log->lock, NULL);
+    log->ins = ins;
+    log->rate = 0 < rate ? rate : 0;
+    log->payload_bytes = payload_bytes;
+    log->tokens = log->rate;
+    log->refill_ns = pulsar_metrics_now_ns();
+    log->report_ns = log->refill_ns;
+}
+
+static int result_slot(pulsar_result code)
+{
+    return 0 <= (int) code && (int) code < PULSAR_FAILURE_LOG_RESULTS - 1
+           ? (int) code : PULSAR_FAILURE_LOG_RESULTS - 1;
+}
+
+// caller holds the lock, the summary is logged after it is released
+static size_t failure_log_summary(struct pulsar_failure_log *log, uint64_t now_ns, char *buf, size_t size)
+{
+    int i;
+    int n;
+    size_t len;
+    double seconds = (double) (now_ns - log->report_ns) / 1e9;
+
+    n = snprintf(buf, size, "suppressed %"PRIu64" failure logs in %.1fs:", log->suppressed_total, seconds);
+    len = 0 < n && (size_t) n < size ? (size_t) n : 0;
+    for (i = 0; i < PULSAR_FAILURE_LOG_RESULTS; i++) {
+        if (0 == log->suppressed[i]) {
+            continue;
+        }
+        if (len < size) {
+            n = snprintf(buf + len, size - len, " %s %"PRIu64, i < PULSAR_FAILURE_LOG_RESULTS - 1
+                         ? pulsar_result_str((pulsar_result) i) : "Other", log->suppressed[i]);
+            len = 0 < n && len + n < size ? len + n : size;
+        }
+        log->suppressed[i] = 0;
+    }
+    log->suppressed_total = 0;
+    log->report_ns = now_ns;
+    return len;
+}
+
+void pulsar_failure_log_destroy(struct pulsar_failure_log *log)
+{
+    char summary[1024];
+
+    if (!log->ins) {
+        return;
+    }
+    if (0 < log->suppressed_total) {
+        failure_log_summary(log, pulsar_metrics_now_ns(), summary, sizeof(summary));
+        flb_plg_warn(log->ins, "%s", summary);
+    }
+    pthread_mutex_destroy(&log->lock);
+}
+
+void pulsar_failure_log_write(struct pulsar_failure_log *log, const char *what, pulsar_result code,
+                              const char *data, size_t len)
+{
+    bool allowed = false;
+    size_t summary_len = 0;
+    char summary[1024];
+    uint64_t now_ns = pulsar_metrics_now_ns();
+
+    pthread_mutex_lock(&log->lock);
+    log->tokens += (double) (now_ns - log->refill_ns) / 1e9 * log->rate;
+    if (log->tokens > log->rate) {
+        log->tokens = log->rate;
+    }
+    log->refill_ns = now_ns;
+    if (1 <= log->tokens) {
+        log->tokens -= 1;
+        allowed = true;
+    } else {
+        log->suppressed[result_slot(code)]++;
+        log->suppressed_total++;
+    }
+    if (0 < log->suppressed_total && now_ns - log->report_ns >= FAILURE_LOG_REPORT_NS) {
+        summary_len = failure_log_summary(log, now_ns, summary, sizeof(summary));
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    if (0 < summary_len) {
+        flb_plg_warn(log->ins, "%.*s", (int) summary_len, summary);
+    }
+    if (!allowed) {
+        return;
+    }
+    if (!data || 0 == log->payload_bytes) {
+        flb_plg_info(log->ins, "%s: %s", what, pulsar_result_str(code));
+    } else if (len <= log->payload_bytes) {
+        flb_plg_info(log->ins, "%s: %s, msg: %.*s", what, pulsar_result_str(code), (int) len, data);
+    } else {
+        flb_plg_info(log->ins, "%s: %s, msg (%zu bytes): %.*s...", what, pulsar_result_str(code),
+                     len, (int) log->payload_bytes, data);
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <pulsar/c/client.h>
+
+#define PULSAR_FAILURE_LOG_DEFAULT_RATE           "10"
+#define PULSAR_FAILURE_LOG_DEFAULT_PAYLOAD_BYTES  "256"
+// results are aggregated by value, the last slot holds any larger one
+#define PULSAR_FAILURE_LOG_RESULTS                64
+
+struct flb_output_instance;
+
+/*
+ * Failure log lines limited by a token bucket of `rate` lines per second,
+ * with the payload cut to `payload_bytes`. Lines over the limit are counted
+ * by pulsar_result and summarized at most once per second, by the next
+ * failure after the second or when the log is destroyed.
+ */
+struct pulsar_failure_log {
+    struct flb_output_instance *ins;
+    int rate;
+    size_t payload_bytes;
+
+    pthread_mutex_t lock;
+    double tokens;
+    uint64_t refill_ns;
+    uint64_t report_ns;
+    uint64_t suppressed_total;
+    uint64_t suppressed[PULSAR_FAILURE_LOG_RESULTS];
+};
+
+void pulsar_failure_log_init(struct pulsar_failure_log *log, struct flb_output_instance *ins,
+                             int rate, size_t payload_bytes);
+// reports what is still suppressed
+void pulsar_failure_log_destroy(struct pulsar_failure_log *log);
+
+// log `what` failed with `code`, with the payload of the message if any
+void pulsar_failure_log_write(struct pulsar_failure_log *log, const char *what, pulsar_result code,
+                              const char *data, size_t len);
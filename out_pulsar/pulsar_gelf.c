@@ -0,0 +1,300 @@
+#include <unistd.h>
+
+#include <fluent-bit/flb_output_plugin.h>
+
+#include "pulsar_gelf.h"
+#include "pulsar_json.h"
+#include "pulsar_projection.h"
+
+// level names accepted by prefix, mapped to syslog severities
+static const struct {
+    const char *name;
+    int level;
+} gelf_level_names[] = {
+    { "emerg", 0 }, { "alert", 1 }, { "crit", 2 }, { "fatal", 2 }, { "err", 3 },
+    { "warn", 4 }, { "notice", 5 }, { "info", 6 }, { "debug", 7 }, { "trace", 7 },
+};
+
+void pulsar_gelf_conf_init(struct pulsar_gelf_conf *conf)
+{
+    if (0 != gethostname(conf->hostname, sizeof(conf->hostname) - 1)) {
+        strcpy(conf->hostname, "unknown");
+    }
+    conf->hostname[sizeof(conf->hostname) - 1] = '\0';
+}
+
+static inline int key_equals(const msgpack_object *key, const char *name)
+{
+    return name && MSGPACK_OBJECT_STR == key->type
+        && key->via.str.size == strlen(name)
+        && 0 == memcmp(key->via.str.ptr, name, key->via.str.size);
+}
+
+// syslog severity of a level field: numbers are taken as is, names by prefix
+static int gelf_level(const msgpack_object *o)
+{
+    size_t i;
+    size_t len;
+
+    if (MSGPACK_OBJECT_POSITIVE_INTEGER == o->type) {
+        return o->via.u64 > 7 ? 7 : (int) o->via.u64;
+    }
+    if (MSGPACK_OBJECT_STR != o->type || 0 == o->via.str.size) {
+        return -1;
+    }
+    if (1 == o->via.str.size && '0' <= o->via.str.ptr[0] && o->via.str.ptr[0] <= '7') {
+        return o->via.str.ptr[0] - '0';
+    }
+    for (i = 0; i < sizeof(gelf_level_names) / sizeof(gelf_level_names[0]); i++) {
+        len = strlen(gelf_level_names[i].name);
+        if (o->via.str.size >= len && 0 == strncasecmp(o->via.str.ptr, gelf_level_names[i].name, len)) {
+            return gelf_level_names[i].level;
+        }
+    }
+    return -1;
+}
+
+static int write_string_field(struct pulsar_buffer *buf, const char *name, const msgpack_object *o)
+{
+    if (0 != pulsar_buffer_append(buf, name, strlen(name))) {
+        return -1;
+    }
+    if (MSGPACK_OBJECT_STR == o->type) {
+        if (0 != pulsar_buffer_putc(buf, '"')
+            || 0 != pulsar_json_write_str(buf, o->via.str.ptr, o->via.str.size)) {
+            return -1;
+        }
+        return pulsar_buffer_putc(buf, '"');
+    }
+    if (MSGPACK_OBJECT_BIN == o->type) {
+        if (0 != pulsar_buffer_putc(buf, '"')
+            || 0 != pulsar_json_write_str(buf, o->via.bin.ptr, o->via.bin.size)) {
+            return -1;
+        }
+        return pulsar_buffer_putc(buf, '"');
+    }
+
+    // GELF wants strings here: quote the JSON form of anything else. It is
+    // rendered at the end of the buffer, escaped behind it and moved back.
+    size_t start = buf->size;
+    if (0 != pulsar_json_write_object(buf, o)) {
+        return -1;
+    }
+    size_t len = buf->size - start;
+    if (0 != pulsar_buffer_reserve(buf, len * 6 + 2)) {
+        return -1;
+    }
+    size_t escaped = buf->size;
+    if (0 != pulsar_buffer_putc(buf, '"')
+        || 0 != pulsar_json_write_str(buf, buf->data + start, len)
+        || 0 != pulsar_buffer_putc(buf, '"')) {
+        return -1;
+    }
+    memmove(buf->data + start, buf->data + escaped, buf->size - escaped);
+    buf->size = start + (buf->size - escaped);
+    return 0;
+}
+
+// additional field names must match ^[\w\.\-]*$, other bytes become '_'
+static size_t append_key(char *prefix, size_t prefix_len, const msgpack_object *key,
+                         const struct pulsar_projection_node *node)
+{
+    size_t i;
+    size_t len;
+    const char *ptr;
+    char c;
+
+    if (node && node->rename) {
+        ptr = node->rename;
+        len = flb_sds_len(node->rename);
+    } else if (MSGPACK_OBJECT_STR == key->type) {
+        ptr = key->via.str.ptr;
+        len = key->via.str.size;
+    } else if (MSGPACK_OBJECT_BIN == key->type) {
+        ptr = key->via.bin.ptr;
+        len = key->via.bin.size;
+    } else {
+        return prefix_len;
+    }
+
+    // no room left for '_' below a key that already filled the prefix, drop the field
+    if (prefix_len + 2 > PULSAR_GELF_MAX_KEY_LEN) {
+        return prefix_len;
+    }
+    if (prefix_len + 1 + len >= PULSAR_GELF_MAX_KEY_LEN) {
+        len = PULSAR_GELF_MAX_KEY_LEN - prefix_len - 2;
+    }
+    prefix[prefix_len++] = '_';
+    for (i = 0; i < len; i++) {
+        c = ptr[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '_' || c == '.' || c == '-') {
+            prefix[prefix_len++] = c;
+        } else {
+            prefix[prefix_len++] = '_';
+        }
+    }
+    return prefix_len;
+}
+
+// node is the projection of a map, NULL once every key below is kept
+static int write_additional(struct pulsar_buffer *buf, char *prefix, size_t prefix_len, const msgpack_object *o,
+                            const struct pulsar_projection_node *node, bool inside)
+{
+    uint32_t i;
+    size_t len;
+    bool child_inside = true;
+    const msgpack_object_kv *kv;
+    const struct pulsar_projection_node *child = NULL;
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_NIL:
+        return 0;
+    case MSGPACK_OBJECT_MAP:
+        for (i = 0; i < o->via.map.size; i++) {
+            kv = &o->via.map.ptr[i];
+            if (node && !pulsar_projection_lookup(node, inside, &kv->key, &kv->val, &child, &child_inside)) {
+                continue;
+            }
+            len = append_key(prefix, prefix_len, &kv->key, child);
+            if (len == prefix_len) {
+                continue;
+            }
+            if (0 != write_additional(buf, prefix, len, &kv->val,
+                                      pulsar_projection_descend(child, &kv->val) ? child : NULL,
+                                      child_inside)) {
+                return -1;
+            }
+        }
+        return 0;
+    default:
+        break;
+    }
+
+    // "_id" is reserved by graylog
+    if (3 == prefix_len && 0 == memcmp(prefix, "_id", 3)) {
+        return 0;
+    }
+
+    if (0 != pulsar_buffer_append(buf, ",\"", 2)
+        || 0 != pulsar_buffer_append(buf, prefix, prefix_len)
+        || 0 != pulsar_buffer_append(buf, "\":", 2)) {
+        return -1;
+    }
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        return pulsar_json_write_object(buf, o);
+    default:
+        return write_string_field(buf, "", o);
+    }
+}
+
+int pulsar_gelf_write(struct pulsar_buffer *buf, struct pulsar_gelf_conf *conf,
+                      msgpack_object *map, struct flb_time *tm)
+{
+    uint32_t i;
+    int level = -1;
+    int len;
+    size_t prefix_len;
+    char tmp[64];
+    char prefix[PULSAR_GELF_MAX_KEY_LEN];
+    bool child_inside = true;
+    msgpack_object *key;
+    msgpack_object *val;
+    const struct pulsar_projection_node *child = NULL;
+    msgpack_object *short_message = NULL;
+    msgpack_object *full_message = NULL;
+    msgpack_object *host = NULL;
+    msgpack_object *level_val = NULL;
+
+    if (MSGPACK_OBJECT_MAP != map->type) {
+        return -1;
+    }
+
+    // pick the well known fields first
+    for (i = 0; i < map->via.map.size; i++) {
+        key = &map->via.map.ptr[i].key;
+        val = &map->via.map.ptr[i].val;
+        if (!short_message && key_equals(key, conf->short_message_key)) {
+            short_message = val;
+        } else if (!full_message && key_equals(key, conf->full_message_key)) {
+            full_message = val;
+        } else if (!host && key_equals(key, conf->host_key)) {
+            host = val;
+        } else if (!level_val && key_equals(key, conf->level_key)) {
+            level_val = val;
+        }
+    }
+
+    if (!short_message) {
+        flb_debug("[out_pulsar] record has no GELF short message key '%s'", conf->short_message_key);
+        return -1;
+    }
+
+    if (0 != pulsar_buffer_append(buf, "{\"version\":\"1.1\",", 17)) {
+        return -1;
+    }
+
+    if (host && MSGPACK_OBJECT_STR == host->type && 0 < host->via.str.size) {
+        if (0 != write_string_field(buf, "\"host\":", host)) {
+            return -1;
+        }
+    } else {
+        if (0 != pulsar_buffer_append(buf, "\"host\":\"", 8)
+            || 0 != pulsar_json_write_str(buf, conf->hostname, strlen(conf->hostname))
+            || 0 != pulsar_buffer_putc(buf, '"')) {
+            return -1;
+        }
+    }
+
+    if (0 != write_string_field(buf, ",\"short_message\":", short_message)) {
+        return -1;
+    }
+    if (full_message && 0 != write_string_field(buf, ",\"full_message\":", full_message)) {
+        return -1;
+    }
+
+    len = snprintf(tmp, sizeof(tmp), ",\"timestamp\":%lld.%03ld",
+                   (long long) tm->tm.tv_sec, (long) (tm->tm.tv_nsec / 1000000));
+    if (0 != pulsar_buffer_append(buf, tmp, len)) {
+        return -1;
+    }
+
+    if (level_val) {
+        level = gelf_level(level_val);
+    }
+    if (0 <= level) {
+        len = snprintf(tmp, sizeof(tmp), ",\"level\":%d", level);
+        if (0 != pulsar_buffer_append(buf, tmp, len)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < map->via.map.size; i++) {
+        key = &map->via.map.ptr[i].key;
+        val = &map->via.map.ptr[i].val;
+        if (val == short_message || val == full_message || val == host
+            || (val == level_val && 0 <= level)) {
+            continue;
+        }
+        if (conf->projection
+            && !pulsar_projection_lookup(&conf->projection->root, pulsar_projection_root_inside(conf->projection),
+                                         key, val, &child, &child_inside)) {
+            continue;
+        }
+        prefix_len = append_key(prefix, 0, key, child);
+        if (0 == prefix_len) {
+            continue;
+        }
+        if (0 != write_additional(buf, prefix, prefix_len, val,
+                                  pulsar_projection_descend(child, val) ? child : NULL, child_inside)) {
+            return -1;
+        }
+    }
+
+    return pulsar_buffer_putc(buf, '}');
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <msgpack.h>
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_time.h>
+
+#include "pulsar_buffer.h"
+
+struct pulsar_projection;
+
+#define PULSAR_GELF_DEFAULT_SHORT_MESSAGE_KEY  "log"
+#define PULSAR_GELF_DEFAULT_HOST_KEY           "host"
+#define PULSAR_GELF_DEFAULT_LEVEL_KEY          "level"
+// additional field names, nested keys included, are cut to fit this buffer
+#define PULSAR_GELF_MAX_KEY_LEN                512
+
+// GELF encoder settings, keys refer to top level fields of the record
+struct pulsar_gelf_conf {
+    flb_sds_t short_message_key;
+    flb_sds_t full_message_key;
+    flb_sds_t host_key;
+    flb_sds_t level_key;
+    char hostname[256];   // used when a record has no host field
+    const struct pulsar_projection *projection;   // applied to the additional fields, or NULL
+};
+
+void pulsar_gelf_conf_init(struct pulsar_gelf_conf *conf);
+
+/*
+ * Append the GELF 1.1 message of a record to buf. Every other field of the
+ * record becomes an additional "_field", nested maps are flattened with '_'.
+ * The projection, if any, selects and renames the additional fields.
+ * Returns -1 if the record has no short message or on allocation failure.
+ */
+int pulsar_gelf_write(struct pulsar_buffer *buf, struct pulsar_gelf_conf *conf,
+                      msgpack_object *map, struct flb_time *tm);
@@ -0,0 +1,517 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include <fluent-bit/flb_output_plugin.h>
+
+#include "pulsar_json.h"
+#include "pulsar_projection.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PULSAR_JSON_X86
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/*
+ * A scanner returns the length of the leading run of plain bytes, the ones
+ * copied as they are: printable ASCII but the quote and the backslash.
+ */
+typedef size_t (*json_scan_func)(const unsigned char *str, size_t len);
+
+static inline bool json_plain(unsigned char c)
+{
+    return c >= 0x20 && c < 0x7f && c != '"' && c != '\\';
+}
+
+static size_t json_scan_scalar(const unsigned char *str, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && json_plain(str[i])) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef PULSAR_JSON_X86
+/*
+ * Mask of the bytes to escape among the 16 at str. Bytes are compared as
+ * signed, so the < 0x20 test also catches the ones of 0x80 and above, which
+ * leave the UTF-8 sequences to the scalar code. Inlined, so it is VEX encoded
+ * in the AVX2 scanner and does not pay for SSE/AVX transitions.
+ */
+static inline __attribute__((always_inline)) uint32_t json_escape_mask16(const unsigned char *str)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) str);
+
+    return (uint32_t) _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))));
+}
+
+static size_t json_scan_sse2(const unsigned char *str, size_t len)
+{
+    size_t i;
+    uint32_t mask;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        mask = json_escape_mask16(str + i);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + json_scan_scalar(str + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_avx2(const unsigned char *str, size_t len)
+{
+    size_t i;
+    uint32_t mask;
+    __m256i v;
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (str + i));
+        mask = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash))));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i + 16 <= len) {
+        mask = json_escape_mask16(str + i);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    while (i < len && json_plain(str[i])) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+static const json_scan_func json_scanners[] = {
+    [PULSAR_JSON_ISA_SCALAR] = json_scan_scalar,
+#ifdef PULSAR_JSON_X86
+    [PULSAR_JSON_ISA_SSE2] = json_scan_sse2,
+    [PULSAR_JSON_ISA_AVX2] = json_scan_avx2,
+#endif
+};
+
+static _Atomic(json_scan_func) json_scan;
+
+static bool json_isa_supported(enum pulsar_json_isa isa)
+{
+    switch (isa) {
+    case PULSAR_JSON_ISA_SCALAR:
+        return true;
+#ifdef PULSAR_JSON_X86
+    case PULSAR_JSON_ISA_SSE2:
+        // part of x86-64
+        return true;
+    case PULSAR_JSON_ISA_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+enum pulsar_json_isa pulsar_json_isa(void)
+{
+    if (json_isa_supported(PULSAR_JSON_ISA_AVX2)) {
+        return PULSAR_JSON_ISA_AVX2;
+    }
+    if (json_isa_supported(PULSAR_JSON_ISA_SSE2)) {
+        return PULSAR_JSON_ISA_SSE2;
+    }
+    return PULSAR_JSON_ISA_SCALAR;
+}
+
+const char* pulsar_json_isa_name(enum pulsar_json_isa isa)
+{
+    switch (isa) {
+    case PULSAR_JSON_ISA_SSE2:
+        return "sse2";
+    case PULSAR_JSON_ISA_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+int pulsar_json_use_isa(enum pulsar_json_isa isa)
+{
+    if (!json_isa_supported(isa)) {
+        return -1;
+    }
+    atomic_store_explicit(&json_scan, json_scanners[isa], memory_order_relaxed);
+    return 0;
+}
+
+static inline json_scan_func json_scanner(void)
+{
+    json_scan_func scan = atomic_load_explicit(&json_scan, memory_order_relaxed);
+
+    if (!scan) {
+        // every thread resolves the same scanner, the race is harmless
+        scan = json_scanners[pulsar_json_isa()];
+        atomic_store_explicit(&json_scan, scan, memory_order_relaxed);
+    }
+    return scan;
+}
+
+// number of bytes of an UTF-8 sequence, given its leading byte
+static inline int utf8_sequence_len(unsigned char c)
+{
+    if (c < 0xC0) {
+        return 1;
+    } else if (c < 0xE0) {
+        return 2;
+    } else if (c < 0xF0) {
+        return 3;
+    } else if (c < 0xF8) {
+        return 4;
+    } else if (c < 0xFC) {
+        return 5;
+    }
+    return 6;
+}
+
+int pulsar_json_write_str(struct pulsar_buffer *buf, const char *str, size_t len)
+{
+    size_t i;
+    size_t n;
+    size_t seq_len;
+    unsigned char c;
+    char *p;
+    json_scan_func scan = json_scanner();
+
+    // worst case: every byte becomes a six bytes \u00XX escape
+    if (pulsar_buffer_reserve(buf, len * 6) != 0) {
+        return -1;
+    }
+
+    p = buf->data + buf->size;
+    for (i = 0; i < len; i++) {
+        c = (unsigned char) str[i];
+        if (json_plain(c)) {
+            // copy the whole run of plain bytes up to the next one to escape
+            n = scan((const unsigned char *) str + i, len - i);
+            memcpy(p, str + i, n);
+            p += n;
+            i += n - 1;
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+            *p++ = '\\';
+            *p++ = '"';
+            break;
+        case '\\':
+            *p++ = '\\';
+            *p++ = '\\';
+            break;
+        case '\n':
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+        case '\r':
+            *p++ = '\\';
+            *p++ = 'r';
+            break;
+        case '\t':
+            *p++ = '\\';
+            *p++ = 't';
+            break;
+        case '\b':
+            *p++ = '\\';
+            *p++ = 'b';
+            break;
+        case '\f':
+            *p++ = '\\';
+            *p++ = 'f';
+            break;
+        default:
+            if (c < 0x80) {
+                // other control characters and DEL
+                *p++ = '\\';
+                *p++ = 'u';
+                *p++ = '0';
+                *p++ = '0';
+                *p++ = hex_digits[c >> 4];
+                *p++ = hex_digits[c & 0x0f];
+                break;
+            }
+
+            // multi-byte UTF-8: valid sequences are copied as they are
+            seq_len = utf8_sequence_len(c);
+            if (i + seq_len > len) {
+                // truncated sequence at the end of the string is dropped
+                i = len;
+                break;
+            }
+            if (seq_len == 1) {
+                // stray continuation byte
+                memcpy(p, "\xEF\xBF\xBD", 3);
+                p += 3;
+                break;
+            }
+            for (n = 1; n < seq_len; n++) {
+                if (((unsigned char) str[i + n] & 0xC0) != 0x80) {
+                    break;
+                }
+            }
+            if (n < seq_len) {
+                // broken sequence: replace it and resume at the offending byte
+                memcpy(p, "\xEF\xBF\xBD", 3);
+                p += 3;
+                i += n - 1;
+                break;
+            }
+            memcpy(p, str + i, seq_len);
+            p += seq_len;
+            i += seq_len - 1;
+            break;
+        }
+    }
+
+    buf->size = p - buf->data;
+    return 0;
+}
+
+static int write_fmt(struct pulsar_buffer *buf, const char *fmt, ...)
+{
+    int len;
+    va_list va;
+    char tmp[512];
+
+    va_start(va, fmt);
+    len = vsnprintf(tmp, sizeof(tmp) - 1, fmt, va);
+    va_end(va);
+    if (len < 0) {
+        return -1;
+    }
+    if (len > (int) sizeof(tmp) - 1) {
+        len = sizeof(tmp) - 1;
+    }
+    return pulsar_buffer_append(buf, tmp, len);
+}
+
+// write the digits of v backwards, ending at end, and return where they start
+static char* format_u64(char *end, uint64_t v)
+{
+    uint32_t r;
+
+    while (v >= 100) {
+        r = (uint32_t) (v % 100) * 2;
+        v /= 100;
+        end -= 2;
+        memcpy(end, digit_pairs + r, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, digit_pairs + v * 2, 2);
+    } else {
+        *--end = '0' + (char) v;
+    }
+    return end;
+}
+
+// the integer, then suffix if any, like printf("%"PRIu64"%s") with a leading '-' if negative
+static int write_u64(struct pulsar_buffer *buf, uint64_t v, bool negative, const char *suffix, size_t suffix_len)
+{
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *start = format_u64(end, v);
+
+    if (negative) {
+        *--start = '-';
+    }
+    if (pulsar_buffer_reserve(buf, (end - start) + suffix_len) != 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->size, start, end - start);
+    memcpy(buf->data + buf->size + (end - start), suffix, suffix_len);
+    buf->size += (end - start) + suffix_len;
+    return 0;
+}
+
+static int write_i64(struct pulsar_buffer *buf, int64_t v)
+{
+    // negated as unsigned, INT64_MIN has no positive counterpart
+    return v < 0 ? write_u64(buf, 0 - (uint64_t) v, true, "", 0) : write_u64(buf, (uint64_t) v, false, "", 0);
+}
+
+static int write_double(struct pulsar_buffer *buf, double f)
+{
+    int len;
+
+    if (fabs(f) < 0x1p63) {
+        // integral values print as %.1f, which is their exact integer below 2^63
+        if (f == (double) (int64_t) f) {
+            return write_u64(buf, f < 0 ? 0 - (uint64_t) (int64_t) f : (uint64_t) (int64_t) f,
+                             signbit(f), ".0", 2);
+        }
+    } else if (f == (double) (long long int) f) {
+        return write_fmt(buf, "%.1f", f);
+    }
+
+    // at most 24 bytes, as in -1.234567890123457e-308
+    if (pulsar_buffer_reserve(buf, 32) != 0) {
+        return -1;
+    }
+    len = snprintf(buf->data + buf->size, 32, "%.16g", f);
+    if (len < 0 || len >= 32) {
+        return -1;
+    }
+    buf->size += len;
+    return 0;
+}
+
+static int write_ext(struct pulsar_buffer *buf, const msgpack_object_ext *ext)
+{
+    uint32_t i;
+
+    if (pulsar_buffer_putc(buf, '"') != 0) {
+        return -1;
+    }
+    // same rendering as fluent-bit: every byte as \xNN, sign-extended
+    for (i = 0; i < ext->size; i++) {
+        if (write_fmt(buf, "\\x%02x", (char) ext->ptr[i]) != 0) {
+            return -1;
+        }
+    }
+    return pulsar_buffer_putc(buf, '"');
+}
+
+int pulsar_json_write_object(struct pulsar_buffer *buf, const msgpack_object *o)
+{
+    uint32_t i;
+
+    switch (o->type) {
+    case MSGPACK_OBJECT_NIL:
+        return pulsar_buffer_append(buf, "null", 4);
+    case MSGPACK_OBJECT_BOOLEAN:
+        return o->via.boolean ? pulsar_buffer_append(buf, "true", 4) : pulsar_buffer_append(buf, "false", 5);
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        return write_u64(buf, o->via.u64, false, "", 0);
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return write_i64(buf, o->via.i64);
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+        return write_double(buf, o->via.f64);
+    case MSGPACK_OBJECT_STR:
+        if (pulsar_buffer_putc(buf, '"') != 0
+            || pulsar_json_write_str(buf, o->via.str.ptr, o->via.str.size) != 0) {
+            return -1;
+        }
+        return pulsar_buffer_putc(buf, '"');
+    case MSGPACK_OBJECT_BIN:
+        if (pulsar_buffer_putc(buf, '"') != 0
+            || pulsar_json_write_str(buf, o->via.bin.ptr, o->via.bin.size) != 0) {
+            return -1;
+        }
+        return pulsar_buffer_putc(buf, '"');
+    case MSGPACK_OBJECT_EXT:
+        return write_ext(buf, &o->via.ext);
+    case MSGPACK_OBJECT_ARRAY:
+        if (pulsar_buffer_putc(buf, '[') != 0) {
+            return -1;
+        }
+        for (i = 0; i < o->via.array.size; i++) {
+            if ((i > 0 && pulsar_buffer_putc(buf, ',') != 0)
+                || pulsar_json_write_object(buf, o->via.array.ptr + i) != 0) {
+                return -1;
+            }
+        }
+        return pulsar_buffer_putc(buf, ']');
+    case MSGPACK_OBJECT_MAP:
+        if (pulsar_buffer_putc(buf, '{') != 0) {
+            return -1;
+        }
+        for (i = 0; i < o->via.map.size; i++) {
+            if ((i > 0 && pulsar_buffer_putc(buf, ',') != 0)
+                || pulsar_json_write_object(buf, &o->via.map.ptr[i].key) != 0
+                || pulsar_buffer_putc(buf, ':') != 0
+                || pulsar_json_write_object(buf, &o->via.map.ptr[i].val) != 0) {
+                return -1;
+            }
+        }
+        return pulsar_buffer_putc(buf, '}');
+    default:
+        flb_warn("[out_pulsar] unknown msgpack type %i", (int) o->type);
+        return -1;
+    }
+}
+
+static int write_projected_map(struct pulsar_buffer *buf, const struct pulsar_projection_node *node,
+                               bool inside, const msgpack_object *o)
+{
+    uint32_t i;
+    uint32_t n = 0;
+    bool child_inside;
+    const msgpack_object_kv *kv;
+    const struct pulsar_projection_node *child;
+
+    if (pulsar_buffer_putc(buf, '{') != 0) {
+        return -1;
+    }
+    for (i = 0; i < o->via.map.size; i++) {
+        kv = &o->via.map.ptr[i];
+        if (!pulsar_projection_lookup(node, inside, &kv->key, &kv->val, &child, &child_inside)) {
+            continue;
+        }
+        if (n++ > 0 && pulsar_buffer_putc(buf, ',') != 0) {
+            return -1;
+        }
+        if (child && child->rename) {
+            if (pulsar_buffer_putc(buf, '"') != 0
+                || pulsar_json_write_str(buf, child->rename, flb_sds_len(child->rename)) != 0
+                || pulsar_buffer_putc(buf, '"') != 0) {
+                return -1;
+            }
+        } else if (pulsar_json_write_object(buf, &kv->key) != 0) {
+            return -1;
+        }
+        if (pulsar_buffer_putc(buf, ':') != 0) {
+            return -1;
+        }
+        if (pulsar_projection_descend(child, &kv->val)) {
+            if (write_projected_map(buf, child, child_inside, &kv->val) != 0) {
+                return -1;
+            }
+        } else if (pulsar_json_write_object(buf, &kv->val) != 0) {
+            return -1;
+        }
+    }
+    return pulsar_buffer_putc(buf, '}');
+}
+
+int pulsar_json_write_projected(struct pulsar_buffer *buf, const struct pulsar_projection *proj,
+                                const msgpack_object *map)
+{
+    if (!proj) {
+        return pulsar_json_write_object(buf, map);
+    }
+    if (MSGPACK_OBJECT_MAP != map->type) {
+        return -1;
+    }
+    return write_projected_map(buf, &proj->root, pulsar_projection_root_inside(proj), map);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <msgpack.h>
+
+#include "pulsar_buffer.h"
+
+struct pulsar_projection;
+
+// escape scanners of pulsar_json_write_str(), from the slowest
+enum pulsar_json_isa {
+    PULSAR_JSON_ISA_SCALAR = 0,
+    PULSAR_JSON_ISA_SSE2,
+    PULSAR_JSON_ISA_AVX2,
+};
+
+// the fastest scanner the CPU supports, the one used unless another is forced
+enum pulsar_json_isa pulsar_json_isa(void);
+const char* pulsar_json_isa_name(enum pulsar_json_isa isa);
+// force a scanner, to compare their output; -1 if the CPU lacks it
+int pulsar_json_use_isa(enum pulsar_json_isa isa);
+
+/*
+ * Append the JSON representation of a msgpack object to buf. The output is
+ * byte-for-byte the same as flb_msgpack_to_json(), but it is written straight
+ * from the decoded object, without re-packing the record or allocating an
+ * intermediate SDS string.
+ */
+int pulsar_json_write_object(struct pulsar_buffer *buf, const msgpack_object *o);
+
+/*
+ * Append a JSON string body (without quotes), escaped like flb_utils_write_str().
+ * Runs of bytes that need no escaping are found 16 or 32 at a time with
+ * SSE2/AVX2 where available and copied in bulk.
+ */
+int pulsar_json_write_str(struct pulsar_buffer *buf, const char *str, size_t len);
+
+// like pulsar_json_write_object() for a record map, keeping the projected keys only
+int pulsar_json_write_projected(struct pulsar_buffer *buf, const struct pulsar_projection *proj,
+                                const msgpack_object *map);
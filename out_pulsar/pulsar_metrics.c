@@ -0,0 +1,292 @@
+#include <fluent-bit/flb_output_plugin.h>
+
+#ifdef FLB_HAVE_METRICS
+#include <cmetrics/cmetrics.h>
+#include <cmetrics/cmt_counter.h>
+#include <cmetrics/cmt_gauge.h>
+#include <cmetrics/cmt_histogram.h>
+#endif
+
+#include "pulsar_metrics.h"
+
+#ifdef FLB_HAVE_METRICS
+
+int pulsar_metrics_init(struct pulsar_metrics *m, struct flb_output_instance *ins)
+{
+    uint64_t ts = cfl_time_now();
+    struct cmt_histogram_buckets *buckets;
+
+    memset(m, 0, sizeof(struct pulsar_metrics));
+    pthread_mutex_init(&m->lock, NULL);
+    m->name = (char *) flb_output_name(ins);
+
+    m->records = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "sent_records_total",
+                                    "Number of records acked by the broker.",
+                                    1, (char *[]) {"name"});
+    m->messages = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "sent_messages_total",
+                                     "Number of pulsar messages acked by the broker.",
+                                     1, (char *[]) {"name"});
+    m->bytes = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "sent_bytes_total",
+                                  "Number of payload bytes acked by the broker.",
+                                  1, (char *[]) {"name"});
+    m->failed = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "failed_records_total",
+                                   "Number of records that could not be sent, by result.",
+                                   2, (char *[]) {"name", "result"});
+    m->discarded = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "discarded_records_total",
+                                      "Number of records rejected in the send callback, by result.",
+                                      2, (char *[]) {"name", "result"});
+    m->spilled = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "spilled_records_total",
+                                    "Number of records kept in the spill after a failed send.",
+                                    1, (char *[]) {"name"});
+    m->replayed = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "replayed_records_total",
+                                     "Number of spilled records sent again.",
+                                     1, (char *[]) {"name"});
+    m->dead_letter = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "dead_letter_records_total",
+                                        "Number of rejected records published to the dead-letter topic, by result.",
+                                        2, (char *[]) {"name", "result"});
+    m->inflight = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "inflight_messages",
+                                   "Number of async sends waiting for their callback.",
+                                   1, (char *[]) {"name"});
+    m->inflight_bytes = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "inflight_bytes",
+                                         "Payload bytes of the async sends waiting for their callback.",
+                                         1, (char *[]) {"name"});
+    m->batch_records = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "batch_max_records",
+                                        "Records packed per message, chosen by adaptiveBatching.",
+                                        1, (char *[]) {"name"});
+    m->batch_bytes = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "batch_max_bytes",
+                                      "Payload bytes packed per message, chosen by adaptiveBatching.",
+                                      1, (char *[]) {"name"});
+    m->record_rate = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "record_rate",
+                                      "Records per second measured by adaptiveBatching.",
+                                      1, (char *[]) {"name"});
+    m->cluster_state = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "cluster_state",
+                                        "State of a pulsar cluster: 0 healthy, 1 down, 2 probing.",
+                                        2, (char *[]) {"name", "cluster"});
+    m->zstd_in = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "zstd_input_bytes_total",
+                                    "Number of payload bytes compressed by zstdCompression.",
+                                    1, (char *[]) {"name"});
+    m->zstd_out = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "zstd_output_bytes_total",
+                                     "Number of bytes of the zstd frames made by zstdCompression.",
+                                     1, (char *[]) {"name"});
+    m->pool_hits = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "callback_pool_hits_total",
+                                      "Number of async send contexts taken from the callback pool.",
+                                      1, (char *[]) {"name"});
+    m->pool_misses = cmt_counter_create(ins->cmt, "fluentbit", "pulsar", "callback_pool_misses_total",
+                                        "Number of async send contexts allocated since the callback pool was empty.",
+                                        1, (char *[]) {"name"});
+    m->pool_retained = cmt_gauge_create(ins->cmt, "fluentbit", "pulsar", "callback_pool_retained_bytes",
+                                        "Bytes of the payload buffers kept by the callback pool.",
+                                        1, (char *[]) {"name"});
+
+    buckets = cmt_histogram_buckets_create(13, 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                                           0.5, 1.0, 2.5, 5.0, 10.0, 30.0);
+    m->ack_latency = cmt_histogram_create(ins->cmt, "fluentbit", "pulsar", "ack_latency_seconds",
+                                          "Latency from send to the broker ack.",
+                                          buckets, 1, (char *[]) {"name"});
+
+    if (!m->records || !m->messages || !m->bytes || !m->failed
+        || !m->discarded || !m->spilled || !m->replayed || !m->dead_letter
+        || !m->inflight || !m->inflight_bytes
+        || !m->batch_records || !m->batch_bytes || !m->record_rate || !m->cluster_state
+        || !m->zstd_in || !m->zstd_out || !m->pool_hits || !m->pool_misses || !m->pool_retained
+        || !m->ack_latency) {
+        return -1;
+    }
+
+    // start the fixed series at zero so they are exported before the first send
+    cmt_counter_set(m->records, ts, 0, 1, (char *[]) {m->name});
+    cmt_counter_set(m->messages, ts, 0, 1, (char *[]) {m->name});
+    cmt_counter_set(m->bytes, ts, 0, 1, (char *[]) {m->name});
+    cmt_counter_set(m->spilled, ts, 0, 1, (char *[]) {m->name});
+    cmt_counter_set(m->replayed, ts, 0, 1, (char *[]) {m->name});
+    cmt_gauge_set(m->inflight, ts, 0, 1, (char *[]) {m->name});
+    cmt_gauge_set(m->inflight_bytes, ts, 0, 1, (char *[]) {m->name});
+    return 0;
+}
+
+void pulsar_metrics_destroy(struct pulsar_metrics *m)
+{
+    // the metrics belong to the instance cmt context
+    pthread_mutex_destroy(&m->lock);
+}
+
+void pulsar_metrics_sent(struct pulsar_metrics *m, uint32_t records, size_t bytes, uint64_t send_ns)
+{
+    uint64_t ts = cfl_time_now();
+    double latency = (double) (pulsar_metrics_now_ns() - send_ns) / 1e9;
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->records, ts, records, 1, (char *[]) {m->name});
+    cmt_counter_inc(m->messages, ts, 1, (char *[]) {m->name});
+    cmt_counter_add(m->bytes, ts, bytes, 1, (char *[]) {m->name});
+    cmt_histogram_observe(m->ack_latency, ts, latency, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_failed(struct pulsar_metrics *m, const char *result, uint32_t records)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->failed, ts, records, 2, (char *[]) {m->name, (char *) result});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_discarded(struct pulsar_metrics *m, const char *result, uint32_t records, uint64_t send_ns)
+{
+    uint64_t ts = cfl_time_now();
+    double latency = (double) (pulsar_metrics_now_ns() - send_ns) / 1e9;
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->discarded, ts, records, 2, (char *[]) {m->name, (char *) result});
+    cmt_histogram_observe(m->ack_latency, ts, latency, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_spilled(struct pulsar_metrics *m, uint32_t records)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->spilled, ts, records, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_replayed(struct pulsar_metrics *m, uint32_t records)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->replayed, ts, records, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_dead_letter(struct pulsar_metrics *m, const char *result, uint32_t records)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->dead_letter, ts, records, 2, (char *[]) {m->name, (char *) result});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_inflight(struct pulsar_metrics *m, int delta)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_gauge_add(m->inflight, ts, delta, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_inflight_bytes(struct pulsar_metrics *m, int64_t delta)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_gauge_add(m->inflight_bytes, ts, delta, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_batching(struct pulsar_metrics *m, uint32_t records, uint64_t bytes, double rate)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_gauge_set(m->batch_records, ts, records, 1, (char *[]) {m->name});
+    cmt_gauge_set(m->batch_bytes, ts, bytes, 1, (char *[]) {m->name});
+    cmt_gauge_set(m->record_rate, ts, rate, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_cluster(struct pulsar_metrics *m, const char *cluster, int state)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_gauge_set(m->cluster_state, ts, state, 2, (char *[]) {m->name, (char *) cluster});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_compressed(struct pulsar_metrics *m, size_t in, size_t out)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_add(m->zstd_in, ts, in, 1, (char *[]) {m->name});
+    cmt_counter_add(m->zstd_out, ts, out, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+void pulsar_metrics_pool(struct pulsar_metrics *m, uint64_t hits, uint64_t misses, int64_t retained)
+{
+    uint64_t ts = cfl_time_now();
+
+    pthread_mutex_lock(&m->lock);
+    cmt_counter_set(m->pool_hits, ts, hits, 1, (char *[]) {m->name});
+    cmt_counter_set(m->pool_misses, ts, misses, 1, (char *[]) {m->name});
+    cmt_gauge_set(m->pool_retained, ts, retained, 1, (char *[]) {m->name});
+    pthread_mutex_unlock(&m->lock);
+}
+
+#else
+
+int pulsar_metrics_init(struct pulsar_metrics *m, struct flb_output_instance *ins)
+{
+    memset(m, 0, sizeof(struct pulsar_metrics));
+    return 0;
+}
+
+void pulsar_metrics_destroy(struct pulsar_metrics *m)
+{
+}
+
+void pulsar_metrics_sent(struct pulsar_metrics *m, uint32_t records, size_t bytes, uint64_t send_ns)
+{
+}
+
+void pulsar_metrics_failed(struct pulsar_metrics *m, const char *result, uint32_t records)
+{
+}
+
+void pulsar_metrics_discarded(struct pulsar_metrics *m, const char *result, uint32_t records, uint64_t send_ns)
+{
+}
+
+void pulsar_metrics_spilled(struct pulsar_metrics *m, uint32_t records)
+{
+}
+
+void pulsar_metrics_replayed(struct pulsar_metrics *m, uint32_t records)
+{
+}
+
+void pulsar_metrics_dead_letter(struct pulsar_metrics *m, const char *result, uint32_t records)
+{
+}
+
+void pulsar_metrics_inflight(struct pulsar_metrics *m, int delta)
+{
+}
+
+void pulsar_metrics_inflight_bytes(struct pulsar_metrics *m, int64_t delta)
+{
+}
+
+void pulsar_metrics_batching(struct pulsar_metrics *m, uint32_t records, uint64_t bytes, double rate)
+{
+}
+
+void pulsar_metrics_cluster(struct pulsar_metrics *m, const char *cluster, int state)
+{
+}
+
+void pulsar_metrics_compressed(struct pulsar_metrics *m, size_t in, size_t out)
+{
+}
+
+void pulsar_metrics_pool(struct pulsar_metrics *m, uint64_t hits, uint64_t misses, int64_t retained)
+{
+}
+
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// failure reasons raised by the plugin itself, next to the pulsar_result strings
+#define PULSAR_METRICS_ENCODE_ERROR          "EncodeError"
+#define PULSAR_METRICS_PRODUCER_UNAVAILABLE  "ProducerUnavailable"
+#define PULSAR_METRICS_OUT_OF_MEMORY         "OutOfMemory"
+#define PULSAR_METRICS_TOPIC_UNRESOLVED      "TopicUnresolved"
+#define PULSAR_METRICS_INFLIGHT_BUDGET       "InflightBudget"
+
+struct flb_output_instance;
+struct cmt_counter;
+struct cmt_gauge;
+struct cmt_histogram;
+
+/*
+ * Prometheus metrics of the plugin, registered on the output instance so
+ * they are exported by the fluent-bit HTTP server. Updates come from flush
+ * workers and pulsar callback threads, hence the lock.
+ */
+struct pulsar_metrics {
+    pthread_mutex_t lock;
+    char *name;
+
+    struct cmt_counter *records;
+    struct cmt_counter *messages;
+    struct cmt_counter *bytes;
+    struct cmt_counter *failed;
+    struct cmt_counter *discarded;
+    struct cmt_counter *spilled;
+    struct cmt_counter *replayed;
+    struct cmt_counter *dead_letter;
+    struct cmt_gauge *inflight;
+    struct cmt_gauge *inflight_bytes;
+    struct cmt_gauge *batch_records;
+    struct cmt_gauge *batch_bytes;
+    struct cmt_gauge *record_rate;
+    struct cmt_gauge *cluster_state;
+    struct cmt_counter *zstd_in;
+    struct cmt_counter *zstd_out;
+    struct cmt_counter *pool_hits;
+    struct cmt_counter *pool_misses;
+    struct cmt_gauge *pool_retained;
+    struct cmt_histogram *ack_latency;
+};
+
+static inline uint64_t pulsar_metrics_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int pulsar_metrics_init(struct pulsar_metrics *m, struct flb_output_instance *ins);
+void pulsar_metrics_destroy(struct pulsar_metrics *m);
+
+// a message of `records` records and `bytes` bytes was acked after send_ns
+void pulsar_metrics_sent(struct pulsar_metrics *m, uint32_t records, size_t bytes, uint64_t send_ns);
+// records that could not be handed to the producer
+void pulsar_metrics_failed(struct pulsar_metrics *m, const char *result, uint32_t records);
+// records the broker did not persist, reported by the send callback
+void pulsar_metrics_discarded(struct pulsar_metrics *m, const char *result, uint32_t records, uint64_t send_ns);
+// records kept in the spill instead of failing
+void pulsar_metrics_spilled(struct pulsar_metrics *m, uint32_t records);
+// records of the spill sent again
+void pulsar_metrics_replayed(struct pulsar_metrics *m, uint32_t records);
+// rejected records the dead-letter topic took
+void pulsar_metrics_dead_letter(struct pulsar_metrics *m, const char *result, uint32_t records);
+// messages handed to send_async and not completed yet
+void pulsar_metrics_inflight(struct pulsar_metrics *m, int delta);
+// payload bytes of those messages
+void pulsar_metrics_inflight_bytes(struct pulsar_metrics *m, int64_t delta);
+// packing limits chosen by adaptiveBatching for the measured record rate
+void pulsar_metrics_batching(struct pulsar_metrics *m, uint32_t records, uint64_t bytes, double rate);
+// state of a failover cluster: 0 healthy, 1 down, 2 probing
+void pulsar_metrics_cluster(struct pulsar_metrics *m, const char *cluster, int state);
+// a payload of `in` bytes was compressed by zstdCompression to `out` bytes
+void pulsar_metrics_compressed(struct pulsar_metrics *m, size_t in, size_t out);
+// totals of the callback pool: contexts taken from it or from the heap, and the bytes its buffers keep
+void pulsar_metrics_pool(struct pulsar_metrics *m, uint64_t hits, uint64_t misses, int64_t retained);
@@ -0,0 +1,160 @@
+#include <fluent-bit/flb_output_plugin.h>
+
+#include <pulsar/c/client.h>
+
+#include "pulsar_context.h"
+#include "pulsar_pool.h"
+
+#define POOL_HEAD(tag, index)  (((uint64_t) (tag) << 32) | (uint32_t) (index))
+#define POOL_HEAD_TAG(head)    ((uint32_t) ((head) >> 32))
+#define POOL_HEAD_INDEX(head)  ((uint32_t) (head))
+
+struct pulsar_callback_pool* pulsar_callback_pool_create(uint32_t size)
+{
+    uint32_t i;
+    struct pulsar_callback_pool *pool;
+
+    if (0 == size) {
+        size = PULSAR_POOL_DEFAULT_SIZE;
+    } else if (PULSAR_POOL_MAX_SIZE < size) {
+        size = PULSAR_POOL_MAX_SIZE;
+    }
+
+    pool = flb_calloc(1, sizeof(struct pulsar_callback_pool));
+    if (!pool) {
+        flb_errno();
+        return NULL;
+    }
+
+    pool->slots = flb_calloc(size, sizeof(struct pulsar_callback_ctx));
+    if (!pool->slots) {
+        flb_errno();
+        flb_free(pool);
+        return NULL;
+    }
+    pool->size = size;
+
+    // chain all slots into the free list: 0 -> 1 -> ... -> size - 1
+    for (i = 0; i < size; i++) {
+        pool->slots[i].pool_index = i;
+        atomic_init(&pool->slots[i].pool_next, (i + 1 < size) ? i + 1 : PULSAR_POOL_NIL);
+    }
+    atomic_init(&pool->head, POOL_HEAD(0, 0));
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    atomic_init(&pool->retained, 0);
+    return pool;
+}
+
+void pulsar_callback_pool_destroy(struct pulsar_callback_pool *pool)
+{
+    uint32_t i;
+
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < pool->size; i++) {
+        if (pool->slots[i].payload) {
+            flb_free(pool->slots[i].payload);
+        }
+    }
+    flb_free(pool->slots);
+    flb_free(pool);
+}
+
+static struct pulsar_callback_ctx* pool_pop(struct pulsar_callback_pool *pool)
+{
+    uint32_t index;
+    uint32_t next;
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+
+    do {
+        index = POOL_HEAD_INDEX(head);
+        if (PULSAR_POOL_NIL == index) {
+            return NULL;
+        }
+        next = atomic_load_explicit(&pool->slots[index].pool_next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, POOL_HEAD(POOL_HEAD_TAG(head) + 1, next),
+                                                    memory_order_acq_rel, memory_order_acquire));
+
+    return &pool->slots[index];
+}
+
+static void pool_push(struct pulsar_callback_pool *pool, struct pulsar_callback_ctx *pcctx)
+{
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+    do {
+        atomic_store_explicit(&pcctx->pool_next, POOL_HEAD_INDEX(head), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, POOL_HEAD(POOL_HEAD_TAG(head) + 1, pcctx->pool_index),
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+struct pulsar_callback_ctx* pulsar_callback_pool_get(struct pulsar_callback_pool *pool, size_t len)
+{
+    char *tmp;
+    size_t capacity;
+    struct pulsar_callback_ctx *pcctx;
+
+    pcctx = pool_pop(pool);
+    if (pcctx) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+        pcctx = flb_calloc(1, sizeof(struct pulsar_callback_ctx));
+        if (!pcctx) {
+            flb_errno();
+            return NULL;
+        }
+        pcctx->pool_index = PULSAR_POOL_NIL;
+    }
+
+    if (pcctx->payload_capacity < len) {
+        capacity = pcctx->payload_capacity ? pcctx->payload_capacity : 256;
+        while (capacity < len) {
+            capacity <<= 1;
+        }
+        tmp = flb_realloc(pcctx->payload, capacity);
+        if (!tmp) {
+            flb_errno();
+            pulsar_callback_pool_put(pool, pcctx);
+            return NULL;
+        }
+        if (PULSAR_POOL_NIL != pcctx->pool_index) {
+            atomic_fetch_add_explicit(&pool->retained, (int_fast64_t) (capacity - pcctx->payload_capacity),
+                                      memory_order_relaxed);
+        }
+        pcctx->payload = tmp;
+        pcctx->payload_capacity = capacity;
+    }
+
+    return pcctx;
+}
+
+void pulsar_callback_pool_put(struct pulsar_callback_pool *pool, struct pulsar_callback_ctx *pcctx)
+{
+    pcctx->ctx = NULL;
+    pcctx->msg = NULL;
+    pcctx->flush = NULL;
+    pcctx->topic_producer = NULL;
+
+    if (PULSAR_POOL_NIL == pcctx->pool_index) {
+        if (pcctx->payload) {
+            flb_free(pcctx->payload);
+        }
+        flb_free(pcctx);
+        return;
+    }
+
+    // do not let a few huge records, or a burst of large ones, pin their buffers for the plugin lifetime
+    if (PULSAR_POOL_MAX_PAYLOAD_SIZE < pcctx->payload_capacity
+        || PULSAR_POOL_MAX_RETAINED_SIZE < atomic_load_explicit(&pool->retained, memory_order_relaxed)) {
+        atomic_fetch_sub_explicit(&pool->retained, (int_fast64_t) pcctx->payload_capacity, memory_order_relaxed);
+        flb_free(pcctx->payload);
+        pcctx->payload = NULL;
+        pcctx->payload_capacity = 0;
+    }
+
+    pool_push(pool, pcctx);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#define PULSAR_POOL_NIL               0xffffffffu
+#define PULSAR_POOL_DEFAULT_SIZE      1000
+#define PULSAR_POOL_MAX_SIZE          (1 << 20)
+#define PULSAR_POOL_MAX_PAYLOAD_SIZE  (1 << 20)
+// payload buffers kept by all the slots, larger ones are freed when given back
+#define PULSAR_POOL_MAX_RETAINED_SIZE  (32 << 20)
+
+struct pulsar_callback_ctx;
+
+/*
+ * Fixed size pool of callback contexts for the async send path. Entries are
+ * taken on the flush thread and given back from pulsar callback threads, so
+ * the free list is a lock-free stack whose head carries an ABA tag in its
+ * upper 32 bits. When the pool is exhausted entries come from the heap.
+ * The payload buffers of the slots are reused, as long as they add up to
+ * at most PULSAR_POOL_MAX_RETAINED_SIZE.
+ */
+struct pulsar_callback_pool {
+    struct pulsar_callback_ctx *slots;
+    uint32_t size;
+    _Atomic uint64_t head;
+
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_int_fast64_t retained;   // bytes of the payload buffers of the slots
+};
+
+struct pulsar_callback_pool* pulsar_callback_pool_create(uint32_t size);
+void pulsar_callback_pool_destroy(struct pulsar_callback_pool *pool);
+
+// get a context whose payload buffer can hold at least len bytes
+struct pulsar_callback_ctx* pulsar_callback_pool_get(struct pulsar_callback_pool *pool, size_t len);
+void pulsar_callback_pool_put(struct pulsar_callback_pool *pool, struct pulsar_callback_ctx *pcctx);
@@ -0,0 +1,251 @@
+#include <fluent-bit/flb_output_plugin.h>
+#include <fluent-bit/flb_slist.h>
+
+#include "pulsar_projection.h"
+
+static void node_init(struct pulsar_projection_node *node)
+{
+    memset(node, 0, sizeof(*node));
+    mk_list_init(&node->children);
+}
+
+static void node_free_children(struct pulsar_projection_node *node)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pulsar_projection_node *child;
+
+    mk_list_foreach_safe(head, tmp, &node->children) {
+        child = mk_list_entry(head, struct pulsar_projection_node, _head);
+        mk_list_del(&child->_head);
+        node_free_children(child);
+        flb_sds_destroy(child->name);
+        if (child->rename) {
+            flb_sds_destroy(child->rename);
+        }
+        flb_free(child);
+    }
+}
+
+static struct pulsar_projection_node* node_find(const struct pulsar_projection_node *node,
+                                                const char *name, size_t len)
+{
+    struct mk_list *head;
+    struct pulsar_projection_node *child;
+
+    mk_list_foreach(head, &node->children) {
+        child = mk_list_entry(head, struct pulsar_projection_node, _head);
+        if (flb_sds_len(child->name) == len && 0 == memcmp(child->name, name, len)) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+// node of a dotted key path, created along with its parents
+static struct pulsar_projection_node* node_add_path(struct flb_output_instance *ins,
+                                                   struct pulsar_projection_node *root,
+                                                   const char *path, size_t len, bool include)
+{
+    const char *p = path;
+    const char *end = path + len;
+    const char *dot;
+    struct pulsar_projection_node *node = root;
+    struct pulsar_projection_node *child;
+
+    while (p <= end) {
+        dot = memchr(p, '.', end - p);
+        if (!dot) {
+            dot = end;
+        }
+        if (dot == p) {
+            flb_plg_error(ins, "invalid key path '%.*s'", (int) len, path);
+            return NULL;
+        }
+        if (include) {
+            node->has_include = true;
+        }
+
+        child = node_find(node, p, dot - p);
+        if (!child) {
+            child = flb_malloc(sizeof(struct pulsar_projection_node));
+            if (!child) {
+                flb_errno();
+                return NULL;
+            }
+            node_init(child);
+            child->name = flb_sds_create_len(p, dot - p);
+            if (!child->name) {
+                flb_free(child);
+                return NULL;
+            }
+            mk_list_add(&child->_head, &node->children);
+        }
+        node = child;
+        p = dot + 1;
+    }
+    return node;
+}
+
+struct pulsar_projection* pulsar_projection_create(struct flb_output_instance *ins,
+                                                   struct mk_list *include_keys,
+                                                   struct mk_list *exclude_keys,
+                                                   struct mk_list *rename_keys)
+{
+    const char *sep;
+    struct mk_list *head;
+    struct flb_slist_entry *entry;
+    struct pulsar_projection_node *node;
+    struct pulsar_projection *proj;
+
+    if ((!include_keys || 0 == mk_list_size(include_keys))
+        && (!exclude_keys || 0 == mk_list_size(exclude_keys))
+        && (!rename_keys || 0 == mk_list_size(rename_keys))) {
+        return NULL;
+    }
+
+    proj = flb_malloc(sizeof(struct pulsar_projection));
+    if (!proj) {
+        flb_errno();
+        return NULL;
+    }
+    node_init(&proj->root);
+
+    if (include_keys) {
+        mk_list_foreach(head, include_keys) {
+            entry = mk_list_entry(head, struct flb_slist_entry, _head);
+            node = node_add_path(ins, &proj->root, entry->str, flb_sds_len(entry->str), true);
+            if (!node) {
+                goto error;
+            }
+            node->include = true;
+        }
+    }
+
+    if (exclude_keys) {
+        mk_list_foreach(head, exclude_keys) {
+            entry = mk_list_entry(head, struct flb_slist_entry, _head);
+            node = node_add_path(ins, &proj->root, entry->str, flb_sds_len(entry->str), false);
+            if (!node) {
+                goto error;
+            }
+            node->exclude = true;
+        }
+    }
+
+    // renames are given as path:name, the name replaces the last key of the path
+    if (rename_keys) {
+        mk_list_foreach(head, rename_keys) {
+            entry = mk_list_entry(head, struct flb_slist_entry, _head);
+            sep = strrchr(entry->str, ':');
+            if (!sep || sep == entry->str || '\0' == sep[1]) {
+                flb_plg_error(ins, "invalid rename '%s', expected <key path>:<new name>", entry->str);
+                goto error;
+            }
+            node = node_add_path(ins, &proj->root, entry->str, sep - entry->str, false);
+            if (!node) {
+                goto error;
+            }
+            if (node->rename) {
+                flb_sds_destroy(node->rename);
+            }
+            node->rename = flb_sds_create(sep + 1);
+            if (!node->rename) {
+                goto error;
+            }
+        }
+    }
+
+    return proj;
+
+error:
+    pulsar_projection_destroy(proj);
+    return NULL;
+}
+
+void pulsar_projection_destroy(struct pulsar_projection *proj)
+{
+    if (!proj) {
+        return;
+    }
+    node_free_children(&proj->root);
+    flb_free(proj);
+}
+
+bool pulsar_projection_lookup(const struct pulsar_projection_node *node, bool inside,
+                              const msgpack_object *key, const msgpack_object *val,
+                              const struct pulsar_projection_node **child, bool *child_inside)
+{
+    const struct pulsar_projection_node *c = NULL;
+
+    if (MSGPACK_OBJECT_STR == key->type) {
+        c = node_find(node, key->via.str.ptr, key->via.str.size);
+    }
+
+    *child = c;
+    *child_inside = inside || (c && c->include);
+    if (c && c->exclude) {
+        return false;
+    }
+    if (*child_inside) {
+        return true;
+    }
+    // kept only for the included keys below it, which a non-map value has not
+    return c && c->has_include && MSGPACK_OBJECT_MAP == val->type;
+}
+
+static int pack_map(msgpack_packer *pck, const struct pulsar_projection_node *node, bool inside,
+                    const msgpack_object *map)
+{
+    uint32_t i;
+    uint32_t count = 0;
+    bool child_inside;
+    const msgpack_object_kv *kv;
+    const struct pulsar_projection_node *child;
+
+    // the map header comes first, count the kept entries
+    for (i = 0; i < map->via.map.size; i++) {
+        kv = &map->via.map.ptr[i];
+        if (pulsar_projection_lookup(node, inside, &kv->key, &kv->val, &child, &child_inside)) {
+            count++;
+        }
+    }
+
+    if (0 != msgpack_pack_map(pck, count)) {
+        return -1;
+    }
+    for (i = 0; i < map->via.map.size; i++) {
+        kv = &map->via.map.ptr[i];
+        if (!pulsar_projection_lookup(node, inside, &kv->key, &kv->val, &child, &child_inside)) {
+            continue;
+        }
+        if (child && child->rename) {
+            if (0 != msgpack_pack_str(pck, flb_sds_len(child->rename))
+                || 0 != msgpack_pack_str_body(pck, child->rename, flb_sds_len(child->rename))) {
+                return -1;
+            }
+        } else if (0 != msgpack_pack_object(pck, kv->key)) {
+            return -1;
+        }
+        if (pulsar_projection_descend(child, &kv->val)) {
+            if (0 != pack_map(pck, child, child_inside, &kv->val)) {
+                return -1;
+            }
+        } else if (0 != msgpack_pack_object(pck, kv->val)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pulsar_projection_write_msgpack(struct pulsar_buffer *buf, const struct pulsar_projection *proj,
+                                    const msgpack_object *map)
+{
+    msgpack_packer pck;
+
+    if (MSGPACK_OBJECT_MAP != map->type) {
+        return -1;
+    }
+    msgpack_packer_init(&pck, buf, pulsar_buffer_write);
+    return pack_map(&pck, &proj->root, pulsar_projection_root_inside(proj), map);
+}
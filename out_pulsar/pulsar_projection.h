@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <msgpack.h>
+#include <fluent-bit/flb_sds.h>
+
+#include "pulsar_buffer.h"
+
+struct flb_output_instance;
+
+// a key of the projected record, children are the keys of its nested map
+struct pulsar_projection_node {
+    flb_sds_t name;
+    flb_sds_t rename;      // new name of the key, or NULL
+    bool include;          // the key is kept with all of its value
+    bool exclude;          // the key is dropped, wins over include
+    bool has_include;      // some key below this one is included
+    struct mk_list children;
+    struct mk_list _head;
+};
+
+/*
+ * includeKeys / excludeKeys / renameKeys as a tree of dotted key paths. The
+ * encoders walk it along with the record map, so dropped keys are never
+ * serialized and the record is not re-packed. Without includes every key is
+ * kept; with includes only the included keys and their parents are.
+ */
+struct pulsar_projection {
+    struct pulsar_projection_node root;
+};
+
+struct pulsar_projection* pulsar_projection_create(struct flb_output_instance *ins,
+                                                   struct mk_list *include_keys,
+                                                   struct mk_list *exclude_keys,
+                                                   struct mk_list *rename_keys);
+void pulsar_projection_destroy(struct pulsar_projection *proj);
+
+// keys of the root map are kept unless includeKeys is set
+static inline bool pulsar_projection_root_inside(const struct pulsar_projection *proj)
+{
+    return !proj->root.has_include;
+}
+
+/*
+ * Decide on an entry of a map whose node is `node`, `inside` telling if the map
+ * is included as a whole. Returns false if the entry is dropped. Otherwise
+ * *child is the node of the key (NULL if it has no rule) and *child_inside
+ * tells if its value is kept as a whole.
+ */
+bool pulsar_projection_lookup(const struct pulsar_projection_node *node, bool inside,
+                              const msgpack_object *key, const msgpack_object *val,
+                              const struct pulsar_projection_node **child, bool *child_inside);
+
+// the value of the entry has keys with rules of their own and must be walked
+static inline bool pulsar_projection_descend(const struct pulsar_projection_node *child,
+                                             const msgpack_object *val)
+{
+    return child && MSGPACK_OBJECT_MAP == val->type && mk_list_is_empty((struct mk_list *) &child->children) != 0;
+}
+
+// append the projected msgpack map to buf
+int pulsar_projection_write_msgpack(struct pulsar_buffer *buf, const struct pulsar_projection *proj,
+                                    const msgpack_object *map);
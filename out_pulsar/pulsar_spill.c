@@ -0,0 +1,515 @@
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fluent-bit/flb_output_plugin.h>
+
+#include "pulsar_spill.h"
+
+#define SPILL_MAGIC_VALID     0x50534c32   // "PSL2", record complete
+#define SPILL_MAGIC_CONSUMED  0x50534c30   // "PSL0", record replayed
+
+#define SPILL_BACKOFF_MIN_MS  1000
+#define SPILL_BACKOFF_MAX_MS  30000
+#define SPILL_IDLE_WAIT_MS    1000
+
+/*
+ * record header, followed by topic\0, partition key\0, the properties and the
+ * payload, 8 bytes aligned
+ */
+struct spill_record {
+    uint32_t magic;          // written last, see spill_record_magic()
+    uint32_t payload_len;
+    uint32_t record_count;
+    uint16_t topic_len;      // 0 for the static topic
+    uint16_t key_len;        // 0 without partition key
+    uint32_t properties_len;
+    uint32_t reserved;
+    uint64_t event_time;
+};
+
+#define SPILL_ALIGN(n)  (((n) + 7) & ~((size_t) 7))
+
+static size_t spill_record_size(size_t topic_len, size_t key_len, size_t properties_len, size_t payload_len)
+{
+    return SPILL_ALIGN(sizeof(struct spill_record)
+                       + (topic_len ? topic_len + 1 : 0)
+                       + (key_len ? key_len + 1 : 0)
+                       + properties_len
+                       + payload_len);
+}
+
+static uint32_t spill_record_magic(struct spill_record *rec)
+{
+    return __atomic_load_n(&rec->magic, __ATOMIC_ACQUIRE);
+}
+
+static void spill_segment_path(struct pulsar_spill *spill, uint64_t seq, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%016"PRIx64".seg", spill->path, seq);
+}
+
+static void spill_segment_close(struct pulsar_spill_segment *seg)
+{
+    if (seg->map) {
+        msync(seg->map, seg->size, MS_ASYNC);
+        munmap(seg->map, seg->size);
+        seg->map = NULL;
+    }
+    if (seg->fd >= 0) {
+        close(seg->fd);
+        seg->fd = -1;
+    }
+    seg->size = 0;
+    seg->offset = 0;
+}
+
+// map an existing segment (size 0) or create a new one of the given size
+static int spill_segment_open(struct pulsar_spill *spill, struct pulsar_spill_segment *seg,
+                              uint64_t seq, size_t size)
+{
+    char file[PATH_MAX];
+    struct stat st;
+
+    spill_segment_path(spill, seq, file, sizeof(file));
+    seg->fd = open(file, size ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0640);
+    if (seg->fd < 0) {
+        return -1;
+    }
+
+    if (size) {
+        // sparse file: only the written pages take disk space
+        if (ftruncate(seg->fd, size) != 0) {
+            flb_errno();
+            close(seg->fd);
+            seg->fd = -1;
+            unlink(file);
+            return -1;
+        }
+    } else {
+        if (fstat(seg->fd, &st) != 0 || st.st_size < (off_t) sizeof(struct spill_record)) {
+            close(seg->fd);
+            seg->fd = -1;
+            return -1;
+        }
+        size = st.st_size;
+    }
+
+    seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (MAP_FAILED == seg->map) {
+        flb_errno();
+        seg->map = NULL;
+        close(seg->fd);
+        seg->fd = -1;
+        return -1;
+    }
+    seg->seq = seq;
+    seg->size = size;
+    seg->offset = 0;
+    return 0;
+}
+
+// record at the segment offset, NULL at the end of the written part
+static struct spill_record* spill_segment_record(struct pulsar_spill_segment *seg, uint32_t *magic)
+{
+    struct spill_record *rec;
+
+    if (seg->offset + sizeof(struct spill_record) > seg->size) {
+        return NULL;
+    }
+    rec = (struct spill_record *) (seg->map + seg->offset);
+    *magic = spill_record_magic(rec);
+    if (SPILL_MAGIC_VALID != *magic && SPILL_MAGIC_CONSUMED != *magic) {
+        return NULL;
+    }
+    if (seg->offset + spill_record_size(rec->topic_len, rec->key_len, rec->properties_len, rec->payload_len) > seg->size) {
+        return NULL;
+    }
+    return rec;
+}
+
+static void spill_record_entry(struct spill_record *rec, struct pulsar_spill_entry *entry)
+{
+    char *p = (char *) (rec + 1);
+
+    entry->topic = NULL;
+    entry->topic_len = rec->topic_len;
+    if (rec->topic_len) {
+        entry->topic = p;
+        p += rec->topic_len + 1;
+    }
+    entry->partition_key = NULL;
+    if (rec->key_len) {
+        entry->partition_key = p;
+        p += rec->key_len + 1;
+    }
+    entry->properties = NULL;
+    entry->properties_len = rec->properties_len;
+    if (rec->properties_len) {
+        entry->properties = p;
+        p += rec->properties_len;
+    }
+    entry->event_time = rec->event_time;
+    entry->record_count = rec->record_count;
+    entry->payload = p;
+    entry->payload_len = rec->payload_len;
+}
+
+static void spill_wait(struct pulsar_spill *spill, int ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long) (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&spill->wait_lock);
+    if (!spill->stop) {
+        pthread_cond_timedwait(&spill->wait_cond, &spill->wait_lock, &deadline);
+    }
+    pthread_mutex_unlock(&spill->wait_lock);
+}
+
+static bool spill_stopped(struct pulsar_spill *spill)
+{
+    bool stop;
+
+    pthread_mutex_lock(&spill->wait_lock);
+    stop = spill->stop;
+    pthread_mutex_unlock(&spill->wait_lock);
+    return stop;
+}
+
+/*
+ * Next message to replay, in append order. Finished segments are deleted on
+ * the way. Returns NULL when everything written so far has been replayed.
+ */
+static struct spill_record* spill_next(struct pulsar_spill *spill)
+{
+    char file[PATH_MAX];
+    uint32_t magic;
+    uint64_t write_seq;
+    struct spill_record *rec;
+
+    while (true) {
+        if (!spill->read.map) {
+            write_seq = atomic_load(&spill->write_seq);
+            if (spill->read.seq > write_seq) {
+                return NULL;
+            }
+            if (spill_segment_open(spill, &spill->read, spill->read.seq, 0) != 0) {
+                if (spill->read.seq < write_seq) {
+                    // a gap left by a failed segment creation
+                    spill->read.seq++;
+                    continue;
+                }
+                // the writer did not create it yet
+                return NULL;
+            }
+        }
+
+        rec = spill_segment_record(&spill->read, &magic);
+        if (rec && SPILL_MAGIC_CONSUMED == magic) {
+            // replayed by a previous run
+            spill->read.offset += spill_record_size(rec->topic_len, rec->key_len, rec->properties_len, rec->payload_len);
+            continue;
+        }
+        if (rec) {
+            return rec;
+        }
+
+        // no record here: the segment is finished only once the writer moved past it
+        if (spill->read.seq >= atomic_load(&spill->write_seq)) {
+            return NULL;
+        }
+        // a record may have been appended right before the writer rolled
+        if (spill_segment_record(&spill->read, &magic)) {
+            continue;
+        }
+
+        spill_segment_path(spill, spill->read.seq, file, sizeof(file));
+        spill_segment_close(&spill->read);
+        unlink(file);
+        spill->read.seq++;
+    }
+}
+
+static void *spill_replay_thread(void *data)
+{
+    int ret;
+    int backoff_ms = 0;
+    uint64_t now;
+    uint64_t next_ns = 0;
+    uint64_t interval_ns = 0;
+    size_t size;
+    struct timespec ts;
+    struct spill_record *rec;
+    struct pulsar_spill_entry entry;
+    struct pulsar_spill *spill = data;
+
+    if (0 < spill->replay_rate) {
+        interval_ns = 1000000000ULL / spill->replay_rate;
+    }
+
+    while (!spill_stopped(spill)) {
+        rec = spill_next(spill);
+        if (!rec) {
+            spill_wait(spill, SPILL_IDLE_WAIT_MS);
+            continue;
+        }
+
+        // pace the replay so a recovering broker is not flooded
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        if (next_ns > now) {
+            spill_wait(spill, (int) ((next_ns - now) / 1000000) + 1);
+            continue;
+        }
+        next_ns = now + interval_ns;
+
+        spill_record_entry(rec, &entry);
+        ret = spill->replay(spill->replay_data, &entry);
+        if (ret < 0) {
+            backoff_ms = backoff_ms ? backoff_ms << 1 : SPILL_BACKOFF_MIN_MS;
+            if (backoff_ms > SPILL_BACKOFF_MAX_MS) {
+                backoff_ms = SPILL_BACKOFF_MAX_MS;
+            }
+            spill_wait(spill, backoff_ms);
+            continue;
+        }
+        backoff_ms = 0;
+
+        size = spill_record_size(rec->topic_len, rec->key_len, rec->properties_len, rec->payload_len);
+        __atomic_store_n(&rec->magic, SPILL_MAGIC_CONSUMED, __ATOMIC_RELEASE);
+        spill->read.offset += size;
+        atomic_fetch_sub(&spill->bytes, size);
+    }
+
+    return NULL;
+}
+
+// find the segments of a previous run and the bytes they still hold
+static int spill_recover(struct pulsar_spill *spill, uint64_t *first, uint64_t *next)
+{
+    DIR *dir;
+    uint32_t magic;
+    uint64_t seq;
+    uint64_t min_seq = UINT64_MAX;
+    uint64_t max_seq = 0;
+    char *end;
+    size_t size;
+    struct dirent *de;
+    struct spill_record *rec;
+    struct pulsar_spill_segment seg = { .fd = -1 };
+
+    dir = opendir(spill->path);
+    if (!dir) {
+        flb_errno();
+        return -1;
+    }
+    while ((de = readdir(dir))) {
+        seq = strtoull(de->d_name, &end, 16);
+        if (end == de->d_name || strcmp(end, ".seg") != 0) {
+            continue;
+        }
+        if (seq < min_seq) {
+            min_seq = seq;
+        }
+        if (seq > max_seq) {
+            max_seq = seq;
+        }
+
+        if (spill_segment_open(spill, &seg, seq, 0) != 0) {
+            continue;
+        }
+        while ((rec = spill_segment_record(&seg, &magic))) {
+            size = spill_record_size(rec->topic_len, rec->key_len, rec->properties_len, rec->payload_len);
+            if (SPILL_MAGIC_VALID == magic) {
+                atomic_fetch_add(&spill->bytes, size);
+            }
+            seg.offset += size;
+        }
+        spill_segment_close(&seg);
+    }
+    closedir(dir);
+
+    if (UINT64_MAX == min_seq) {
+        *first = 0;
+        *next = 0;
+    } else {
+        *first = min_seq;
+        *next = max_seq + 1;
+    }
+    return 0;
+}
+
+struct pulsar_spill* pulsar_spill_create(struct flb_output_instance *ins, const char *path,
+                                         size_t segment_size, uint64_t max_bytes, int replay_rate,
+                                         pulsar_spill_replay_func replay, void *replay_data)
+{
+    uint64_t first;
+    uint64_t next;
+    struct pulsar_spill *spill;
+
+    if (mkdir(path, 0750) != 0 && EEXIST != errno) {
+        flb_errno();
+        flb_plg_error(ins, "cannot create spill directory %s", path);
+        return NULL;
+    }
+
+    spill = flb_calloc(1, sizeof(struct pulsar_spill));
+    if (!spill) {
+        flb_errno();
+        return NULL;
+    }
+    spill->path = flb_sds_create(path);
+    if (!spill->path) {
+        flb_free(spill);
+        return NULL;
+    }
+    spill->ins = ins;
+    spill->segment_size = SPILL_ALIGN(segment_size);
+    spill->max_bytes = max_bytes;
+    spill->replay_rate = replay_rate;
+    spill->replay = replay;
+    spill->replay_data = replay_data;
+    spill->write.fd = -1;
+    spill->read.fd = -1;
+    atomic_init(&spill->bytes, 0);
+    pthread_mutex_init(&spill->lock, NULL);
+    pthread_mutex_init(&spill->wait_lock, NULL);
+    pthread_cond_init(&spill->wait_cond, NULL);
+
+    if (spill_recover(spill, &first, &next) != 0) {
+        flb_plg_error(ins, "cannot read spill directory %s", path);
+        pulsar_spill_destroy(spill);
+        return NULL;
+    }
+    spill->read.seq = first;
+    atomic_init(&spill->write_seq, next);
+    if (0 < atomic_load(&spill->bytes)) {
+        flb_plg_info(ins, "%"PRIu64" spilled bytes of a previous run will be replayed",
+                     (uint64_t) atomic_load(&spill->bytes));
+    }
+
+    if (pthread_create(&spill->thread, NULL, spill_replay_thread, spill) != 0) {
+        flb_errno();
+        pulsar_spill_destroy(spill);
+        return NULL;
+    }
+    spill->started = true;
+    return spill;
+}
+
+void pulsar_spill_stop(struct pulsar_spill *spill)
+{
+    if (!spill || !spill->started) {
+        return;
+    }
+
+    pthread_mutex_lock(&spill->wait_lock);
+    spill->stop = true;
+    pthread_cond_signal(&spill->wait_cond);
+    pthread_mutex_unlock(&spill->wait_lock);
+    pthread_join(spill->thread, NULL);
+    spill->started = false;
+}
+
+void pulsar_spill_destroy(struct pulsar_spill *spill)
+{
+    if (!spill) {
+        return;
+    }
+
+    pulsar_spill_stop(spill);
+
+    // segments are kept on disk and replayed by the next run
+    spill_segment_close(&spill->read);
+    spill_segment_close(&spill->write);
+
+    pthread_cond_destroy(&spill->wait_cond);
+    pthread_mutex_destroy(&spill->wait_lock);
+    pthread_mutex_destroy(&spill->lock);
+    flb_sds_destroy(spill->path);
+    flb_free(spill);
+}
+
+int pulsar_spill_append(struct pulsar_spill *spill, struct pulsar_spill_entry *entry)
+{
+    char *p;
+    size_t key_len = entry->partition_key ? strlen(entry->partition_key) : 0;
+    size_t size = spill_record_size(entry->topic_len, key_len, entry->properties_len, entry->payload_len);
+    struct spill_record *rec;
+
+    if (entry->topic_len > UINT16_MAX || key_len > UINT16_MAX
+        || entry->properties_len > UINT32_MAX || entry->payload_len > UINT32_MAX) {
+        return -1;
+    }
+    if (atomic_load(&spill->bytes) + size > spill->max_bytes) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&spill->lock);
+
+    // roll to a new segment, larger than configured for a single huge message
+    if (!spill->write.map || spill->write.offset + size > spill->write.size) {
+        if (spill->write.map) {
+            spill_segment_close(&spill->write);
+            atomic_fetch_add(&spill->write_seq, 1);
+        }
+        if (spill_segment_open(spill, &spill->write, atomic_load(&spill->write_seq),
+                               size > spill->segment_size ? SPILL_ALIGN(size) : spill->segment_size) != 0) {
+            flb_plg_error(spill->ins, "cannot create spill segment in %s", spill->path);
+            // skip the sequence number, the replay thread steps over the gap
+            atomic_fetch_add(&spill->write_seq, 1);
+            pthread_mutex_unlock(&spill->lock);
+            return -1;
+        }
+    }
+
+    rec = (struct spill_record *) (spill->write.map + spill->write.offset);
+    rec->payload_len = entry->payload_len;
+    rec->record_count = entry->record_count;
+    rec->topic_len = entry->topic_len;
+    rec->key_len = key_len;
+    rec->properties_len = entry->properties_len;
+    rec->reserved = 0;
+    rec->event_time = entry->event_time;
+    p = (char *) (rec + 1);
+    if (entry->topic_len) {
+        memcpy(p, entry->topic, entry->topic_len);
+        p[entry->topic_len] = '\0';
+        p += entry->topic_len + 1;
+    }
+    if (key_len) {
+        memcpy(p, entry->partition_key, key_len + 1);
+        p += key_len + 1;
+    }
+    if (entry->properties_len) {
+        memcpy(p, entry->properties, entry->properties_len);
+        p += entry->properties_len;
+    }
+    memcpy(p, entry->payload, entry->payload_len);
+
+    // publish the record to the replay thread once it is complete
+    __atomic_store_n(&rec->magic, SPILL_MAGIC_VALID, __ATOMIC_RELEASE);
+    spill->write.offset += size;
+    atomic_fetch_add(&spill->bytes, size);
+
+    pthread_mutex_unlock(&spill->lock);
+
+    pthread_mutex_lock(&spill->wait_lock);
+    pthread_cond_signal(&spill->wait_cond);
+    pthread_mutex_unlock(&spill->wait_lock);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <fluent-bit/flb_sds.h>
+
+#define PULSAR_SPILL_DEFAULT_SEGMENT_SIZE  "64M"
+#define PULSAR_SPILL_DEFAULT_MAX_SIZE      "1G"
+#define PULSAR_SPILL_DEFAULT_REPLAY_RATE   "500"
+
+struct flb_output_instance;
+
+// a spilled message: the encoded payload and the attributes to send it again
+struct pulsar_spill_entry {
+    const char *topic;           // NUL-terminated, NULL for the static topic
+    size_t topic_len;
+    const char *partition_key;   // NUL-terminated, or NULL
+    uint32_t record_count;
+    const char *properties;      // name\0value\0 pairs, or NULL
+    size_t properties_len;
+    uint64_t event_time;
+    const char *payload;
+    size_t payload_len;
+};
+
+/*
+ * Send a spilled message again. Returns 0 once the broker persisted it, -1 to
+ * retry it later, or 1 to drop a message the broker will never accept.
+ */
+typedef int (*pulsar_spill_replay_func)(void *data, struct pulsar_spill_entry *entry);
+
+struct pulsar_spill_segment {
+    uint64_t seq;
+    int fd;
+    char *map;
+    size_t size;
+    size_t offset;
+};
+
+/*
+ * Append-only log of the messages the broker did not take, kept as mmap'ed
+ * segment files under a directory. A replay thread sends them again in order,
+ * at a capped rate, and deletes a segment once all of its messages are sent.
+ * Segments left by a previous run are replayed as well.
+ */
+struct pulsar_spill {
+    flb_sds_t path;
+    size_t segment_size;
+    uint64_t max_bytes;
+    int replay_rate;
+    struct flb_output_instance *ins;
+
+    // writer side, appends come from flush workers and pulsar callback threads
+    pthread_mutex_t lock;
+    struct pulsar_spill_segment write;
+    atomic_uint_fast64_t write_seq;   // segment being written, may not exist yet
+    atomic_uint_fast64_t bytes;       // bytes of the messages not replayed yet
+
+    // reader side, owned by the replay thread
+    struct pulsar_spill_segment read;
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    bool stop;
+    pulsar_spill_replay_func replay;
+    void *replay_data;
+};
+
+struct pulsar_spill* pulsar_spill_create(struct flb_output_instance *ins, const char *path,
+                                         size_t segment_size, uint64_t max_bytes, int replay_rate,
+                                         pulsar_spill_replay_func replay, void *replay_data);
+// stop the replay, appends are still accepted until destroy
+void pulsar_spill_stop(struct pulsar_spill *spill);
+void pulsar_spill_destroy(struct pulsar_spill *spill);
+
+// returns -1 if the message does not fit in the spill size limit
+int pulsar_spill_append(struct pulsar_spill *spill, struct pulsar_spill_entry *entry);
@@ -0,0 +1,238 @@
+#include <fluent-bit/flb_output_plugin.h>
+#include <fluent-bit/flb_hash_table.h>
+
+#include "pulsar_topic.h"
+
+struct pulsar_topic_map* pulsar_topic_map_create(struct flb_output_instance *ins,
+                                                 pulsar_client_t *client,
+                                                 pulsar_producer_configuration_t *producer_conf,
+                                                 int max_producers, int idle_timeout)
+{
+    struct pulsar_topic_map *map = flb_calloc(1, sizeof(struct pulsar_topic_map));
+    if (!map) {
+        flb_errno();
+        return NULL;
+    }
+
+    map->max_producers = 0 < max_producers ? max_producers : PULSAR_DEFAULT_MAX_TOPIC_PRODUCERS;
+    map->idle_timeout = 0 < idle_timeout ? idle_timeout : PULSAR_DEFAULT_TOPIC_IDLE_TIMEOUT;
+    map->table = flb_hash_table_create(FLB_HASH_TABLE_EVICT_NONE, map->max_producers * 2, -1);
+    if (!map->table) {
+        flb_free(map);
+        return NULL;
+    }
+
+    pthread_mutex_init(&map->lock, NULL);
+    pthread_cond_init(&map->created, NULL);
+    mk_list_init(&map->lru);
+    map->client = client;
+    map->producer_conf = producer_conf;
+    map->ins = ins;
+    return map;
+}
+
+static void topic_producer_free(struct pulsar_topic_producer *entry)
+{
+    if (entry->producer) {
+        pulsar_producer_close(entry->producer);
+        pulsar_producer_free(entry->producer);
+    }
+    flb_sds_destroy(entry->topic);
+    flb_free(entry);
+}
+
+// unlink an entry, the caller holds the lock and closes the producer afterwards
+static void topic_map_unlink(struct pulsar_topic_map *map, struct pulsar_topic_producer *entry)
+{
+    flb_hash_table_del(map->table, entry->topic);
+    mk_list_del(&entry->_head);
+    --map->count;
+}
+
+void pulsar_topic_map_destroy(struct pulsar_topic_map *map)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pulsar_topic_producer *entry;
+
+    if (!map) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &map->lru) {
+        entry = mk_list_entry(head, struct pulsar_topic_producer, _head);
+        mk_list_del(&entry->_head);
+        topic_producer_free(entry);
+    }
+
+    flb_hash_table_destroy(map->table);
+    pthread_cond_destroy(&map->created);
+    pthread_mutex_destroy(&map->lock);
+    flb_free(map);
+}
+
+void pulsar_topic_map_foreach(struct pulsar_topic_map *map, void (*fn)(pulsar_producer_t *, void *), void *data)
+{
+    struct mk_list *head;
+    struct pulsar_topic_producer *entry;
+
+    pthread_mutex_lock(&map->lock);
+    mk_list_foreach(head, &map->lru) {
+        entry = mk_list_entry(head, struct pulsar_topic_producer, _head);
+        if (entry->producer) {
+            fn(entry->producer, data);
+        }
+    }
+    pthread_mutex_unlock(&map->lock);
+}
+
+/*
+ * Collect the producers to close: every idle one, plus the least recently
+ * used ones while a new producer would exceed the cap. Entries with messages
+ * in flight are skipped. Returns the number of entries moved to evicted.
+ */
+static int topic_map_evict(struct pulsar_topic_map *map, struct mk_list *evicted, int need_slot)
+{
+    int n = 0;
+    time_t now = time(NULL);
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pulsar_topic_producer *entry;
+
+    // the list starts with the least recently used entry
+    mk_list_foreach_safe(head, tmp, &map->lru) {
+        entry = mk_list_entry(head, struct pulsar_topic_producer, _head);
+        if (0 < atomic_load(&entry->inflight)) {
+            continue;
+        }
+        if (now - atomic_load(&entry->last_used) >= map->idle_timeout
+            || (need_slot && map->count >= map->max_producers)) {
+            topic_map_unlink(map, entry);
+            mk_list_add(&entry->_head, evicted);
+            ++n;
+        }
+    }
+    return n;
+}
+
+struct pulsar_topic_producer* pulsar_topic_map_acquire(struct pulsar_topic_map *map, const char *topic, size_t len)
+{
+    int id;
+    size_t out_size;
+    void *out_buf = NULL;
+    time_t now = time(NULL);
+    pulsar_result err;
+    pulsar_producer_t *producer = NULL;
+    struct mk_list evicted;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct pulsar_topic_producer *entry = NULL;
+
+    mk_list_init(&evicted);
+    pthread_mutex_lock(&map->lock);
+
+    // a steady set of topics never reaches the eviction of a new one, close the idle producers here
+    if (now != map->last_sweep) {
+        map->last_sweep = now;
+        topic_map_evict(map, &evicted, FLB_FALSE);
+    }
+
+    id = flb_hash_table_get(map->table, topic, len, &out_buf, &out_size);
+    if (0 <= id && out_buf) {
+        entry = out_buf;
+        // counted first, an entry in flight is not evicted while this thread waits
+        atomic_fetch_add(&entry->inflight, 1);
+        atomic_store(&entry->last_used, now);
+        mk_list_del(&entry->_head);
+        mk_list_add(&entry->_head, &map->lru);
+        while (entry->creating) {
+            pthread_cond_wait(&map->created, &map->lock);
+        }
+        if (entry->producer) {
+            pthread_mutex_unlock(&map->lock);
+            goto close_evicted;
+        }
+        if (now < entry->retry_at) {
+            atomic_fetch_sub(&entry->inflight, 1);
+            entry = NULL;
+            pthread_mutex_unlock(&map->lock);
+            goto close_evicted;
+        }
+        // the backoff of a failed creation is over, this thread tries again
+        entry->creating = true;
+        pthread_mutex_unlock(&map->lock);
+        goto create;
+    }
+
+    topic_map_evict(map, &evicted, FLB_TRUE);
+    if (map->count >= map->max_producers) {
+        flb_plg_warn(map->ins, "all %d topic producers are busy, cannot open topic %.*s",
+            map->max_producers, (int) len, topic);
+        pthread_mutex_unlock(&map->lock);
+        goto close_evicted;
+    }
+
+    entry = flb_calloc(1, sizeof(struct pulsar_topic_producer));
+    if (!entry) {
+        flb_errno();
+        pthread_mutex_unlock(&map->lock);
+        goto close_evicted;
+    }
+    entry->topic = flb_sds_create_len(topic, len);
+    if (!entry->topic) {
+        flb_free(entry);
+        entry = NULL;
+        pthread_mutex_unlock(&map->lock);
+        goto close_evicted;
+    }
+    atomic_init(&entry->inflight, 1);
+    atomic_init(&entry->last_used, now);
+    entry->creating = true;
+
+    // value size 0 stores the entry pointer itself
+    if (0 > flb_hash_table_add(map->table, entry->topic, flb_sds_len(entry->topic), entry, 0)) {
+        flb_plg_error(map->ins, "cannot add topic %s to the producer map", entry->topic);
+        topic_producer_free(entry);
+        entry = NULL;
+        pthread_mutex_unlock(&map->lock);
+        goto close_evicted;
+    }
+    mk_list_add(&entry->_head, &map->lru);
+    ++map->count;
+    pthread_mutex_unlock(&map->lock);
+
+create:
+    // the broker lookup may take the operation timeout, the other topics go on meanwhile
+    err = pulsar_client_create_producer(map->client, entry->topic, map->producer_conf, &producer);
+
+    pthread_mutex_lock(&map->lock);
+    entry->creating = false;
+    if (err == pulsar_result_Ok) {
+        entry->producer = producer;
+        flb_plg_info(map->ins, "created producer of topic %s, %d topic producers open", entry->topic, map->count);
+    } else {
+        flb_plg_error(map->ins, "Failed to create pulsar producer of topic %s: %s, retry in %ds",
+                      entry->topic, pulsar_result_str(err), PULSAR_TOPIC_RETRY_BACKOFF);
+        entry->retry_at = time(NULL) + PULSAR_TOPIC_RETRY_BACKOFF;
+        atomic_fetch_sub(&entry->inflight, 1);
+        entry = NULL;
+    }
+    pthread_cond_broadcast(&map->created);
+    pthread_mutex_unlock(&map->lock);
+
+close_evicted:
+    // closing waits for the broker, keep it out of the lock
+    mk_list_foreach_safe(head, tmp, &evicted) {
+        struct pulsar_topic_producer *old = mk_list_entry(head, struct pulsar_topic_producer, _head);
+        mk_list_del(&old->_head);
+        flb_plg_debug(map->ins, "close idle producer of topic %s", old->topic);
+        topic_producer_free(old);
+    }
+    return entry;
+}
+
+void pulsar_topic_map_release(struct pulsar_topic_producer *entry)
+{
+    atomic_store(&entry->last_used, time(NULL));
+    atomic_fetch_sub(&entry->inflight, 1);
+}
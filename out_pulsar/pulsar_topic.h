@@ -0,0 +1,62 @@
+#pragma once
+
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <fluent-bit/flb_sds.h>
+#include <fluent-bit/flb_hash_table.h>
+
+#include <pulsar/c/client.h>
+
+#define PULSAR_DEFAULT_MAX_TOPIC_PRODUCERS   64
+#define PULSAR_DEFAULT_TOPIC_IDLE_TIMEOUT    300
+// seconds a topic whose producer could not be created is failed at once
+#define PULSAR_TOPIC_RETRY_BACKOFF           5
+
+// producer of one topic, created on first use
+struct pulsar_topic_producer {
+    flb_sds_t topic;
+    pulsar_producer_t *producer;  // NULL while created, or after the creation failed
+    bool creating;            // a thread creates the producer out of the lock
+    time_t retry_at;          // failed creation, not tried again before that time
+    atomic_uint inflight;     // messages acquired and not completed yet
+    atomic_llong last_used;
+    struct mk_list _head;     // LRU order, most recently used last
+};
+
+/*
+ * Producers of templated topics. All of them are created on the same client,
+ * looked up by topic name and evicted when idle or when the cap is reached.
+ * An entry is never evicted while it has messages in flight. Producers are
+ * created out of the lock, behind an entry the other threads wait on, so a
+ * slow or failing topic does not hold up the open ones.
+ */
+struct pulsar_topic_map {
+    pthread_mutex_t lock;
+    pthread_cond_t created;   // signaled when a creation ends
+    struct flb_hash_table *table;
+    struct mk_list lru;
+    int count;
+    int max_producers;
+    int idle_timeout;
+    time_t last_sweep;        // idle producers are looked for at most once per second
+
+    pulsar_client_t *client;
+    pulsar_producer_configuration_t *producer_conf;
+    struct flb_output_instance *ins;
+};
+
+struct pulsar_topic_map* pulsar_topic_map_create(struct flb_output_instance *ins,
+                                                 pulsar_client_t *client,
+                                                 pulsar_producer_configuration_t *producer_conf,
+                                                 int max_producers, int idle_timeout);
+void pulsar_topic_map_destroy(struct pulsar_topic_map *map);
+
+// get (or create) the producer of a topic and count one message in flight on it
+struct pulsar_topic_producer* pulsar_topic_map_acquire(struct pulsar_topic_map *map, const char *topic, size_t len);
+// the message acquired on the producer is completed
+void pulsar_topic_map_release(struct pulsar_topic_producer *entry);
+// call fn on every open producer, under the map lock
+void pulsar_topic_map_foreach(struct pulsar_topic_map *map, void (*fn)(pulsar_producer_t *, void *), void *data);
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <fluent-bit/flb_output_plugin.h>
+
+#ifdef PULSAR_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "pulsar_metrics.h"
+#include "pulsar_zstd.h"
+
+#ifdef PULSAR_HAVE_ZSTD
+
+static struct pulsar_zstd_dict* zstd_dict_create(struct pulsar_zstd *z, const char *buf, size_t size)
+{
+    struct pulsar_zstd_dict *dict;
+
+    // consumers find the dictionary of a frame by its id, raw content has none
+    if (0 == ZDICT_getDictID(buf, size)) {
+        flb_plg_error(z->ins, "%s is not a zstd dictionary", z->dict_path);
+        return NULL;
+    }
+
+    dict = flb_calloc(1, sizeof(struct pulsar_zstd_dict));
+    if (!dict) {
+        flb_errno();
+        return NULL;
+    }
+    dict->cdict = ZSTD_createCDict(buf, size, z->level);
+    if (!dict->cdict) {
+        flb_plg_error(z->ins, "cannot load zstd dictionary %s", z->dict_path);
+        flb_free(dict);
+        return NULL;
+    }
+    dict->id = ZDICT_getDictID(buf, size);
+    snprintf(dict->id_str, sizeof(dict->id_str), "%u", dict->id);
+    return dict;
+}
+
+static void zstd_dict_destroy(struct pulsar_zstd_dict *dict)
+{
+    if (dict) {
+        ZSTD_freeCDict(dict->cdict);
+        flb_free(dict);
+    }
+}
+
+// 1 if the file does not exist yet, 0 once the dictionary is loaded, -1 on error
+static int zstd_dict_load(struct pulsar_zstd *z)
+{
+    FILE *fp;
+    size_t len;
+    int ret = -1;
+    struct pulsar_buffer buf = { 0 };
+    struct pulsar_zstd_dict *dict;
+
+    fp = fopen(z->dict_path, "rb");
+    if (!fp) {
+        if (ENOENT == errno) {
+            return 1;
+        }
+        flb_errno();
+        flb_plg_error(z->ins, "cannot open zstd dictionary %s", z->dict_path);
+        return -1;
+    }
+    while (0 == pulsar_buffer_reserve(&buf, 4096)
+           && 0 < (len = fread(buf.data + buf.size, 1, 4096, fp))) {
+        buf.size += len;
+        if (PULSAR_ZSTD_MAX_DICT_SIZE < buf.size) {
+            break;
+        }
+    }
+    if (ferror(fp) || !buf.data) {
+        flb_plg_error(z->ins, "cannot read zstd dictionary %s", z->dict_path);
+    } else if (PULSAR_ZSTD_MAX_DICT_SIZE < buf.size) {
+        flb_plg_error(z->ins, "zstd dictionary %s is larger than %d bytes", z->dict_path, PULSAR_ZSTD_MAX_DICT_SIZE);
+    } else if ((dict = zstd_dict_create(z, buf.data, buf.size))) {
+        atomic_store_explicit(&z->dict, dict, memory_order_release);
+        flb_plg_info(z->ins, "zstd dictionary %s loaded, id %u, %zu bytes", z->dict_path, dict->id, buf.size);
+        ret = 0;
+    }
+    fclose(fp);
+    pulsar_buffer_destroy(&buf);
+    return ret;
+}
+
+// written aside and renamed, so consumers never read a partial dictionary
+static int zstd_dict_save(struct pulsar_zstd *z, const char *buf, size_t size)
+{
+    FILE *fp;
+    int ret = 0;
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", z->dict_path);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        flb_errno();
+        return -1;
+    }
+    if (size != fwrite(buf, 1, size, fp)) {
+        ret = -1;
+    }
+    if (0 != fclose(fp)) {
+        ret = -1;
+    }
+    if (0 == ret && 0 != rename(tmp, z->dict_path)) {
+        ret = -1;
+    }
+    if (0 != ret) {
+        flb_errno();
+        unlink(tmp);
+    }
+    return ret;
+}
+
+static void zstd_samples_free(struct pulsar_zstd *z)
+{
+    pulsar_buffer_destroy(&z->samples);
+    if (z->sample_sizes) {
+        flb_free(z->sample_sizes);
+    }
+    z->sample_sizes = NULL;
+    z->sample_count = 0;
+}
+
+/*
+ * Train the dictionary on the collected samples. The frames made meanwhile
+ * go without dictionary, and still do if the training fails, since consumers
+ * can only decompress with a dictionary written to dict_path.
+ */
+static void *zstd_train_thread(void *data)
+{
+    size_t ret;
+    char *buf;
+    uint64_t start_ns = pulsar_metrics_now_ns();
+    struct pulsar_zstd *z = data;
+    struct pulsar_zstd_dict *dict = NULL;
+
+    buf = flb_malloc(z->dict_size);
+    if (!buf) {
+        flb_errno();
+    } else {
+        ret = ZDICT_trainFromBuffer(buf, z->dict_size, z->samples.data, z->sample_sizes, z->sample_count);
+        if (ZDICT_isError(ret)) {
+            flb_plg_warn(z->ins, "zstd dictionary training on %u records failed: %s, "
+                         "records stay compressed without dictionary", z->sample_count, ZDICT_getErrorName(ret));
+        } else if (0 != zstd_dict_save(z, buf, ret)) {
+            flb_plg_warn(z->ins, "cannot write zstd dictionary %s, records stay compressed without dictionary",
+                         z->dict_path);
+        } else {
+            dict = zstd_dict_create(z, buf, ret);
+        }
+        if (dict) {
+            atomic_store_explicit(&z->dict, dict, memory_order_release);
+            flb_plg_info(z->ins, "zstd dictionary %s trained on %u records in %"PRIu64"ms, id %u, %zu bytes",
+                         z->dict_path, z->sample_count, (pulsar_metrics_now_ns() - start_ns) / 1000000,
+                         dict->id, ret);
+        }
+        flb_free(buf);
+    }
+
+    pthread_mutex_lock(&z->lock);
+    zstd_samples_free(z);
+    atomic_store_explicit(&z->train_state, PULSAR_ZSTD_TRAIN_OFF, memory_order_relaxed);
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+struct pulsar_zstd* pulsar_zstd_create(struct flb_output_instance *ins, int level, const char *dict_path,
+                                       uint32_t train_records, size_t dict_size)
+{
+    int ret;
+    struct pulsar_zstd *z;
+
+    z = flb_calloc(1, sizeof(struct pulsar_zstd));
+    if (!z) {
+        flb_errno();
+        return NULL;
+    }
+    z->ins = ins;
+    z->level = level;
+    z->dict_path = dict_path && 0 < strlen(dict_path) ? dict_path : NULL;
+    z->dict_size = dict_size;
+    z->train_records = train_records;
+    atomic_init(&z->dict, NULL);
+    atomic_init(&z->train_state, PULSAR_ZSTD_TRAIN_OFF);
+    pthread_mutex_init(&z->lock, NULL);
+
+    if (!z->dict_path) {
+        return z;
+    }
+
+    ret = zstd_dict_load(z);
+    if (0 > ret) {
+        pulsar_zstd_destroy(z);
+        return NULL;
+    }
+    if (0 == ret) {
+        return z;
+    }
+
+    // the dictionary file does not exist yet, it is made from the first records
+    if (0 == train_records) {
+        flb_plg_error(ins, "zstd dictionary %s does not exist and training is disabled", z->dict_path);
+        pulsar_zstd_destroy(z);
+        return NULL;
+    }
+    if (dict_size < 256 || PULSAR_ZSTD_MAX_DICT_SIZE < dict_size) {
+        flb_plg_error(ins, "zstd dictionary size must be between 256 and %d bytes", PULSAR_ZSTD_MAX_DICT_SIZE);
+        pulsar_zstd_destroy(z);
+        return NULL;
+    }
+    z->sample_sizes = flb_malloc(train_records * sizeof(size_t));
+    if (!z->sample_sizes) {
+        flb_errno();
+        pulsar_zstd_destroy(z);
+        return NULL;
+    }
+    atomic_store_explicit(&z->train_state, PULSAR_ZSTD_TRAIN_COLLECTING, memory_order_relaxed);
+    flb_plg_info(ins, "zstd dictionary %s will be trained on the first %u records", z->dict_path, train_records);
+    return z;
+}
+
+void pulsar_zstd_destroy(struct pulsar_zstd *z)
+{
+    if (!z) {
+        return;
+    }
+    if (z->training) {
+        pthread_join(z->train_thread, NULL);
+    }
+    zstd_dict_destroy(atomic_load(&z->dict));
+    zstd_samples_free(z);
+    pthread_mutex_destroy(&z->lock);
+    flb_free(z);
+}
+
+void pulsar_zstd_sample(struct pulsar_zstd *z, const char *data, size_t size)
+{
+    if (0 == size || PULSAR_ZSTD_MAX_SAMPLE < size) {
+        return;
+    }
+
+    pthread_mutex_lock(&z->lock);
+    // checked again under the lock, the training may have just started
+    if (!pulsar_zstd_collecting(z) || 0 != pulsar_buffer_append(&z->samples, data, size)) {
+        pthread_mutex_unlock(&z->lock);
+        return;
+    }
+    z->sample_sizes[z->sample_count++] = size;
+
+    if (z->sample_count >= z->train_records
+        || z->samples.size >= z->dict_size * PULSAR_ZSTD_SAMPLES_PER_DICT_BYTE) {
+        // a training takes a while, it is not done by a flush
+        atomic_store_explicit(&z->train_state, PULSAR_ZSTD_TRAIN_RUNNING, memory_order_relaxed);
+        if (0 == pthread_create(&z->train_thread, NULL, zstd_train_thread, z)) {
+            z->training = true;
+        } else {
+            flb_errno();
+            flb_plg_warn(z->ins, "cannot start the zstd dictionary training, records stay compressed without dictionary");
+            zstd_samples_free(z);
+            atomic_store_explicit(&z->train_state, PULSAR_ZSTD_TRAIN_OFF, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&z->lock);
+}
+
+int pulsar_zstd_compress(struct pulsar_zstd *z, void **cctx, struct pulsar_buffer *out,
+                         const char *data, size_t size, const char **dict_id)
+{
+    size_t ret;
+    struct pulsar_zstd_dict *dict;
+
+    if (!*cctx) {
+        *cctx = ZSTD_createCCtx();
+        if (!*cctx) {
+            return -1;
+        }
+    }
+
+    pulsar_buffer_reset(out);
+    if (0 != pulsar_buffer_reserve(out, ZSTD_compressBound(size))) {
+        return -1;
+    }
+
+    dict = atomic_load_explicit(&z->dict, memory_order_acquire);
+    if (dict) {
+        ret = ZSTD_compress_usingCDict(*cctx, out->data, out->capacity, data, size, dict->cdict);
+    } else {
+        ret = ZSTD_compressCCtx(*cctx, out->data, out->capacity, data, size, z->level);
+    }
+    if (ZSTD_isError(ret)) {
+        flb_plg_debug(z->ins, "zstd compression failed: %s", ZSTD_getErrorName(ret));
+        return -1;
+    }
+    // a payload the frame does not make smaller is better sent as it is
+    if (ret >= size) {
+        return -1;
+    }
+    out->size = ret;
+    *dict_id = dict ? dict->id_str : "0";
+    return 0;
+}
+
+void pulsar_zstd_cctx_free(void *cctx)
+{
+    if (cctx) {
+        ZSTD_freeCCtx(cctx);
+    }
+}
+
+#else
+
+struct pulsar_zstd* pulsar_zstd_create(struct flb_output_instance *ins, int level, const char *dict_path,
+                                       uint32_t train_records, size_t dict_size)
+{
+    flb_plg_error(ins, "the plugin is built without zstd, build it with -DPULSAR_ZSTD=On");
+    return NULL;
+}
+
+void pulsar_zstd_destroy(struct pulsar_zstd *z)
+{
+}
+
+void pulsar_zstd_sample(struct pulsar_zstd *z, const char *data, size_t size)
+{
+}
+
+int pulsar_zstd_compress(struct pulsar_zstd *z, void **cctx, struct pulsar_buffer *out,
+                         const char *data, size_t size, const char **dict_id)
+{
+    return -1;
+}
+
+void pulsar_zstd_cctx_free(void *cctx)
+{
+}
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pulsar_buffer.h"
+
+#define PULSAR_ZSTD_DEFAULT_LEVEL          "3"
+#define PULSAR_ZSTD_DEFAULT_TRAIN_RECORDS  "10000"
+#define PULSAR_ZSTD_DEFAULT_DICT_SIZE      "16K"
+// records larger than this teach a dictionary nothing a frame would not find itself
+#define PULSAR_ZSTD_MAX_SAMPLE             (16 * 1024)
+// bytes of samples per byte of dictionary, as the zstd documentation advises
+#define PULSAR_ZSTD_SAMPLES_PER_DICT_BYTE  100
+#define PULSAR_ZSTD_MAX_DICT_SIZE          (1024 * 1024)
+
+struct flb_output_instance;
+
+// a dictionary in use, immutable once published
+struct pulsar_zstd_dict {
+    void *cdict;
+    uint32_t id;
+    char id_str[16];
+};
+
+enum pulsar_zstd_train_state {
+    PULSAR_ZSTD_TRAIN_OFF = 0,
+    PULSAR_ZSTD_TRAIN_COLLECTING,
+    PULSAR_ZSTD_TRAIN_RUNNING,
+};
+
+/*
+ * Payload compression done by the plugin. Frames are made with the
+ * dictionary loaded from `dict_path`, or trained on the first
+ * `train_records` records when that file does not exist yet, and written
+ * there for the consumers. Until a dictionary is trained the frames are
+ * made without one, so the property telling the dictionary id is "0".
+ *
+ * Compression contexts are not thread-safe, every flush arena has its own;
+ * the dictionary is shared read-only, published once with an atomic pointer.
+ */
+struct pulsar_zstd {
+    struct flb_output_instance *ins;
+    int level;
+    const char *dict_path;
+    size_t dict_size;
+    uint32_t train_records;
+
+    _Atomic(struct pulsar_zstd_dict *) dict;
+
+    // samples of the training, collected under the lock
+    atomic_int train_state;
+    pthread_mutex_t lock;
+    pthread_t train_thread;
+    bool training;      // the thread was started, it is joined on destroy
+    struct pulsar_buffer samples;
+    size_t *sample_sizes;
+    uint32_t sample_count;
+};
+
+/*
+ * NULL on error, or when the plugin was built without zstd. `dict_path` is
+ * optional, without it the frames are made without dictionary.
+ */
+struct pulsar_zstd* pulsar_zstd_create(struct flb_output_instance *ins, int level, const char *dict_path,
+                                       uint32_t train_records, size_t dict_size);
+void pulsar_zstd_destroy(struct pulsar_zstd *z);
+
+// an encoded record, kept for the training while it collects samples
+void pulsar_zstd_sample(struct pulsar_zstd *z, const char *data, size_t size);
+
+/*
+ * Compress data into out, with the compression context in *cctx, created on
+ * first use. *dict_id is the id of the dictionary used, "0" for none.
+ */
+int pulsar_zstd_compress(struct pulsar_zstd *z, void **cctx, struct pulsar_buffer *out,
+                         const char *data, size_t size, const char **dict_id);
+void pulsar_zstd_cctx_free(void *cctx);
+
+static inline bool pulsar_zstd_collecting(struct pulsar_zstd *z)
+{
+    return PULSAR_ZSTD_TRAIN_COLLECTING == atomic_load_explicit(&z->train_state, memory_order_relaxed);
+}